@@ -2,6 +2,9 @@
 #include <modules/console.hpp>
 #include <modules/network_settings.hpp>
 #include <modules/drive_stats.hpp>
+#ifdef BASESTATION_VIDEO
+#include <modules/video_viewer.hpp>
+#endif
 #include <modules/input_config/controller_config.hpp>
 #include <controls/lua_ctrl_lib.hpp>
 
@@ -148,6 +151,30 @@ void Basestation::read_settings(const boost::property_tree::ptree& settings_tree
 
 	}	// end network settings
 
+#ifdef BASESTATION_VIDEO
+	// video feed settings
+	// Defaults match the rover's video program (cfg/video_config.json: video.network.stream_ip, command_ip, and announce_port)
+	{
+		bool enable = settings_tree.get<bool>("network.video_feed.enable", true);
+		auto ip = settings_tree.get<std::string>("network.video_feed.addr", "239.255.123.123");
+		auto port = settings_tree.get<uint16_t>("network.video_feed.port", 22202);
+		m_video_feed.set_decode_threads(settings_tree.get<unsigned>("network.video_feed.decode_threads", m_video_feed.decode_threads()));
+		m_video_feed.set_announce_port(settings_tree.get<uint16_t>("network.video_feed.announce_port", m_video_feed.announce_port()));
+		m_video_feed.set_command_port(settings_tree.get<uint16_t>("network.video_feed.command_port", m_video_feed.command_port()));
+		m_video_feed.set_still_directory(settings_tree.get<std::string>("network.video_feed.still_directory", m_video_feed.still_directory()));
+
+		try {
+			boost::asio::ip::udp::endpoint feed_ep(boost::asio::ip::address_v4::from_string(ip), port);
+			m_video_feed.set_feed_endpoint(feed_ep);
+			if (enable) {
+				m_video_feed.open(feed_ep);
+			}
+		} catch (const boost::system::system_error& err) {
+			std::cerr << "Invalid video feed IP address: " << ip << " (" << err.what() << ")\n";
+		}
+	}	// end video feed settings
+#endif
+
 }
 
 void Basestation::write_settings(boost::property_tree::ptree& to) {
@@ -171,6 +198,20 @@ void Basestation::write_settings(boost::property_tree::ptree& to) {
 			network_cfg.add_child("subsystem_endpoint", subsys_ep_cfg);
 		}
 		network_cfg.put("movement_interval_ms", m_remote_drive.get_interval());
+#ifdef BASESTATION_VIDEO
+		{
+			boost::property_tree::ptree video_feed_cfg;
+			video_feed_cfg.put("port", m_video_feed.feed_endpoint().port());
+			video_feed_cfg.put("addr", m_video_feed.feed_endpoint().address().to_string());
+			video_feed_cfg.put("enable", m_video_feed.opened());
+			video_feed_cfg.put("decode_threads", m_video_feed.decode_threads());
+			video_feed_cfg.put("announce_port", m_video_feed.announce_port());
+			video_feed_cfg.put("command_port", m_video_feed.command_port());
+			video_feed_cfg.put("still_directory", m_video_feed.still_directory());
+
+			network_cfg.add_child("video_feed", video_feed_cfg);
+		}
+#endif
 
 		to.add_child("network", network_cfg);
 	}
@@ -278,6 +319,8 @@ int Basestation::lua_basestation_lib::open_module(lua_State* L) {
 		act = 3;
 	} else if (strcmp("drive", name) == 0) {
 		act = 4;
+	} else if (strcmp("video", name) == 0) {
+		act = 5;
 	}
 	if (act != 0) {
 		Basestation::async([act](Basestation& bs) {
@@ -296,6 +339,11 @@ int Basestation::lua_basestation_lib::open_module(lua_State* L) {
 				case 4:
 					wnd = new gui::DriveStats(s);
 					break;
+#ifdef BASESTATION_VIDEO
+				case 5:
+					wnd = new gui::VideoViewer(s);
+					break;
+#endif
 			}
 			if (wnd != nullptr) {
 				wnd->center();
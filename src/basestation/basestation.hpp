@@ -12,6 +12,9 @@
 #include <basestation_screen.hpp>
 #include <controls/controller_manager.hpp>
 #include <controls/drive_input.hpp>
+#ifdef BASESTATION_VIDEO
+#include <video/video_feed.hpp>
+#endif
 
 /*
 	Container class for the main instance of the base station
@@ -54,6 +57,11 @@ class Basestation {
 		inline rc::Sensor& remote_sensors() {
 			return m_remote_sensors;
 		}
+#ifdef BASESTATION_VIDEO
+		inline VideoFeed& video_feed() {
+			return m_video_feed;
+		}
+#endif
 
 		void schedule(const std::function<void(Basestation&)>& callback);
 		
@@ -84,6 +92,9 @@ class Basestation {
 		net::MessageReceiver m_subsystem_feed;
 		DriveInput m_remote_drive;
 		rc::Sensor m_remote_sensors;
+#ifdef BASESTATION_VIDEO
+		VideoFeed m_video_feed;
+#endif
 
 		event::Handler log_feed_error;
 		event::Handler log_sender_error;
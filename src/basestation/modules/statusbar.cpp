@@ -10,6 +10,9 @@
 #include <modules/network_settings.hpp>
 #include <modules/electrical_info.hpp>
 #include <modules/drive_stats.hpp>
+#ifdef BASESTATION_VIDEO
+#include <modules/video_viewer.hpp>
+#endif
 #include <modules/input_config/controller_config.hpp>
 
 gui::Statusbar::Statusbar(nanogui::Widget* parent) : gui::Toolbar(parent) {
@@ -29,6 +32,16 @@ gui::Statusbar::Statusbar(nanogui::Widget* parent) : gui::Toolbar(parent) {
 			wnd->center();
 		});
 	}
+#ifdef BASESTATION_VIDEO
+	{
+		auto video_button = new nanogui::ToolButton(right_tray(), FA_VIDEO);
+		video_button->set_flags(nanogui::Button::NormalButton);
+		video_button->set_callback([this] {
+			auto wnd = new gui::VideoViewer(screen());
+			wnd->center();
+		});
+	}
+#endif
 	{
 		battery_button = new nanogui::ToolButton(right_tray(), FA_BATTERY_FULL);
 		battery_button->set_flags(nanogui::Button::NormalButton);
@@ -0,0 +1,286 @@
+#include <modules/video_viewer.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <iomanip>
+
+#include <basestation.hpp>
+#include <nanogui/nanogui.h>
+#include <nanogui/opengl.h>
+#include <widgets/layouts/simple_row.hpp>
+#include <widgets/layouts/simple_column.hpp>
+
+gui::VideoViewer::Display::Display(VideoViewer* viewer) : nanogui::Widget(viewer), viewer(viewer) {}
+
+void gui::VideoViewer::Display::draw(NVGcontext* ctx) {
+	nanogui::Widget::draw(ctx);
+
+	if (viewer->texture == 0) {
+		nvgFontSize(ctx, 18.0F);
+		nvgFontFace(ctx, "sans");
+		nvgFillColor(ctx, m_theme->m_disabled_text_color);
+		nvgTextAlign(ctx, NVG_ALIGN_CENTER | NVG_ALIGN_MIDDLE);
+		nvgText(ctx, m_pos.x() + m_size.x() * 0.5F, m_pos.y() + m_size.y() * 0.5F, "No video", nullptr);
+		return;
+	}
+
+	float x, y, w, h;
+	image_rect(x, y, w, h);
+	NVGpaint paint = nvgImagePattern(ctx, x, y, w, h, 0.0F, viewer->texture, 1.0F);
+	nvgBeginPath(ctx);
+	nvgRect(ctx, x, y, w, h);
+	nvgFillPaint(ctx, paint);
+	nvgFill(ctx);
+
+	if (selecting) {
+		nvgBeginPath(ctx);
+		nvgRect(ctx, std::min(select_start.x(), select_end.x()), std::min(select_start.y(), select_end.y()),
+			std::abs(select_end.x() - select_start.x()), std::abs(select_end.y() - select_start.y()));
+		nvgStrokeColor(ctx, nvgRGBA(255, 255, 0, 255));
+		nvgStrokeWidth(ctx, 1.0F);
+		nvgStroke(ctx);
+	}
+}
+
+bool gui::VideoViewer::Display::mouse_button_event(const nanogui::Vector2i& p, int button, bool down, int modifiers) {
+	float x, y, w, h;
+	if (down && button == GLFW_MOUSE_BUTTON_1 && image_rect(x, y, w, h)) {
+		float fx = (p.x() - x) / w;
+		float fy = (p.y() - y) / h;
+		if (fx >= 0.0F && fx < 1.0F && fy >= 0.0F && fy < 1.0F && viewer->select_tile(fx, fy))
+			return true;
+	}
+	if (button == GLFW_MOUSE_BUTTON_2 && (!down || image_rect(x, y, w, h))) {
+		if (down) {
+			selecting = true;
+			select_start = select_end = p;
+		} else if (selecting) {
+			select_end = p;
+			finish_selection();
+		}
+		return true;
+	}
+	return nanogui::Widget::mouse_button_event(p, button, down, modifiers);
+}
+
+bool gui::VideoViewer::Display::mouse_drag_event(const nanogui::Vector2i& p, const nanogui::Vector2i& rel, int button, int modifiers) {
+	if (selecting) {
+		select_end = p;
+		return true;
+	}
+	return nanogui::Widget::mouse_drag_event(p, rel, button, modifiers);
+}
+
+void gui::VideoViewer::Display::finish_selection() {
+	selecting = false;
+	float x, y, w, h;
+	if (!image_rect(x, y, w, h))
+		return;
+
+	float left = std::clamp((std::min(select_start.x(), select_end.x()) - x) / w, 0.0F, 1.0F);
+	float right = std::clamp((std::max(select_start.x(), select_end.x()) - x) / w, 0.0F, 1.0F);
+	float top = std::clamp((std::min(select_start.y(), select_end.y()) - y) / h, 0.0F, 1.0F);
+	float bottom = std::clamp((std::max(select_start.y(), select_end.y()) - y) / h, 0.0F, 1.0F);
+	// A click without a drag selects nothing, which shows the whole frame
+	constexpr float min_drag = 4.0F;
+	if ((right - left) * w < min_drag || (bottom - top) * h < min_drag) {
+		left = right = top = bottom = 0.0F;
+	}
+	viewer->select_region(left, top, right, bottom);
+}
+
+bool gui::VideoViewer::Display::image_rect(float& x, float& y, float& w, float& h) const {
+	if (viewer->texture == 0)
+		return false;
+
+	float scale = std::min(m_size.x() / static_cast<float>(viewer->texture_width), m_size.y() / static_cast<float>(viewer->texture_height));
+	w = viewer->texture_width * scale;
+	h = viewer->texture_height * scale;
+	x = m_pos.x() + (m_size.x() - w) * 0.5F;
+	y = m_pos.y() + (m_size.y() - h) * 0.5F;
+	return true;
+}
+
+gui::VideoViewer::VideoViewer(nanogui::Widget* parent, int stream_index) :
+	gui::Window(parent, "Video", true),
+	feed(Basestation::get().video_feed()),
+	stream(std::clamp(stream_index, 0, VideoFeed::MAX_STREAMS - 1)) {
+
+	set_layout(new gui::SimpleColumnLayout(margin, margin, margin, gui::SimpleColumnLayout::HorizontalAnchor::STRETCH));
+
+	auto controls = new nanogui::Widget(this);
+	controls->set_layout(new gui::SimpleRowLayout(0, margin));
+	controls->set_fixed_height(row_height);
+
+	new nanogui::Label(controls, "Stream");
+
+	stream_box = new nanogui::IntBox<int>(controls, stream);
+	stream_box->set_editable(true);
+	stream_box->set_spinnable(true);
+	stream_box->set_min_max_values(0, VideoFeed::MAX_STREAMS - 1);
+	stream_box->set_fixed_width(60);
+	stream_box->set_fixed_height(row_height);
+	stream_box->set_callback([this](int new_stream) {
+		set_stream(new_stream);
+	});
+
+	still_button = new nanogui::Button(controls, "Still");
+	still_button->set_fixed_height(row_height);
+	still_button->set_callback([this]() {
+		feed.capture_still(stream);
+	});
+
+	info_label = new nanogui::Label(controls, "");
+
+	// No fixed size: the display takes all remaining space in the window
+	display = new Display(this);
+
+	set_size(nanogui::Vector2i(480, 340));
+	parent->perform_layout(screen()->nvg_context());
+
+	feed.watch(stream);
+	next_info_update = std::chrono::steady_clock::now();
+	update_info();
+}
+
+gui::VideoViewer::~VideoViewer() {
+	// Other viewers of the stream expect the whole frame
+	if (region.enabled)
+		feed.set_region_of_interest(stream, VideoFeed::RegionOfInterest());
+	feed.unwatch(stream);
+	if (texture != 0) {
+		nvgDeleteImage(texture_ctx, texture);
+	}
+}
+
+void gui::VideoViewer::set_stream(int new_stream) {
+	if (new_stream == stream)
+		return;
+
+	if (region.enabled)
+		feed.set_region_of_interest(stream, VideoFeed::RegionOfInterest());
+	feed.unwatch(stream);
+	stream = new_stream;
+	feed.watch(stream);
+
+	// Keep the texture until the new stream's first frame replaces it, but restart the counters
+	region = VideoFeed::RegionOfInterest();
+	requested_size = 0;
+	shown_sequence = 0;
+	frames_shown = 0;
+	frames_skipped = 0;
+}
+
+bool gui::VideoViewer::select_tile(float x, float y) {
+	VideoFeed::StreamInfo mosaic;
+	if (!feed.stream_info(stream, mosaic) || mosaic.tile_columns <= 0)
+		return false;
+
+	int columns = mosaic.tile_columns;
+	int rows = (static_cast<int>(mosaic.tiles.size()) + columns - 1) / columns;
+	std::size_t tile = static_cast<std::size_t>(y * rows) * columns + static_cast<std::size_t>(x * columns);
+	if (tile >= mosaic.tiles.size())
+		return false;
+
+	int camera = mosaic.tiles[tile];
+	VideoFeed::StreamInfo camera_info;
+	bool focused = feed.stream_info(camera, camera_info) && camera_info.focused;
+	feed.focus(focused ? -1 : camera);
+	return true;
+}
+
+void gui::VideoViewer::select_region(float left, float top, float right, float bottom) {
+	// A mosaic is made on the video server, so there is nothing to crop
+	VideoFeed::StreamInfo stream_info;
+	if (feed.stream_info(stream, stream_info) && stream_info.tile_columns > 0)
+		return;
+
+	if (right <= left || bottom <= top) {
+		region = VideoFeed::RegionOfInterest();
+	} else {
+		// The image already shows the current region, so the selection narrows it.
+		// The server widens crops to whole JPEG blocks, which makes repeated crops drift by a few pixels
+		region.x += left * region.width;
+		region.y += top * region.height;
+		region.width *= right - left;
+		region.height *= bottom - top;
+		region.enabled = true;
+	}
+	feed.set_region_of_interest(stream, region);
+}
+
+void gui::VideoViewer::upload_image(NVGcontext* ctx) {
+	if (!feed.take_latest_image(stream, image))
+		return;
+
+	if (texture != 0 && (image.width != texture_width || image.height != texture_height)) {
+		nvgDeleteImage(ctx, texture);
+		texture = 0;
+	}
+	if (texture == 0) {
+		texture = nvgCreateImageRGBA(ctx, image.width, image.height, 0, image.pixels.data());
+		texture_ctx = ctx;
+		texture_width = image.width;
+		texture_height = image.height;
+	} else {
+		nvgUpdateImage(ctx, texture, image.pixels.data());
+	}
+
+	// Sequence gaps are frames that completed but were replaced before they could be shown
+	if (shown_sequence != 0 && image.sequence > shown_sequence + 1) {
+		frames_skipped += image.sequence - shown_sequence - 1;
+	}
+	shown_sequence = image.sequence;
+	frames_shown++;
+}
+
+void gui::VideoViewer::update_info() {
+	auto now = std::chrono::steady_clock::now();
+	if (now < next_info_update)
+		return;
+
+	std::stringstream info_ss;
+	VideoFeed::StreamInfo stream_info;
+	if (!feed.opened()) {
+		info_ss << "Video feed is not open";
+	} else if (!feed.stream_info(stream, stream_info)) {
+		info_ss << "No camera on this stream";
+	} else {
+		info_ss << stream_info.name;
+		if (stream_info.focused)
+			info_ss << " (focus)";
+		if (region.enabled)
+			info_ss << " (cropped)";
+		info_ss << ": " << frames_shown << " fps";
+		if (frames_skipped > 0)
+			info_ss << ", " << frames_skipped << " skipped";
+		if (texture != 0)
+			info_ss << " (" << texture_width << "x" << texture_height << ")";
+	}
+	// Downloads of this stream's stills
+	for (const VideoFeed::StillStatus& still : feed.stills()) {
+		if (still.stream == stream && still.received < still.size)
+			info_ss << ", still " << 100 * static_cast<uint64_t>(still.received) / still.size << "%";
+	}
+	info_label->set_caption(info_ss.str());
+
+	frames_shown = 0;
+	frames_skipped = 0;
+	next_info_update = now + std::chrono::seconds(1);
+}
+
+void gui::VideoViewer::draw(NVGcontext* ctx) {
+	// Decode only as much resolution as the display can show
+	float ratio = screen()->pixel_ratio();
+	nanogui::Vector2i display_size(static_cast<int>(display->width() * ratio), static_cast<int>(display->height() * ratio));
+	if (display_size != requested_size) {
+		feed.set_display_size(stream, display_size.x(), display_size.y());
+		requested_size = display_size;
+	}
+
+	upload_image(ctx);
+	update_info();
+
+	gui::Window::draw(ctx);
+}
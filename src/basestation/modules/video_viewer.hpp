@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+
+#include <widgets/window.hpp>
+#include <video/video_feed.hpp>
+
+#include <nanogui/widget.h>
+#include <nanogui/textbox.h>
+#include <nanogui/label.h>
+#include <nanogui/button.h>
+
+namespace gui {
+
+/*
+	Shows one stream of the rover's video feed
+
+	Decoding happens on VideoFeed's threads. Each redraw uploads the newest decoded frame, if any, to a texture.
+	Clicking a camera in the video server's mosaic focuses it, and clicking the focused camera unfocuses it.
+	Dragging with the right button crops the stream to the selected region, and a right click shows the whole frame again.
+	The still button takes a full resolution still of the stream, which is downloaded in the background
+*/
+class VideoViewer : public gui::Window {
+	public:
+		VideoViewer(nanogui::Widget* parent, int stream_index = 0);
+		~VideoViewer();
+
+		virtual void draw(NVGcontext* ctx) override;
+
+	private:
+		// Draws the texture, letterboxed to keep the frame's aspect ratio
+		class Display : public nanogui::Widget {
+			public:
+				Display(VideoViewer* viewer);
+				virtual void draw(NVGcontext* ctx) override;
+				virtual bool mouse_button_event(const nanogui::Vector2i& p, int button, bool down, int modifiers) override;
+				virtual bool mouse_drag_event(const nanogui::Vector2i& p, const nanogui::Vector2i& rel, int button, int modifiers) override;
+			private:
+				VideoViewer* viewer;
+
+				// Corners of the region being dragged out with the right button
+				bool selecting = false;
+				nanogui::Vector2i select_start;
+				nanogui::Vector2i select_end;
+				void finish_selection();
+
+				// Where the texture is drawn, relative to the parent. Returns false if there is no texture
+				bool image_rect(float& x, float& y, float& w, float& h) const;
+		};
+
+		constexpr static int row_height = 26;
+		constexpr static int margin = 4;
+
+		VideoFeed& feed;
+		int stream;
+
+		nanogui::IntBox<int>* stream_box;
+		nanogui::Button* still_button;
+		nanogui::Label* info_label;
+		Display* display;
+
+		// Most recent frame, and its texture (0 before the first frame)
+		VideoFeed::Image image;
+		NVGcontext* texture_ctx = nullptr;
+		int texture = 0;
+		int texture_width = 0;
+		int texture_height = 0;
+
+		// Displayed and skipped frames since the info label was last updated
+		unsigned frames_shown = 0;
+		unsigned frames_skipped = 0;
+		uint32_t shown_sequence = 0;
+		// Display size last given to the feed, in pixels
+		nanogui::Vector2i requested_size = 0;
+		std::chrono::steady_clock::time_point next_info_update;
+		// Region of the camera frame this viewer last asked for
+		VideoFeed::RegionOfInterest region;
+
+		void set_stream(int new_stream);
+		// Focus the camera in the mosaic tile at this fraction of the image's width and height
+		bool select_tile(float x, float y);
+		// Crop the stream to this part of the image, in fractions of its width and height. An empty region shows the whole frame
+		void select_region(float left, float top, float right, float bottom);
+		void upload_image(NVGcontext* ctx);
+		void update_info();
+
+};
+
+}
@@ -0,0 +1,568 @@
+#include <video/video_feed.hpp>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include <rover_system_messages.hpp>
+
+// Minimum time between refresh requests for a stream. Long enough for the refreshed frame to arrive
+static const std::chrono::milliseconds REFRESH_REQUEST_INTERVAL(500);
+// Stills are asked for in runs of STILL_REQUEST_CHUNKS chunks of STILL_CHUNK_SIZE bytes. Chunks must fit in one message
+static const uint32_t STILL_CHUNK_SIZE = 1024;
+static const uint32_t STILL_REQUEST_CHUNKS = 64;
+// A run that has not progressed for this long is asked for again, from its first missing chunk
+static const std::chrono::milliseconds STILL_STALL_TIMEOUT(1000);
+static const std::chrono::milliseconds STILL_REQUEST_INTERVAL(250);
+
+// Named like the video server's copy, which includes the capture time, so a video server that
+// starts numbering its stills again is not mistaken for one that sent them before
+static std::string still_file_name(const VideoFeed::StillStatus& still) {
+	char name[64];
+	std::snprintf(name, sizeof(name), "still_%" PRIu32 "_%d_%" PRIu64 ".jpg", still.id, still.stream, still.capture_time);
+	return name;
+}
+
+VideoFeed::VideoFeed() : receiver(net_ctx), announcements(net_ctx), commands(net_ctx), still_timer(net_ctx) {
+	decode_thread_count = std::clamp(std::thread::hardware_concurrency() / 2, 1U, 4U);
+
+	// Runs on the network thread: only note the work, decoders fetch the frame themselves
+	receiver.on_frame_received([this](int stream, net::Frame&) {
+		if (stream < 0 || stream >= MAX_STREAMS)
+			return;
+		{
+			std::lock_guard lock(work_lock);
+			if (streams[stream].viewers == 0)
+				return;
+			streams[stream].pending = true;
+		}
+		work_ready.notify_one();
+	});
+
+	announcements.register_handler<video_msg::StreamAnnouncement>([this](const uint8_t buf[], std::size_t len) {
+		video::StreamAnnouncement msg;
+		if (!msg.ParseFromArray(buf, len))
+			return;
+
+		video_server = announcements.remote_sender().address();
+
+		bool announced[MAX_STREAMS] = {};
+		{
+			std::lock_guard lock(work_lock);
+			for (const video::StreamInfo& s : msg.streams()) {
+				if (s.stream() >= static_cast<unsigned>(MAX_STREAMS))
+					continue;
+				StreamInfo& info = streams[s.stream()].info;
+				info.name = s.name();
+				info.hardware_location = s.hardware_location();
+				info.width = s.width();
+				info.height = s.height();
+				info.fps = s.fps();
+				info.focused = s.focused();
+				info.tiles.assign(s.tiles().begin(), s.tiles().end());
+				info.tile_columns = s.tile_columns();
+				announced[s.stream()] = true;
+			}
+			for (int i = 0; i < MAX_STREAMS; i++) {
+				streams[i].announced = announced[i];
+			}
+		}
+		for (int i = 0; i < MAX_STREAMS; i++) {
+			update_receiver(i);
+		}
+		add_stills(msg);
+	});
+
+	announcements.register_handler<video_msg::StillChunk>([this](const uint8_t buf[], std::size_t len) {
+		video::StillChunk msg;
+		if (msg.ParseFromArray(buf, len))
+			still_chunk_received(msg);
+	});
+}
+
+VideoFeed::~VideoFeed() {
+	{
+		std::lock_guard lock(work_lock);
+		running = false;
+	}
+	work_ready.notify_all();
+	for (auto& t : decoders) {
+		t.join();
+	}
+
+	net_work.reset();
+	net_ctx.stop();
+	if (net_thread.joinable())
+		net_thread.join();
+}
+
+void VideoFeed::set_decode_threads(unsigned count) {
+	decode_thread_count = std::max(count, 1U);
+}
+
+void VideoFeed::open(const boost::asio::ip::udp::endpoint& feed) {
+	endpoint = feed;
+
+	if (!net_thread.joinable()) {
+		running = true;
+		for (unsigned i = 0; i < decode_thread_count; i++) {
+			decoders.emplace_back(&VideoFeed::decode_loop, this);
+		}
+
+		net_work.emplace(net_ctx.get_executor());
+		net_thread = std::thread([this] {
+			net_ctx.run();
+		});
+	}
+
+	// The receiver is not thread-safe, so control it from the network thread
+	boost::asio::post(net_ctx, [this, feed = endpoint, port = announcements_port]() mutable {
+		try {
+			receiver.subscribe(feed);
+		} catch (const boost::system::system_error& err) {
+			std::cerr << "Unable to subscribe to video feed " << feed << ": " << err.what() << "\n";
+		}
+		try {
+			announcements.subscribe(boost::asio::ip::udp::endpoint(feed.address(), port));
+			announcements.open();
+		} catch (const boost::system::system_error& err) {
+			std::cerr << "Unable to subscribe to video stream announcements on port " << port << ": " << err.what() << "\n";
+		}
+		schedule_still_requests();
+	});
+	is_open = true;
+}
+
+void VideoFeed::watch(int stream) {
+	if (stream < 0 || stream >= MAX_STREAMS)
+		return;
+
+	std::lock_guard lock(work_lock);
+	if (streams[stream].viewers++ == 0) {
+		boost::asio::post(net_ctx, [this, stream] {
+			update_receiver(stream);
+		});
+	}
+}
+
+void VideoFeed::unwatch(int stream) {
+	if (stream < 0 || stream >= MAX_STREAMS)
+		return;
+
+	std::lock_guard lock(work_lock);
+	if (streams[stream].viewers > 0 && --streams[stream].viewers == 0) {
+		streams[stream].pending = false;
+		boost::asio::post(net_ctx, [this, stream] {
+			update_receiver(stream);
+		});
+	}
+}
+
+void VideoFeed::set_display_size(int stream, int width, int height) {
+	if (stream < 0 || stream >= MAX_STREAMS)
+		return;
+
+	std::lock_guard lock(work_lock);
+	streams[stream].display_width = width;
+	streams[stream].display_height = height;
+}
+
+bool VideoFeed::stream_info(int stream, StreamInfo& info) {
+	if (stream < 0 || stream >= MAX_STREAMS)
+		return false;
+
+	std::lock_guard lock(work_lock);
+	if (!streams[stream].announced)
+		return false;
+	info = streams[stream].info;
+	return true;
+}
+
+void VideoFeed::focus(int stream) {
+	// Built on the network thread: a copied message would still point to the original's data
+	boost::asio::post(net_ctx, [this, stream]() {
+		video_msg::Focus msg;
+		msg.data.set_enabled(stream >= 0 && stream < MAX_STREAMS);
+		msg.data.set_stream(std::max(stream, 0));
+		send_command(msg);
+	});
+}
+
+void VideoFeed::set_region_of_interest(int stream, const RegionOfInterest& region) {
+	if (stream < 0 || stream >= MAX_STREAMS)
+		return;
+
+	boost::asio::post(net_ctx, [this, stream, region]() {
+		video_msg::RegionOfInterest msg;
+		msg.data.set_stream(stream);
+		msg.data.set_enabled(region.enabled);
+		msg.data.set_x(region.x);
+		msg.data.set_y(region.y);
+		msg.data.set_width(region.width);
+		msg.data.set_height(region.height);
+		msg.data.set_quality(region.quality);
+		msg.data.set_weighted(region.weighted);
+		send_command(msg);
+	});
+}
+
+void VideoFeed::capture_still(int stream) {
+	if (stream < 0 || stream >= MAX_STREAMS)
+		return;
+
+	boost::asio::post(net_ctx, [this, stream]() {
+		video_msg::StillCapture msg;
+		msg.data.set_stream(stream);
+		send_command(msg);
+	});
+}
+
+std::vector<VideoFeed::StillStatus> VideoFeed::stills() {
+	std::lock_guard lock(still_lock);
+	std::vector<StillStatus> list;
+	for (const auto& entry : still_downloads) {
+		list.push_back(entry.second.status);
+	}
+	return list;
+}
+
+std::string VideoFeed::still_directory() {
+	std::lock_guard lock(still_lock);
+	return still_dir;
+}
+
+void VideoFeed::set_still_directory(const std::string& directory) {
+	std::lock_guard lock(still_lock);
+	still_dir = directory;
+}
+
+void VideoFeed::add_stills(const video::StreamAnnouncement& msg) {
+	bool added = false;
+	// Stills the video server still has although they were saved here. The last acknowledgement may have been lost
+	std::vector<StillStatus> saved;
+	{
+		std::lock_guard lock(still_lock);
+		for (const video::StillInfo& info : msg.stills()) {
+			if (info.size() == 0)
+				continue;
+
+			StillDownload& still = still_downloads[info.id()];
+			if (still.status.id != 0) {
+				bool same = still.status.stream == static_cast<int>(info.stream()) && still.status.size == info.size()
+						&& still.status.capture_time == info.capture_time();
+				if (same) {
+					if (!still.status.path.empty())
+						saved.push_back(still.status);
+					continue;
+				}
+				// The video server restarted and reused the id for a newer still
+				still = StillDownload();
+			}
+			still.status.id = info.id();
+			still.status.stream = info.stream();
+			still.status.size = info.size();
+			still.status.capture_time = info.capture_time();
+
+			// Saved by an earlier run
+			std::filesystem::path path = std::filesystem::path(still_dir) / still_file_name(still.status);
+			std::error_code ec;
+			if (std::filesystem::file_size(path, ec) == info.size() && !ec) {
+				still.status.received = still.status.size;
+				still.status.path = path.string();
+				saved.push_back(still.status);
+				continue;
+			}
+			still.data.resize(info.size());
+			still.chunks.assign((info.size() + STILL_CHUNK_SIZE - 1) / STILL_CHUNK_SIZE, false);
+			added = true;
+		}
+	}
+	for (const StillStatus& still : saved)
+		acknowledge_still(still);
+	if (added)
+		request_still_chunks(false);
+}
+
+void VideoFeed::still_chunk_received(const video::StillChunk& msg) {
+	bool run_finished = false;
+	StillStatus finished;
+	std::vector<uint8_t> finished_data;
+	std::string directory;
+	{
+		std::lock_guard lock(still_lock);
+		auto found = still_downloads.find(msg.id());
+		if (found == still_downloads.end())
+			return;
+		StillDownload& still = found->second;
+
+		// Chunks start where they were asked for, so they line up with STILL_CHUNK_SIZE
+		uint32_t chunk = msg.offset() / STILL_CHUNK_SIZE;
+		if (msg.offset() % STILL_CHUNK_SIZE != 0 || chunk >= still.chunks.size() || still.chunks[chunk]
+				|| msg.data().size() != std::min(STILL_CHUNK_SIZE, still.status.size - msg.offset()))
+			return;
+
+		std::copy(msg.data().begin(), msg.data().end(), still.data.begin() + msg.offset());
+		still.chunks[chunk] = true;
+		still.status.received += msg.data().size();
+		still_progress = std::chrono::steady_clock::now();
+		run_finished = msg.id() == requested_still && msg.offset() + msg.data().size() >= requested_end;
+
+		if (still.status.received == still.status.size) {
+			finished = still.status;
+			std::swap(finished_data, still.data);
+			still.chunks = std::vector<bool>();
+			directory = still_dir;
+		}
+	}
+	// Written without the lock, so the status can be read meanwhile
+	if (finished.id != 0) {
+		std::string path = save_still(directory, finished, finished_data);
+		if (path.empty()) {
+			std::cerr << "Unable to save still " << finished.id << " in " << directory << "\n";
+		} else {
+			{
+				std::lock_guard lock(still_lock);
+				still_downloads[finished.id].status.path = path;
+			}
+			acknowledge_still(finished);
+		}
+	}
+	// Ask for the next run as soon as the last one is in, rather than waiting for the timer
+	if (run_finished)
+		request_still_chunks(true);
+}
+
+void VideoFeed::request_still_chunks(bool stalled) {
+	if (video_server.is_unspecified())
+		return;
+
+	uint32_t id = 0;
+	uint32_t offset = 0;
+	uint32_t end = 0;
+	{
+		std::lock_guard lock(still_lock);
+		for (const auto& entry : still_downloads) {
+			const StillDownload& still = entry.second;
+			if (still.status.received == still.status.size)
+				continue;
+
+			auto first_missing = std::find(still.chunks.begin(), still.chunks.end(), false);
+			std::size_t first = first_missing - still.chunks.begin();
+			std::size_t last = first;
+			while (last < still.chunks.size() && last - first < STILL_REQUEST_CHUNKS && !still.chunks[last])
+				last++;
+			id = still.status.id;
+			offset = first * STILL_CHUNK_SIZE;
+			end = std::min<uint32_t>(last * STILL_CHUNK_SIZE, still.status.size);
+			break;
+		}
+	}
+	// Leave a run that is still arriving alone
+	if (id == 0 || (!stalled && id == requested_still && std::chrono::steady_clock::now() - still_progress < STILL_STALL_TIMEOUT))
+		return;
+
+	requested_still = id;
+	requested_end = end;
+	still_progress = std::chrono::steady_clock::now();
+
+	video_msg::StillRequest msg;
+	msg.data.set_id(id);
+	msg.data.set_offset(offset);
+	msg.data.set_length(end - offset);
+	msg.data.set_chunk_size(STILL_CHUNK_SIZE);
+	send_command(msg);
+}
+
+void VideoFeed::schedule_still_requests() {
+	still_timer.expires_after(STILL_REQUEST_INTERVAL);
+	still_timer.async_wait([this](const boost::system::error_code& ec) {
+		if (ec)
+			return;
+		request_still_chunks(false);
+		schedule_still_requests();
+	});
+}
+
+std::string VideoFeed::save_still(const std::string& directory, const StillStatus& still, const std::vector<uint8_t>& data) {
+	namespace fs = std::filesystem;
+	std::error_code ec;
+	fs::create_directories(directory, ec);
+
+	// Written under another name and then renamed, so a partial file is never mistaken for a finished still
+	fs::path path = fs::path(directory) / still_file_name(still);
+	fs::path partial = path;
+	partial += ".part";
+	{
+		std::ofstream output(partial, std::ios::binary | std::ios::trunc);
+		output.write(reinterpret_cast<const char*>(data.data()), data.size());
+		if (!output)
+			return "";
+	}
+	fs::rename(partial, path, ec);
+	if (ec) {
+		fs::remove(partial, ec);
+		return "";
+	}
+	return path.string();
+}
+
+void VideoFeed::update_receiver(int stream) {
+	bool announced, watched;
+	{
+		std::lock_guard lock(work_lock);
+		announced = streams[stream].announced;
+		watched = streams[stream].viewers > 0;
+	}
+
+	StreamState& s = streams[stream];
+	if (announced && watched) {
+		if (!s.receiver_open) {
+			receiver.open_stream(stream);
+			s.receiver_open = s.receiver_allocated = true;
+			request_refresh(stream);
+		}
+	} else if (announced) {
+		// Keep the buffers so the stream can be watched again without allocating
+		if (s.receiver_open) {
+			receiver.close_stream(stream);
+			s.receiver_open = false;
+		}
+	} else if (s.receiver_allocated) {
+		receiver.destroy_stream(stream);
+		s.receiver_open = s.receiver_allocated = false;
+	}
+}
+
+void VideoFeed::request_refresh(int stream) {
+	StreamState& s = streams[stream];
+	auto now = std::chrono::steady_clock::now();
+	if (video_server.is_unspecified() || now - s.last_refresh_request < REFRESH_REQUEST_INTERVAL)
+		return;
+	s.last_refresh_request = now;
+
+	video_msg::RefreshRequest msg;
+	msg.data.set_stream(stream);
+	send_command(msg);
+}
+
+void VideoFeed::acknowledge_still(const StillStatus& still) {
+	video_msg::StillReceived msg;
+	msg.data.set_id(still.id);
+	msg.data.set_capture_time(still.capture_time);
+	send_command(msg);
+}
+
+void VideoFeed::send_command(msg::Message& msg) {
+	if (video_server.is_unspecified())
+		return;
+	net::Destination server(video_server, commands_port);
+	if (commands.destination_endpoint() != server)
+		commands.set_destination_endpoint(server);
+	commands.send_message(msg);
+}
+
+bool VideoFeed::take_latest_image(int stream, Image& image) {
+	if (stream < 0 || stream >= MAX_STREAMS)
+		return false;
+
+	StreamState& s = streams[stream];
+	std::unique_lock lock(s.image_lock, std::try_to_lock);
+	if (!lock.owns_lock() || s.latest.sequence == 0)
+		return false;
+
+	// The caller's old pixel buffer is recycled by the next decode
+	std::swap(image, s.latest);
+	s.latest.sequence = 0;
+	return true;
+}
+
+void VideoFeed::decode_loop() {
+	tjhandle decompressor = tjInitDecompress();
+	if (!decompressor) {
+		std::cerr << "Video decoder failed to start: " << tjGetErrorStr2(nullptr) << "\n";
+		return;
+	}
+	Image scratch;
+
+	std::unique_lock lock(work_lock);
+	while (running) {
+		int stream = -1;
+		for (int i = 0; i < MAX_STREAMS; i++) {
+			int candidate = (next_stream + i) % MAX_STREAMS;
+			StreamState& s = streams[candidate];
+			if (s.pending && !s.busy && s.viewers > 0) {
+				stream = candidate;
+				break;
+			}
+		}
+		if (stream == -1) {
+			work_ready.wait(lock);
+			continue;
+		}
+		next_stream = (stream + 1) % MAX_STREAMS;
+
+		StreamState& s = streams[stream];
+		s.pending = false;
+		s.busy = true;
+		int width = s.display_width;
+		int height = s.display_height;
+		uint32_t last_sequence = s.decoded_sequence;
+
+		lock.unlock();
+		uint32_t sequence = decode(stream, decompressor, scratch, width, height, last_sequence);
+		lock.lock();
+
+		s.busy = false;
+		if (sequence != 0)
+			s.decoded_sequence = sequence;
+	}
+
+	tjDestroy(decompressor);
+}
+
+uint32_t VideoFeed::decode(int stream, tjhandle decompressor, Image& out, int display_width, int display_height, uint32_t last_sequence) {
+	net::Frame frame;
+	if (!receiver.try_get_latest_frame(stream, frame) || frame.sequence() == last_sequence)
+		return 0;
+
+	int width, height, subsamp, colorspace;
+	if (tjDecompressHeader3(decompressor, frame.data(), frame.size(), &width, &height, &subsamp, &colorspace) != 0)
+		return 0;
+
+	// Pick the smallest scaled IDCT that still covers the display. Never scale up
+	tjscalingfactor scale = { 1, 1 };
+	if (display_width > 0 && display_height > 0) {
+		int factor_count;
+		tjscalingfactor* factors = tjGetScalingFactors(&factor_count);
+		for (int i = 0; factors && i < factor_count; i++) {
+			const tjscalingfactor& f = factors[i];
+			if (f.num > f.denom)
+				continue;
+			if (TJSCALED(width, f) >= display_width && TJSCALED(height, f) >= display_height
+					&& TJSCALED(width, f) < TJSCALED(width, scale)) {
+				scale = f;
+			}
+		}
+	}
+
+	out.width = TJSCALED(width, scale);
+	out.height = TJSCALED(height, scale);
+	out.pixels.resize(static_cast<std::size_t>(out.width) * out.height * 4);
+	if (tjDecompress2(decompressor, frame.data(), frame.size(), out.pixels.data(), out.width, 0, out.height, TJPF_RGBA, TJFLAG_FASTDCT) != 0
+			&& tjGetErrorCode(decompressor) == TJERR_FATAL) {
+		return 0;
+	}
+	out.sequence = frame.sequence();
+
+	// Let the receiver have its buffer back before publishing
+	frame.release();
+
+	StreamState& s = streams[stream];
+	std::lock_guard lock(s.image_lock);
+	// Any image the viewer has not taken yet is dropped here, and its buffer reused
+	std::swap(s.latest, out);
+	return s.latest.sequence;
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <optional>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <turbojpeg.h>
+
+#include <stream.hpp>
+#include <network.hpp>
+#include <video_control.pb.h>
+
+/*
+	Receives the rover's video streams and decodes them for display
+
+	Design:
+	- One network thread runs the StreamReceiver. It only flags streams that completed a frame
+	- A pool of decode threads takes the newest frame of each flagged stream and decodes it to RGBA,
+	  scaled down to the smallest size that still fills the display
+	- The render thread takes the newest decoded image without waiting. Frames that were not
+	  decoded or displayed before a newer frame arrived are skipped
+
+	Streams are only decoded while they have a viewer (see watch/unwatch). Receive buffers are only
+	allocated for streams the video server has announced, and freed when it stops announcing them.
+	A stream that starts being watched asks for a refresh, since a video server holding back the
+	frames of a static scene may not send one for a while
+
+	Full resolution stills are kept on the video server, which lists the oldest in its announcements.
+	The network thread downloads each new one in runs of chunks, asking again for whatever is still
+	missing when a run stalls, so a download survives lost chunks, a dropped link, or either side restarting.
+	The server only sends chunks in the bandwidth its video streams leave. Once a still is saved here the
+	server is told, and deletes its copy so the next one is listed
+*/
+class VideoFeed {
+	public:
+		constexpr static int MAX_STREAMS = net::FrameHeader::MAX_STREAMS;
+
+		// A stream as announced by the video server
+		struct StreamInfo {
+			std::string name;
+			std::string hardware_location;
+			int width = 0;
+			int height = 0;
+			unsigned fps = 0;
+			// The camera the video server sends in full alongside its mosaic
+			bool focused = false;
+			// Set on a mosaic: the stream in each tile, row by row, in rows of tile_columns
+			std::vector<int> tiles;
+			int tile_columns = 0;
+		};
+
+		struct Image {
+			std::vector<uint8_t> pixels;
+			int width = 0;
+			int height = 0;
+			// StreamReceiver frame sequence. Gaps count frames that were never displayed
+			uint32_t sequence = 0;
+		};
+
+		VideoFeed();
+		~VideoFeed();
+
+		VideoFeed(const VideoFeed&) = delete;
+		VideoFeed(VideoFeed&&) = delete;
+
+		// Subscribe to the multicast video feed, and to stream announcements on the same address.
+		// Starts the network and decode threads on first use
+		void open(const boost::asio::ip::udp::endpoint& feed);
+		inline bool opened() const { return is_open; }
+
+		inline const boost::asio::ip::udp::endpoint& feed_endpoint() const { return endpoint; }
+		inline void set_feed_endpoint(const boost::asio::ip::udp::endpoint& feed) { endpoint = feed; }
+
+		// Port the video server announces its streams on. Takes effect on the next open
+		inline uint16_t announce_port() const { return announcements_port; }
+		inline void set_announce_port(uint16_t port) { announcements_port = port; }
+
+		// Port the video server takes control messages on. Refresh requests are sent there
+		inline uint16_t command_port() const { return commands_port; }
+		inline void set_command_port(uint16_t port) { commands_port = port; }
+
+		// Get the stream's camera. Returns false if the video server is not announcing the stream
+		bool stream_info(int stream, StreamInfo& info);
+
+		// Ask the video server to send a camera in full alongside its mosaic (-1 = mosaic only)
+		void focus(int stream);
+
+		// Part of a stream to send in more detail than the rest, in fractions of the camera frame
+		struct RegionOfInterest {
+			bool enabled = false;
+			float x = 0.0F;
+			float y = 0.0F;
+			float width = 1.0F;
+			float height = 1.0F;
+			// 0 = the stream's quality
+			unsigned quality = 0;
+			// Send the whole frame with the region at its own quality, instead of only the region
+			bool weighted = false;
+		};
+		// Ask the video server to crop a stream to a region, or to send the region at a higher quality
+		void set_region_of_interest(int stream, const RegionOfInterest& region);
+
+		// A still on the video server, and how much of it has been downloaded
+		struct StillStatus {
+			uint32_t id = 0;
+			int stream = 0;
+			uint32_t size = 0;
+			uint32_t received = 0;
+			// Microseconds since the Unix epoch
+			uint64_t capture_time = 0;
+			// Where the still was saved, once it is complete
+			std::string path;
+		};
+		// Ask the video server for a still of a stream at the camera's full resolution. The stream pauses while it is taken
+		void capture_still(int stream);
+		// The stills announced since the feed was opened, oldest first
+		std::vector<StillStatus> stills();
+
+		// Directory downloaded stills are saved in. Takes effect for stills that have not finished downloading
+		std::string still_directory();
+		void set_still_directory(const std::string& directory);
+
+		// Number of decode threads. Takes effect when the feed is first opened
+		inline unsigned decode_threads() const { return decode_thread_count; }
+		void set_decode_threads(unsigned count);
+
+		// Start or stop decoding a stream. Every watch needs a matching unwatch
+		void watch(int stream);
+		void unwatch(int stream);
+
+		// Decode the stream at the smallest scale that covers this size in pixels (0 = full size)
+		void set_display_size(int stream, int width, int height);
+
+		// Swap the newest decoded image into image if there is one the caller has not taken yet
+		// Never waits for a decoder: returns false if an image is being published right now
+		bool take_latest_image(int stream, Image& image);
+
+	private:
+		struct StreamState {
+			// Guarded by work_lock
+			int viewers = 0;
+			bool announced = false;
+			StreamInfo info;
+			bool pending = false;
+			bool busy = false;
+			int display_width = 0;
+			int display_height = 0;
+			uint32_t decoded_sequence = 0;
+
+			// Network thread only: whether the receiver has buffers for the stream, and is accepting it
+			bool receiver_allocated = false;
+			bool receiver_open = false;
+			std::chrono::steady_clock::time_point last_refresh_request;
+
+			// Newest decoded frame. A sequence of 0 means it was already taken
+			std::mutex image_lock;
+			Image latest;
+		};
+
+		boost::asio::io_context net_ctx;
+		std::optional<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> net_work;
+		net::StreamReceiver receiver;
+		net::MessageReceiver announcements;
+		uint16_t announcements_port = 22203;
+		// Commands go to the address announcements come from. Network thread only
+		net::MessageSender commands;
+		uint16_t commands_port = 22102;
+		boost::asio::ip::address video_server;
+		std::thread net_thread;
+
+		std::vector<std::thread> decoders;
+		unsigned decode_thread_count;
+		std::mutex work_lock;
+		std::condition_variable work_ready;
+		bool running = false;
+		// Where decoders begin searching for work, so one busy stream cannot starve the others
+		int next_stream = 0;
+
+		StreamState streams[MAX_STREAMS];
+
+		struct StillDownload {
+			StillStatus status;
+			std::vector<uint8_t> data;
+			// Which chunks of STILL_CHUNK_SIZE bytes have arrived
+			std::vector<bool> chunks;
+		};
+		// Guarded by still_lock
+		std::mutex still_lock;
+		std::map<uint32_t, StillDownload> still_downloads;
+		std::string still_dir = "stills";
+		// Network thread only: the run of chunks last asked for, and when a chunk last arrived
+		boost::asio::steady_timer still_timer;
+		uint32_t requested_still = 0;
+		uint32_t requested_end = 0;
+		std::chrono::steady_clock::time_point still_progress;
+
+		boost::asio::ip::udp::endpoint endpoint;
+		bool is_open = false;
+
+		// Open, close, or free the stream in the receiver to match its viewers and announcement. Network thread only
+		void update_receiver(int stream);
+		// Ask the video server to send the stream's next frame, at most once per REFRESH_REQUEST_INTERVAL. Network thread only
+		void request_refresh(int stream);
+		// Send a control message to the video server, once its address is known from an announcement. Network thread only
+		void send_command(msg::Message& msg);
+		// Add newly announced stills, skipping those already saved. Network thread only
+		void add_stills(const video::StreamAnnouncement& msg);
+		void still_chunk_received(const video::StillChunk& msg);
+		// Tell the video server a still is saved, so it deletes its copy. Network thread only
+		void acknowledge_still(const StillStatus& still);
+		// Ask for the next missing run of the oldest unfinished still, unless a run is arriving. Network thread only
+		void request_still_chunks(bool stalled);
+		void schedule_still_requests();
+		// Write a finished still to the still directory. Returns the path, or an empty string on failure
+		static std::string save_still(const std::string& directory, const StillStatus& still, const std::vector<uint8_t>& data);
+		void decode_loop();
+		// Decode the latest frame of a stream into out. Returns the frame's sequence, or 0 if there was nothing new
+		uint32_t decode(int stream, tjhandle decompressor, Image& out, int display_width, int display_height, uint32_t last_sequence);
+
+};
@@ -0,0 +1,145 @@
+/*
+	Measure how many stream frames complete at different packet loss rates, with and without FEC
+
+	Frames are sent over loopback through a relay socket that drops sections at random
+*/
+
+#include <stream.hpp>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
+
+namespace opt = boost::program_options;
+
+unsigned int frame_count;
+unsigned int frame_size;
+unsigned int section_size;
+unsigned short int relay_port;
+unsigned short int receive_port;
+
+struct Result {
+	unsigned int completed = 0;
+	unsigned int corrupt = 0;
+	uint64_t sections_sent = 0;
+	uint32_t sections_recovered = 0;
+};
+
+Result run(double loss, uint8_t group_size, std::mt19937& rng) {
+	boost::asio::io_context ctx;
+	auto loopback = boost::asio::ip::address_v4::loopback();
+
+	// Sender -> relay (drops sections) -> receiver
+	boost::asio::ip::udp::socket relay(ctx, boost::asio::ip::udp::endpoint(loopback, relay_port));
+	relay.non_blocking(true);
+	boost::asio::ip::udp::endpoint receiver_ep(loopback, receive_port);
+
+	net::StreamSender sender(ctx);
+	sender.create_streams(1);
+	sender.set_max_section_size(section_size);
+	sender.set_fec_group_size(group_size);
+	sender.set_destination_endpoint(boost::asio::ip::udp::endpoint(loopback, relay_port));
+
+	net::StreamReceiver receiver(ctx);
+	receiver.set_section_buffer_size(section_size + 64);
+	receiver.set_frame_buffer_size(frame_size);
+	receiver.open_stream(0);
+	receiver.begin(receive_port);
+
+	Result result;
+	std::vector<uint8_t> frame(frame_size);
+	receiver.on_frame_received([&](int, net::Frame& received) {
+		result.completed++;
+		if (received.size() != frame.size() || std::memcmp(received.data(), frame.data(), frame.size()) != 0) {
+			result.corrupt++;
+		}
+	});
+
+	std::bernoulli_distribution drop(loss);
+	std::vector<uint8_t> datagram(section_size + 64);
+
+	for (unsigned int i = 0; i < frame_count; i++) {
+		for (auto& b : frame) b = rng();
+		sender.send_frame(0, frame.data(), frame.size());
+
+		// Forward what the sender wrote, minus the dropped sections
+		boost::system::error_code ec;
+		for (;;) {
+			std::size_t n = relay.receive(boost::asio::buffer(datagram), 0, ec);
+			if (ec) break;
+			result.sections_sent++;
+			if (!drop(rng)) relay.send_to(boost::asio::buffer(datagram.data(), n), receiver_ep);
+		}
+
+		// Let the receiver handle everything that was forwarded
+		while (ctx.poll() > 0) { }
+	}
+
+	result.sections_recovered = receiver.take_stats(0).sections_recovered;
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	std::vector<double> loss_rates;
+	std::vector<unsigned int> group_sizes;
+
+	opt::options_description options("Options");
+	options.add_options()
+		("help,h", "detail program usage")
+		("frames,n", opt::value<unsigned int>(&frame_count)->default_value(500), "frames to send per test")
+		("frame-size", opt::value<unsigned int>(&frame_size)->default_value(60000), "bytes per frame")
+		("section-size", opt::value<unsigned int>(&section_size)->default_value(1024), "max section size")
+		("loss", opt::value<std::vector<double>>(&loss_rates)->multitoken(), "loss rates to test (default 0 0.01 0.02 0.05 0.1)")
+		("group", opt::value<std::vector<unsigned int>>(&group_sizes)->multitoken(), "FEC group sizes to test, 0 = no FEC (default 0 4 8 16)")
+		("relay-port", opt::value<unsigned short int>(&relay_port)->default_value(40010), "loopback port of the lossy relay")
+		("receive-port", opt::value<unsigned short int>(&receive_port)->default_value(40011), "loopback port of the receiver")
+	;
+
+	opt::variables_map vm;
+	try {
+		opt::store(opt::parse_command_line(argc, argv, options), vm);
+		opt::notify(vm);
+	} catch (const std::exception& e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << options << '\n';
+		return 1;
+	}
+
+	if (vm.count("help")) {
+		std::cout << "Measures stream frame completion against packet loss, with and without FEC\n";
+		std::cout << options << '\n';
+		return 0;
+	}
+
+	if (loss_rates.empty()) loss_rates = {0.0, 0.01, 0.02, 0.05, 0.1};
+	if (group_sizes.empty()) group_sizes = {0, 4, 8, 16};
+
+	std::mt19937 rng(1);
+
+	std::cout << frame_count << " frames of " << frame_size << " bytes, " << section_size << " byte sections\n";
+	std::cout << std::setw(8) << "loss" << std::setw(8) << "group" << std::setw(12) << "overhead"
+		<< std::setw(12) << "complete" << std::setw(12) << "recovered" << std::setw(10) << "corrupt" << '\n';
+
+	for (double loss : loss_rates) {
+		for (unsigned int group : group_sizes) {
+			if (group > 0xFF) continue;
+			Result r = run(loss, group, rng);
+
+			std::size_t data_sections = frame_size / section_size + !!(frame_size % section_size);
+			double overhead = 100.0 * (static_cast<double>(r.sections_sent) / frame_count - data_sections) / data_sections;
+
+			std::ostringstream loss_str, overhead_str, complete_str;
+			loss_str << std::fixed << std::setprecision(1) << 100.0 * loss << '%';
+			overhead_str << std::fixed << std::setprecision(1) << overhead << '%';
+			complete_str << std::fixed << std::setprecision(1) << 100.0 * r.completed / frame_count << '%';
+
+			std::cout << std::setw(8) << loss_str.str() << std::setw(8) << group << std::setw(12) << overhead_str.str()
+				<< std::setw(12) << complete_str.str() << std::setw(12) << r.sections_recovered << std::setw(10) << r.corrupt << '\n';
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,105 @@
+/*
+	Measure the CPU time StreamReceiver spends per received megabyte
+
+	A second thread sends frames over loopback while the receiver runs on the main thread
+*/
+
+#include <stream.hpp>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <boost/program_options.hpp>
+
+namespace opt = boost::program_options;
+
+unsigned int frame_count;
+unsigned int frame_size;
+unsigned int section_size;
+unsigned int frame_interval_us;
+unsigned short int port;
+
+static double thread_cpu_seconds() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+	opt::options_description options("Options");
+	options.add_options()
+		("help,h", "detail program usage")
+		("frames,n", opt::value<unsigned int>(&frame_count)->default_value(2000), "frames to send")
+		("frame-size", opt::value<unsigned int>(&frame_size)->default_value(100000), "bytes per frame")
+		("section-size", opt::value<unsigned int>(&section_size)->default_value(1024), "max section size")
+		("interval", opt::value<unsigned int>(&frame_interval_us)->default_value(1000), "microseconds between frames")
+		("port", opt::value<unsigned short int>(&port)->default_value(40013), "loopback port of the receiver")
+	;
+
+	opt::variables_map vm;
+	try {
+		opt::store(opt::parse_command_line(argc, argv, options), vm);
+		opt::notify(vm);
+	} catch (const std::exception& e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << options << '\n';
+		return 1;
+	}
+
+	if (vm.count("help") || frame_count == 0) {
+		std::cout << "Measures StreamReceiver CPU time per received megabyte\n";
+		std::cout << options << '\n';
+		return 0;
+	}
+
+	boost::asio::io_context ctx;
+	auto loopback = boost::asio::ip::address_v4::loopback();
+
+	net::StreamReceiver receiver(ctx);
+	receiver.set_section_buffer_size(section_size + 64);
+	receiver.set_frame_buffer_size(frame_size);
+	receiver.open_stream(0);
+	receiver.begin(port);
+
+	unsigned int completed = 0;
+	receiver.on_frame_received([&](int, net::Frame&) {
+		completed++;
+	});
+
+	std::atomic<bool> sending{true};
+	std::thread sender_thread([&]() {
+		boost::asio::io_context sender_ctx;
+		net::StreamSender sender(sender_ctx);
+		sender.create_streams(1);
+		sender.set_max_section_size(section_size);
+		sender.set_send_mode(net::SendMode::SEGMENT);
+		sender.set_destination_endpoint(boost::asio::ip::udp::endpoint(loopback, port));
+
+		std::vector<uint8_t> frame(frame_size, 0x55);
+		for (unsigned int i = 0; i < frame_count; i++) {
+			sender.send_frame(0, frame.data(), frame.size());
+			std::this_thread::sleep_for(std::chrono::microseconds(frame_interval_us));
+		}
+		sending = false;
+	});
+
+	double cpu_start = thread_cpu_seconds();
+	while (sending) {
+		ctx.run_for(std::chrono::milliseconds(50));
+	}
+	// Drain what is still in flight
+	ctx.run_for(std::chrono::milliseconds(100));
+	double cpu = thread_cpu_seconds() - cpu_start;
+	sender_thread.join();
+
+	net::StreamStats stats = receiver.take_stats(0);
+	double megabytes = stats.bytes_received / 1e6;
+
+	std::cout << "frames completed:  " << completed << " / " << frame_count << '\n';
+	std::cout << "MB received:       " << megabytes << '\n';
+	std::cout << "receiver cpu:      " << cpu * 1000.0 << " ms\n";
+	std::cout << "cpu ms per MB:     " << (megabytes > 0 ? cpu * 1000.0 / megabytes : 0.0) << '\n';
+
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+	Measure the time and system calls StreamSender needs per frame in each send mode
+
+	Frames are sent over loopback to a sink socket that counts the datagrams it receives
+*/
+
+#include <stream.hpp>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
+
+namespace opt = boost::program_options;
+
+unsigned int frame_count;
+unsigned int frame_size;
+unsigned int section_size;
+unsigned int group_size;
+unsigned short int sink_port;
+
+const char* mode_name(net::SendMode mode) {
+	switch (mode) {
+		case net::SendMode::SINGLE: return "single";
+		case net::SendMode::BATCH: return "batch";
+		case net::SendMode::SEGMENT: return "segment";
+	}
+	return "unknown";
+}
+
+void run(net::SendMode mode) {
+	boost::asio::io_context ctx;
+	auto loopback = boost::asio::ip::address_v4::loopback();
+
+	boost::asio::ip::udp::socket sink(ctx, boost::asio::ip::udp::endpoint(loopback, sink_port));
+	sink.non_blocking(true);
+	sink.set_option(boost::asio::socket_base::receive_buffer_size(8 * 1024 * 1024));
+
+	net::StreamSender sender(ctx);
+	sender.create_streams(1);
+	sender.set_max_section_size(section_size);
+	sender.set_fec_group_size(group_size);
+	sender.set_send_mode(mode);
+	sender.set_destination_endpoint(boost::asio::ip::udp::endpoint(loopback, sink_port));
+
+	std::vector<uint8_t> frame(frame_size, 0x55);
+	std::vector<uint8_t> datagram(section_size + 64);
+	uint64_t received = 0;
+	std::chrono::steady_clock::duration send_time{};
+
+	for (unsigned int i = 0; i < frame_count; i++) {
+		auto start = std::chrono::steady_clock::now();
+		sender.send_frame(0, frame.data(), frame.size());
+		send_time += std::chrono::steady_clock::now() - start;
+
+		boost::system::error_code ec;
+		while (sink.receive(boost::asio::buffer(datagram), 0, ec), !ec) {
+			received++;
+		}
+	}
+
+	double us_per_frame = std::chrono::duration<double, std::micro>(send_time).count() / frame_count;
+	double calls_per_frame = static_cast<double>(sender.get_send_call_count()) / frame_count;
+
+	std::cout << std::setw(10) << mode_name(sender.get_send_mode())
+		<< std::setw(14) << std::fixed << std::setprecision(1) << us_per_frame
+		<< std::setw(14) << calls_per_frame
+		<< std::setw(14) << static_cast<double>(received) / frame_count << '\n';
+}
+
+int main(int argc, char* argv[]) {
+	opt::options_description options("Options");
+	options.add_options()
+		("help,h", "detail program usage")
+		("frames,n", opt::value<unsigned int>(&frame_count)->default_value(1000), "frames to send per mode")
+		("frame-size", opt::value<unsigned int>(&frame_size)->default_value(100000), "bytes per frame")
+		("section-size", opt::value<unsigned int>(&section_size)->default_value(1024), "max section size")
+		("group", opt::value<unsigned int>(&group_size)->default_value(0), "FEC group size (0 = no FEC)")
+		("port", opt::value<unsigned short int>(&sink_port)->default_value(40012), "loopback port of the sink")
+	;
+
+	opt::variables_map vm;
+	try {
+		opt::store(opt::parse_command_line(argc, argv, options), vm);
+		opt::notify(vm);
+	} catch (const std::exception& e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << options << '\n';
+		return 1;
+	}
+
+	if (vm.count("help") || frame_count == 0 || group_size > 0xFF) {
+		std::cout << "Measures StreamSender time and system calls per frame in each send mode\n";
+		std::cout << options << '\n';
+		return 0;
+	}
+
+	std::cout << frame_count << " frames of " << frame_size << " bytes, " << section_size << " byte sections\n";
+	std::cout << std::setw(10) << "mode" << std::setw(14) << "us/frame" << std::setw(14) << "calls/frame"
+		<< std::setw(14) << "recv/frame" << '\n';
+
+	// The mode printed is the one actually used, in case a mode is unsupported
+	run(net::SendMode::SINGLE);
+	run(net::SendMode::BATCH);
+	run(net::SendMode::SEGMENT);
+
+	return 0;
+}
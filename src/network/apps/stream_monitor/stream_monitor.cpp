@@ -0,0 +1,147 @@
+/*
+	Receive video streams, print how well each stream is arriving, and report it
+	back to the video server so its rate controller can adapt to the link
+*/
+
+#include <network.hpp>
+#include <stream.hpp>
+#include <rover_system_messages.hpp>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <set>
+#include <string>
+#include <boost/program_options.hpp>
+
+namespace opt = boost::program_options;
+
+std::string stream_addr;
+unsigned short int stream_port;
+std::string feedback_addr;
+unsigned short int feedback_port;
+unsigned short int announce_port;
+unsigned int interval_ms;
+// Streams the video server has announced. Buffers are only allocated for these
+std::set<int> live_streams;
+
+void report(boost::asio::steady_timer& timer, net::StreamReceiver& receiver, net::MessageSender& feedback) {
+	timer.expires_after(std::chrono::milliseconds(interval_ms));
+	timer.async_wait([&](const boost::system::error_code& ec) {
+		if (ec) return;
+
+		for (int i : live_streams) {
+			net::StreamStats stats = receiver.take_stats(i);
+			if (stats.sections_received == 0 && stats.frames_dropped == 0) continue;
+
+			std::cout << "stream " << i << ": " << stats.frames_completed << " frames, "
+				<< stats.frames_dropped << " dropped, "
+				<< stats.sections_lost << "/" << (stats.sections_received + stats.sections_lost) << " sections lost, "
+				<< stats.sections_recovered << " recovered, "
+				<< (stats.bytes_received * 1000 / interval_ms / 1024) << " KiB/s\n";
+
+			if (stats.latency_samples > 0) {
+				auto bound = [](uint32_t ms) { return ms == std::numeric_limits<uint32_t>::max() ? std::string("inf") : std::to_string(ms); };
+				std::cout << "  latency: mean " << stats.mean_latency_ms() << " ms, "
+					<< "p50 < " << bound(stats.latency_percentile_ms(50)) << " ms, "
+					<< "p95 < " << bound(stats.latency_percentile_ms(95)) << " ms, "
+					<< "max " << stats.latency_max_us / 1000.0 << " ms, "
+					<< "jitter " << stats.jitter_us / 1000.0 << " ms\n";
+			}
+			if (stats.latency_invalid > 0) {
+				std::cout << "  " << stats.latency_invalid << " frames arrived before their capture time: clocks are not synchronized\n";
+			}
+
+			if (!feedback_addr.empty()) {
+				video_msg::StreamFeedback msg;
+				msg.data.set_stream(i);
+				msg.data.set_interval_ms(interval_ms);
+				msg.data.set_frames_completed(stats.frames_completed);
+				msg.data.set_frames_dropped(stats.frames_dropped);
+				msg.data.set_sections_received(stats.sections_received);
+				msg.data.set_sections_lost(stats.sections_lost);
+				msg.data.set_bytes_received(stats.bytes_received);
+				msg.data.set_sections_recovered(stats.sections_recovered);
+				feedback.send_message(msg);
+			}
+		}
+
+		report(timer, receiver, feedback);
+	});
+}
+
+void update_streams(net::StreamReceiver& receiver, const video::StreamAnnouncement& announcement) {
+	std::set<int> announced;
+	for (const video::StreamInfo& info : announcement.streams()) {
+		int i = info.stream();
+		if (i >= net::FrameHeader::MAX_STREAMS) continue;
+		announced.insert(i);
+		if (live_streams.insert(i).second) {
+			receiver.open_stream(i);
+			std::cout << "stream " << i << " opened: " << info.name() << " (" << info.hardware_location() << "), "
+				<< info.width() << "x" << info.height() << " at " << info.fps() << " fps\n";
+		}
+	}
+	for (auto it = live_streams.begin(); it != live_streams.end();) {
+		if (announced.count(*it)) {
+			++it;
+			continue;
+		}
+		receiver.destroy_stream(*it);
+		std::cout << "stream " << *it << " closed\n";
+		it = live_streams.erase(it);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	opt::options_description options("Options");
+	options.add_options()
+		("help,h", "detail program usage")
+		("addr", opt::value<std::string>(&stream_addr)->default_value("239.255.123.123"), "multicast address of the video streams")
+		("port", opt::value<unsigned short int>(&stream_port)->default_value(22202), "port of the video streams")
+		("feedback-addr", opt::value<std::string>(&feedback_addr), "video server to send feedback to (none if omitted)")
+		("feedback-port", opt::value<unsigned short int>(&feedback_port)->default_value(22102), "video server command port")
+		("interval", opt::value<unsigned int>(&interval_ms)->default_value(1000), "report interval in milliseconds")
+		("announce-port", opt::value<unsigned short int>(&announce_port)->default_value(22203), "port the video server announces its streams on")
+	;
+
+	opt::variables_map vm;
+	try {
+		opt::store(opt::parse_command_line(argc, argv, options), vm);
+		opt::notify(vm);
+	} catch (const std::exception& e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << options << '\n';
+		return 1;
+	}
+
+	if (vm.count("help") || interval_ms == 0) {
+		std::cout << "Reports video stream reception and sends feedback to the video server\n";
+		std::cout << options << '\n';
+		return 0;
+	}
+
+	register_messages();
+
+	boost::asio::io_context ctx;
+	net::StreamReceiver receiver(ctx);
+	boost::asio::ip::udp::endpoint feed(boost::asio::ip::address::from_string(stream_addr), stream_port);
+	receiver.subscribe(feed);
+
+	net::MessageReceiver announcements(ctx, boost::asio::ip::udp::endpoint(feed.address(), announce_port));
+	announcements.register_handler<video_msg::StreamAnnouncement>([&receiver](const uint8_t buf[], std::size_t len) {
+		video::StreamAnnouncement msg;
+		if (msg.ParseFromArray(buf, len)) {
+			update_streams(receiver, msg);
+		}
+	});
+
+	net::MessageSender feedback(ctx);
+	if (!feedback_addr.empty()) {
+		feedback.set_destination_endpoint(net::Destination(boost::asio::ip::address::from_string(feedback_addr), feedback_port));
+	}
+
+	boost::asio::steady_timer timer(ctx);
+	report(timer, receiver, feedback);
+	ctx.run();
+
+	return 0;
+}
@@ -8,6 +8,18 @@
 namespace video_msg {
 	DEFINE_MESSAGE_TYPE(Quality, video::Quality)
 	DEFINE_MESSAGE_TYPE(Switch, video::Switch)
+	DEFINE_MESSAGE_TYPE(FrameRate, video::FrameRate)
+	DEFINE_MESSAGE_TYPE(Resolution, video::Resolution)
+	DEFINE_MESSAGE_TYPE(StreamFeedback, video::StreamFeedback)
+	DEFINE_MESSAGE_TYPE(FrameSize, video::FrameSize)
+	DEFINE_MESSAGE_TYPE(StreamAnnouncement, video::StreamAnnouncement)
+	DEFINE_MESSAGE_TYPE(RefreshRequest, video::RefreshRequest)
+	DEFINE_MESSAGE_TYPE(Focus, video::Focus)
+	DEFINE_MESSAGE_TYPE(RegionOfInterest, video::RegionOfInterest)
+	DEFINE_MESSAGE_TYPE(StillCapture, video::StillCapture)
+	DEFINE_MESSAGE_TYPE(StillRequest, video::StillRequest)
+	DEFINE_MESSAGE_TYPE(StillChunk, video::StillChunk)
+	DEFINE_MESSAGE_TYPE(StillReceived, video::StillReceived)
 }
 
 namespace drive_msg {
@@ -27,6 +39,18 @@ namespace sensor_msg {
 inline void register_messages() {
 	msg::register_message_type<video_msg::Quality>();
 	msg::register_message_type<video_msg::Switch>();
+	msg::register_message_type<video_msg::FrameRate>();
+	msg::register_message_type<video_msg::Resolution>();
+	msg::register_message_type<video_msg::StreamFeedback>();
+	msg::register_message_type<video_msg::FrameSize>();
+	msg::register_message_type<video_msg::StreamAnnouncement>();
+	msg::register_message_type<video_msg::RefreshRequest>();
+	msg::register_message_type<video_msg::Focus>();
+	msg::register_message_type<video_msg::RegionOfInterest>();
+	msg::register_message_type<video_msg::StillCapture>();
+	msg::register_message_type<video_msg::StillRequest>();
+	msg::register_message_type<video_msg::StillChunk>();
+	msg::register_message_type<video_msg::StillReceived>();
 
 	msg::register_message_type<drive_msg::Velocity>();
 	msg::register_message_type<drive_msg::ActualSpeed>();
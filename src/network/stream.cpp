@@ -1,13 +1,22 @@
 #include "stream.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <limits>
 #include <iostream>
 #include <boost/array.hpp>
 
-net::StreamSender::StreamSender(boost::asio::io_context& io_context) : ctx(io_context), socket(ctx) {
+#ifdef __linux__
+#include <cerrno>
+#include <netinet/in.h>
+#endif
+
+net::StreamSender::StreamSender(boost::asio::io_context& io_context) : pace_timer(io_context), ctx(io_context), socket(ctx) {
 	stream_info.reserve(8);
 	socket.open(boost::asio::ip::udp::v4());
+	// A full socket buffer returns from pump() instead of stalling the io_context's other handlers
+	socket.non_blocking(true);
 }
 
 void net::StreamSender::set_destination_endpoint(const boost::asio::ip::udp::endpoint& endpoint) {
@@ -17,95 +26,434 @@ void net::StreamSender::set_destination_endpoint(const boost::asio::ip::udp::end
 void net::StreamSender::create_streams(int stream_count) {
 	if (stream_count > 0 && stream_info.size() < static_cast<unsigned>(stream_count)) {
 		stream_info.resize(stream_count);
+		queued_frames.resize(stream_count);
 	}
 }
 
-void net::StreamSender::send_frame(int stream, uint8_t* data, std::size_t len) {
+void net::StreamSender::set_send_mode(SendMode mode) {
+#ifdef __linux__
+	send_mode = mode;
+	segment_supported = true;
+#else
+	send_mode = SendMode::SINGLE;
+#endif
+}
+
+void net::StreamSender::send_frame(int stream, const uint8_t* data, std::size_t len, uint64_t capture_time) {
 	if (static_cast<unsigned>(stream) >= stream_info.size()) {
 		throw std::out_of_range("net::StreamSender::send_frame: stream index out of range");
 	}
+	build_sections(stream, data, len, capture_time);
+
+	// A failed send cancels the rest of the frame
+	std::size_t next = 0;
+	while (next < sections.size()) {
+		next = send_sections(next, sections.size());
+		if (!would_block) break;
+		boost::system::error_code ec;
+		socket.wait(boost::asio::ip::udp::socket::wait_write, ec);
+		if (ec) break;
+	}
+}
+
+void net::StreamSender::async_send_frame(int stream, const uint8_t* data, std::size_t len, std::shared_ptr<const void> owner, uint64_t capture_time) {
+	if (static_cast<unsigned>(stream) >= stream_info.size()) {
+		throw std::out_of_range("net::StreamSender::async_send_frame: stream index out of range");
+	}
+
+	QueuedFrame& queued = queued_frames[stream];
+	if (queued.owner || queued.data) {
+		// Drop oldest: the newer frame is worth more than the late one
+		dropped_frames++;
+	}
+	queued.data = data;
+	queued.len = len;
+	queued.capture_time = capture_time;
+	queued.owner = std::move(owner);
+
+	if (!pumping) {
+		pumping = true;
+		boost::asio::post(ctx, [this]() { pump(); });
+	}
+}
+
+void net::StreamSender::cancel_frames(int stream) {
+	if (static_cast<unsigned>(stream) >= queued_frames.size()) return;
+
+	queued_frames[stream] = QueuedFrame();
+	if (active_stream == stream) {
+		// The remaining sections point into the released frame
+		active_frame = QueuedFrame();
+		active_stream = -1;
+		next_section = sections.size();
+	}
+}
+
+void net::StreamSender::set_pacing(uint64_t rate, std::size_t burst) {
+	pacing_rate = rate;
+	// The bucket must hold at least one full section or nothing could be sent
+	pacing_burst = std::max<std::size_t>(burst, max_section_size + FrameHeader::SIZE);
+	tokens = pacing_burst;
+	last_refill = std::chrono::steady_clock::now();
+}
+
+bool net::StreamSender::start_next_frame() {
+	for (std::size_t i = 0; i < queued_frames.size(); i++) {
+		std::size_t stream = (next_stream + i) % queued_frames.size();
+		QueuedFrame& queued = queued_frames[stream];
+		if (!queued.owner && !queued.data) continue;
+
+		active_frame = std::move(queued);
+		queued = QueuedFrame();
+		active_stream = stream;
+		next_stream = stream + 1;
+
+		build_sections(stream, active_frame.data, active_frame.len, active_frame.capture_time);
+		next_section = 0;
+		return true;
+	}
+	return false;
+}
+
+void net::StreamSender::pump() {
+	for (;;) {
+		if (next_section >= sections.size()) {
+			active_frame = QueuedFrame();
+			active_stream = -1;
+			if (!start_next_frame()) {
+				pumping = false;
+				return;
+			}
+		}
+
+		std::size_t end = sections.size();
+		if (pacing_rate > 0) {
+			auto now = std::chrono::steady_clock::now();
+			tokens += std::chrono::duration<double>(now - last_refill).count() * pacing_rate;
+			tokens = std::min(tokens, pacing_burst);
+			last_refill = now;
+
+			// Send the sections the bucket can pay for
+			double cost = 0.0;
+			end = next_section;
+			while (end < sections.size() && cost + sections[end].len + FrameHeader::SIZE <= tokens) {
+				cost += sections[end].len + FrameHeader::SIZE;
+				end++;
+			}
+
+			if (end == next_section) {
+				// Wait until the next section is affordable. Other handlers run in the meantime
+				double deficit = sections[next_section].len + FrameHeader::SIZE - tokens;
+				pace_timer.expires_after(std::chrono::microseconds(static_cast<int64_t>(1e6 * deficit / pacing_rate) + 1));
+				pace_timer.async_wait([this](const boost::system::error_code& ec) {
+					if (!ec) pump();
+				});
+				return;
+			}
+		}
+
+		std::size_t sent = send_sections(next_section, end);
+		if (pacing_rate > 0) {
+			// Only the sections that left are paid for
+			for (std::size_t i = next_section; i < sent; i++) {
+				tokens -= sections[i].len + FrameHeader::SIZE;
+			}
+		}
+
+		if (would_block) {
+			// Carry on from the first unsent section once the socket has room. Other handlers run in the meantime
+			next_section = sent;
+			socket.async_wait(boost::asio::ip::udp::socket::wait_write, [this](const boost::system::error_code& ec) {
+				if (!ec) pump();
+			});
+			return;
+		}
+		// A failed send cancels the rest of the frame
+		next_section = sent == end ? end : sections.size();
+	}
+}
+
+std::size_t net::StreamSender::send_sections(std::size_t first, std::size_t end) {
+	would_block = false;
+	switch (send_mode) {
+	case SendMode::BATCH:
+		return send_batch(first, end);
+	case SendMode::SEGMENT:
+		return send_segmented(first, end);
+	default:
+		return send_single(first, end);
+	}
+}
+
+void net::StreamSender::build_sections(int stream, const uint8_t* data, std::size_t len, uint64_t capture_time) {
 	FrameHeader hdr;
-	uint8_t header_buffer[FrameHeader::SIZE];
-	auto io_header_buffer = boost::asio::buffer(header_buffer, FrameHeader::SIZE);
+	hdr.capture_time = capture_time;
 
 	// aways need 1 more section than (len / max_section_size) unless they divide perfectly
-	hdr.section_count = len / max_section_size + !!(len % max_section_size);
+	std::size_t section_count = len / max_section_size + !!(len % max_section_size);
+	hdr.section_count = section_count;
 	hdr.stream_index = stream;
-	hdr.frame_index = stream_info[stream].frame_index++;
-	hdr.section_index = 0;
-	hdr.offset = 0;
+	hdr.frame_sequence = stream_info[stream].frame_sequence++;
 
-	hdr.write(header_buffer);
+	// Repair sections are numbered after the data sections, so all of them must fit in section_index
+	std::size_t repair_count = 0;
+	if (fec_group_size > 0) {
+		repair_count = section_count / fec_group_size + !!(section_count % fec_group_size);
+		if (section_count + repair_count <= 0xFF) hdr.fec_group_size = fec_group_size;
+	}
 
-	while (len > 0) {
-		
-		std::size_t n_sent = (len > max_section_size) ? max_section_size : len;
-		hdr.write_new_section(header_buffer);
+	// Every section is padded to the full section size in the XOR
+	std::size_t section_size = (len < max_section_size) ? len : max_section_size;
+	if (hdr.fec_group_size) {
+		repair_buffer.assign(repair_count * section_size, 0);
+	}
 
-		auto io_section_buffer = boost::asio::buffer(data, n_sent);
+	sections.clear();
+	std::size_t offset = 0;
+	for (std::size_t index = 0; index < section_count; index++) {
+		std::size_t n = (len - offset > max_section_size) ? max_section_size : len - offset;
+		hdr.section_index = index;
+		hdr.offset = offset;
+
+		Section& section = sections.emplace_back();
+		hdr.write(section.header);
+		section.data = &data[offset];
+		section.len = n;
+
+		if (hdr.fec_group_size) {
+			std::size_t group = index / hdr.fec_group_size;
+			uint8_t* parity = &repair_buffer[group * section_size];
+			for (std::size_t i = 0; i < n; i++) {
+				parity[i] ^= data[offset + i];
+			}
+
+			// Send the repair section after the last section of each group
+			if ((index + 1) % hdr.fec_group_size == 0 || index + 1 == section_count) {
+				FrameHeader repair_hdr = hdr;
+				repair_hdr.section_index = section_count + group;
+				repair_hdr.offset = len;
+
+				Section& repair = sections.emplace_back();
+				repair_hdr.write(repair.header);
+				repair.data = parity;
+				repair.len = section_size;
+			}
+		}
+
+		offset += n;
+	}
+}
+
+std::size_t net::StreamSender::send_single(std::size_t first, std::size_t end) {
+	for (std::size_t i = first; i < end; i++) {
+		auto io_header_buffer = boost::asio::const_buffer(sections[i].header, FrameHeader::SIZE);
+		auto io_section_buffer = boost::asio::const_buffer(sections[i].data, sections[i].len);
 		boost::array<decltype(io_header_buffer), 2> io_buffers = {io_header_buffer, io_section_buffer};
 
-		try {
-			std::size_t act_sent = socket.send_to(io_buffers, destination) - FrameHeader::SIZE;
-			if (act_sent != n_sent) break;
-			len -= n_sent;
-			data = &data[n_sent];
-
-			hdr.section_index++;
-			hdr.offset += n_sent;
-			hdr.write_new_section(header_buffer);
-		} catch (const boost::system::system_error& error) {
-			// Cancel sending the frame on error
-			break;
+		boost::system::error_code ec;
+		send_calls++;
+		std::size_t act_sent = socket.send_to(io_buffers, destination, 0, ec);
+		if (ec == boost::asio::error::would_block) {
+			would_block = true;
+			return i;
+		}
+		if (ec || act_sent != FrameHeader::SIZE + sections[i].len) return i;
+	}
+	return end;
+}
+
+#ifdef __linux__
+
+std::size_t net::StreamSender::send_batch(std::size_t first, std::size_t end) {
+	std::size_t count = end - first;
+	msg_headers.resize(count);
+	iovecs.resize(2 * count);
+
+	for (std::size_t i = 0; i < count; i++) {
+		Section& section = sections[first + i];
+		iovecs[2 * i] = { section.header, FrameHeader::SIZE };
+		iovecs[2 * i + 1] = { const_cast<uint8_t*>(section.data), section.len };
+
+		msghdr& hdr = msg_headers[i].msg_hdr;
+		hdr = msghdr();
+		hdr.msg_name = destination.data();
+		hdr.msg_namelen = destination.size();
+		hdr.msg_iov = &iovecs[2 * i];
+		hdr.msg_iovlen = 2;
+	}
+
+	std::size_t sent = 0;
+	while (sent < count) {
+		send_calls++;
+		int n = ::sendmmsg(socket.native_handle(), &msg_headers[sent], count - sent, 0);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			would_block = errno == EAGAIN || errno == EWOULDBLOCK;
+			return first + sent;
+		}
+		sent += n;
+	}
+	return end;
+}
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+// Linux caps the segments in one GSO send
+static constexpr std::size_t MAX_GSO_SEGMENTS = 64;
+// Max UDP payload
+static constexpr std::size_t MAX_GSO_BYTES = 65507;
+
+std::size_t net::StreamSender::send_segmented(std::size_t first, std::size_t end) {
+	if (!segment_supported || first == end) return send_batch(first, end);
+
+	// Every segment but the last in one send must be exactly segment_size bytes
+	std::size_t segment_size = FrameHeader::SIZE + sections[0].len;
+	std::size_t max_segments = std::min(MAX_GSO_SEGMENTS, MAX_GSO_BYTES / segment_size);
+
+	iovecs.resize(2 * sections.size());
+	for (std::size_t i = first; i < end; i++) {
+		iovecs[2 * i] = { sections[i].header, FrameHeader::SIZE };
+		iovecs[2 * i + 1] = { const_cast<uint8_t*>(sections[i].data), sections[i].len };
+	}
+
+	alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(uint16_t))];
+
+	while (first < end) {
+		// A short section (the end of the frame) must be the last segment of its send
+		std::size_t last = first;
+		while (last < end && last - first < max_segments) {
+			bool full = FrameHeader::SIZE + sections[last].len == segment_size;
+			last++;
+			if (!full) break;
+		}
+
+		msghdr hdr = msghdr();
+		hdr.msg_name = destination.data();
+		hdr.msg_namelen = destination.size();
+		hdr.msg_iov = &iovecs[2 * first];
+		hdr.msg_iovlen = 2 * (last - first);
+		hdr.msg_control = control;
+		hdr.msg_controllen = sizeof(control);
+
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = IPPROTO_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		uint16_t gso_size = segment_size;
+		std::memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+
+		send_calls++;
+		if (::sendmsg(socket.native_handle(), &hdr, 0) < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				would_block = true;
+				return first;
+			}
+			if (errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP || errno == EIO) {
+				// No GSO for this kernel or route. Send the rest of this frame and all later frames batched
+				segment_supported = false;
+				return send_batch(first, end);
+			}
+			return first;
 		}
+		first = last;
 	}
+	return end;
 }
 
+#else
+
+std::size_t net::StreamSender::send_batch(std::size_t first, std::size_t end) {
+	return send_single(first, end);
+}
+
+std::size_t net::StreamSender::send_segmented(std::size_t first, std::size_t end) {
+	return send_single(first, end);
+}
+
+#endif
+
 void net::StreamSender::set_max_section_size(uint32_t max) {
 	if (max < 0x00FFFFFF && max > 0) max_section_size = max;
 }
 
+// Little endian helpers for the header's multi-byte fields
+static void write_le(uint8_t* arr, uint64_t value, unsigned bytes) {
+	for (unsigned i = 0; i < bytes; i++) {
+		arr[i] = (value >> (8 * i)) & 0xFF;
+	}
+}
+
+static uint64_t read_le(const uint8_t* arr, unsigned bytes) {
+	uint64_t value = 0;
+	for (unsigned i = 0; i < bytes; i++) {
+		value |= static_cast<uint64_t>(arr[i]) << (8 * i);
+	}
+	return value;
+}
+
 void net::FrameHeader::write(uint8_t* arr) const {
-	arr[0] = stream_index;
-	arr[1] = frame_index;
+	arr[0] = VERSION;
+	arr[1] = stream_index;
 	arr[2] = section_index;
 	arr[3] = section_count;
-
-	arr[4] = offset & 0xFF;
-	arr[5] = (offset >> 8) & 0xFF;
-	arr[6] = (offset >> 16) & 0xFF;
+	arr[4] = fec_group_size;
+	arr[5] = 0;
+	arr[6] = 0;
+	arr[7] = 0;
+
+	write_le(&arr[8], frame_sequence, 4);
+	write_le(&arr[12], offset, 4);
+	write_le(&arr[16], capture_time, 8);
 }
 
-void net::FrameHeader::read(const uint8_t* arr) {
-	stream_index = arr[0];
-	frame_index = arr[1];
+bool net::FrameHeader::read(const uint8_t* arr) {
+	if (arr[0] != VERSION) return false;
+
+	stream_index = arr[1];
 	section_index = arr[2];
 	section_count = arr[3];
+	fec_group_size = arr[4];
 
-	offset = arr[4] | (arr[5] << 8) | (arr[6] << 16);
+	frame_sequence = read_le(&arr[8], 4);
+	offset = read_le(&arr[12], 4);
+	capture_time = read_le(&arr[16], 8);
+	return true;
 }
 
 void net::FrameHeader::write_new_section(uint8_t* arr) const {
 	arr[2] = section_index;
 
-	arr[4] = offset & 0xFF;
-	arr[5] = (offset >> 8) & 0xFF;
-	arr[6] = (offset >> 16) & 0xFF;
+	write_le(&arr[12], offset, 4);
 }
 
 net::StreamReceiver::Stream::Stream() { }
 
 // When moving object, no need to reallocate the buffers
 // Basically the default move constructor but src.all_data set to null so it doesn't get destructed
-// Also note that completion_lock cannot be copied:
+// Also note that reader_lock cannot be copied and published must be copied by hand:
 //	Reading stream data and moving stream objects must be mutually exclusive.
 //	Enforce with higher-level locks (eg. StreamReceiver::streams_lock)
 net::StreamReceiver::Stream::Stream(Stream&& src) :
 	indv_buffer_size(std::move(src.indv_buffer_size)),
 	all_data(std::move(src.all_data)),
 	frame_buffers(std::move(src.frame_buffers)),
-	complete_buffer(std::move(src.complete_buffer)),
-	open(std::move(src.open)) {
+	writer_buffers(std::move(src.writer_buffers)),
+	published(src.published.load()),
+	reader_buffer(src.reader_buffer),
+	reader_has_frame(src.reader_has_frame),
+	complete_frame_sequence(src.complete_frame_sequence),
+	have_complete_frame(src.have_complete_frame),
+	completed_count(src.completed_count),
+	open(std::move(src.open)),
+	latest_frame_sequence(src.latest_frame_sequence),
+	have_frame_sequence(src.have_frame_sequence),
+	stats(src.stats),
+	jitter_us(src.jitter_us),
+	last_capture_time(src.last_capture_time),
+	last_arrival(src.last_arrival) {
 
 	src.all_data = nullptr;
 }
@@ -118,7 +466,7 @@ void net::StreamReceiver::Stream::alloc_buffers(std::size_t buf_size, unsigned b
 	// Do not reallocate if they are the same size
 	if (all_data && buf_level == frame_buffers.size() && buf_size == indv_buffer_size) return;
 
-	std::lock_guard lock(completion_lock);
+	std::lock_guard lock(reader_lock);
 
 	if (all_data) {
 		delete[] all_data;
@@ -133,20 +481,32 @@ void net::StreamReceiver::Stream::alloc_buffers(std::size_t buf_size, unsigned b
 		f.data = &all_data[offset];
 		f.received_size = 0;
 		f.received_sections = 0;
+		f.section_count = 0;
 
 		offset += buf_size;
 	}
-	complete_buffer = -1;
+
+	// The last two buffers start out as the (empty) published and reader buffers
+	writer_buffers.resize(buf_level - 2);
+	for (unsigned i = 0; i < writer_buffers.size(); i++) {
+		writer_buffers[i] = i;
+	}
+	published.store(buf_level - 2);
+	reader_buffer = buf_level - 1;
+	reader_has_frame = false;
+	have_complete_frame = false;
 }
 
 void net::StreamReceiver::Stream::free_buffers() {
-	std::lock_guard locked(completion_lock);
+	std::lock_guard locked(reader_lock);
 
 	delete[] all_data;
 	all_data = nullptr;
-	complete_buffer = -1;
 
 	frame_buffers.clear();
+	writer_buffers.clear();
+	reader_has_frame = false;
+	have_complete_frame = false;
 
 }
 
@@ -186,66 +546,276 @@ void net::StreamReceiver::subscribe(boost::asio::ip::udp::endpoint& ep) {
 	receive();
 }
 
+#ifdef __linux__
+
+void net::StreamReceiver::receive() {
+	if (recv_batch_buffer.size() != RECV_BATCH * recv_buffer_size) {
+		recv_batch_buffer.resize(RECV_BATCH * recv_buffer_size);
+		recv_msg_headers.resize(RECV_BATCH);
+		recv_iovecs.resize(RECV_BATCH);
+		for (std::size_t i = 0; i < RECV_BATCH; i++) {
+			recv_iovecs[i] = { &recv_batch_buffer[i * recv_buffer_size], recv_buffer_size };
+		}
+	}
+
+	// Wait for the socket instead of reading, then read everything that is ready at once
+	socket.async_wait(boost::asio::ip::udp::socket::wait_read, [this](const boost::system::error_code& error) {
+		if (error == boost::asio::error::operation_aborted) return;
+		if (!error) receive_batch();
+		receive();
+	});
+}
+
+void net::StreamReceiver::receive_batch() {
+	for (;;) {
+		for (std::size_t i = 0; i < RECV_BATCH; i++) {
+			msghdr& hdr = recv_msg_headers[i].msg_hdr;
+			hdr = msghdr();
+			hdr.msg_iov = &recv_iovecs[i];
+			hdr.msg_iovlen = 1;
+		}
+
+		int n = ::recvmmsg(socket.native_handle(), recv_msg_headers.data(), RECV_BATCH, MSG_DONTWAIT, nullptr);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return;
+
+		for (int i = 0; i < n; i++) {
+			// Sections larger than the receive buffer are cut off, so they cannot be used
+			if (recv_msg_headers[i].msg_len >= FrameHeader::SIZE && !(recv_msg_headers[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+				handle_section(&recv_batch_buffer[i * recv_buffer_size], recv_msg_headers[i].msg_len);
+			}
+		}
+
+		// A partial batch means the socket is drained
+		if (static_cast<std::size_t>(n) < RECV_BATCH) return;
+	}
+}
+
+#else
+
 void net::StreamReceiver::receive() {
 	if (!recv_buffer.get()) {
 		recv_buffer.reset(new uint8_t[recv_buffer_size]);
 	}
 	socket.async_receive_from(boost::asio::buffer(recv_buffer.get(), recv_buffer_size), remote, [this](auto error, auto bytes_transferred) {
 		if (!error && bytes_transferred >= FrameHeader::SIZE) {
-			FrameHeader section;
-			section.read(recv_buffer.get());
-
-			// Acquire streams_lock as a reader
-			std::shared_lock<std::shared_mutex> streams_reader(streams_lock);
-			if (section.stream_index >= 0 && static_cast<unsigned>(section.stream_index) < streams.size() && streams[section.stream_index].open) {
-				
-				Stream& s = streams[section.stream_index];
-
-				// Find which buffer to use
-				// s.frame_buffers.size() is guaranteed to be >= 2
-
-				unsigned use_buffer = section.frame_index % (s.frame_buffers.size() - 1);
-				// Do not overwrite most recently completed frame
-				if (s.complete_buffer >= -1 && use_buffer >= static_cast<unsigned>(s.complete_buffer)) {
-					use_buffer++;
-					if (use_buffer == s.frame_buffers.size()) use_buffer = 0;
-				}
-
-				// Continue reconstructing this frame -or- overwrite the old frame
-				FrameBuf& f = s.frame_buffers[use_buffer];
-				if (f.frame_index != section.frame_index) {
-					// Different frames; overwrite
-					f.frame_index = section.frame_index;
-					f.received_sections = 0;
-					f.received_size = 0;
-				}
-
-				std::size_t data_bytes_in = bytes_transferred - FrameHeader::SIZE;
-				if (section.offset + data_bytes_in <= s.indv_buffer_size) {
-					std::memcpy(&f.data[section.offset], &recv_buffer.get()[FrameHeader::SIZE], data_bytes_in);
-					f.received_sections++;
-					f.received_size += data_bytes_in;
-					if (f.received_sections == section.section_count) {
-						// Frame is now complete
-						// Cannot change completion pointer if the old complete buffer is in use (lock)
-						s.completion_lock.lock();
-						s.complete_buffer = use_buffer;
-
-						Frame completed;
-						// Transfer ownership to Frame
-						completed.bind(&s.completion_lock, f.data, f.received_size);
-
-						if (frame_handler) frame_handler(section.stream_index, completed);
-
-					}
-				}
-
-			}
+			handle_section(recv_buffer.get(), bytes_transferred);
 		}
 		receive();
 	});
 }
 
+#endif
+
+void net::StreamReceiver::handle_section(const uint8_t* datagram, std::size_t bytes_transferred) {
+	FrameHeader section;
+	if (!section.read(datagram)) return;
+
+	// Acquire streams_lock as a reader
+	std::shared_lock<std::shared_mutex> streams_reader(streams_lock);
+	if (section.stream_index < 0 || static_cast<unsigned>(section.stream_index) >= streams.size() || !streams[section.stream_index].open) {
+		return;
+	}
+
+	Stream& s = streams[section.stream_index];
+	bool is_repair = section.section_index >= section.section_count;
+
+	// Sections of the published frame or older frames are late (ex. the last repair section arrives after
+	// its frame completes). Drop them rather than overwrite another buffer
+	int32_t behind_complete = s.complete_frame_sequence - section.frame_sequence;
+	if (s.have_complete_frame && behind_complete >= 0 && behind_complete < SEQUENCE_WINDOW) {
+		return;
+	}
+
+	// Find which buffer to use
+	// s.writer_buffers.size() is guaranteed to be >= 1
+	unsigned writer_slot = section.frame_sequence % s.writer_buffers.size();
+	unsigned use_buffer = s.writer_buffers[writer_slot];
+
+	std::unique_lock<std::mutex> stats_writer(s.stats_lock);
+
+	// Frames that were jumped over never had a single section arrive
+	int32_t frames_ahead = section.frame_sequence - s.latest_frame_sequence;
+	if (!s.have_frame_sequence) {
+		s.have_frame_sequence = true;
+		s.latest_frame_sequence = section.frame_sequence;
+	} else if (frames_ahead > 0 && frames_ahead < SEQUENCE_WINDOW) {
+		s.stats.frames_dropped += frames_ahead - 1;
+		s.latest_frame_sequence = section.frame_sequence;
+	} else if (frames_ahead >= SEQUENCE_WINDOW || frames_ahead <= -SEQUENCE_WINDOW) {
+		// The sender restarted its sequence
+		s.latest_frame_sequence = section.frame_sequence;
+	}
+
+	// Continue reconstructing this frame -or- overwrite the old frame
+	FrameBuf& f = s.frame_buffers[use_buffer];
+	if (f.frame_sequence != section.frame_sequence || f.section_count == 0) {
+		// Different frames; overwrite
+		if (f.received_sections > 0 && f.received_sections < f.section_count) {
+			s.stats.frames_dropped++;
+			s.stats.sections_lost += f.section_count - f.received_sections;
+		}
+		f.frame_sequence = section.frame_sequence;
+		f.capture_time = section.capture_time;
+		f.section_count = section.section_count;
+		f.received_sections = 0;
+		f.received_size = 0;
+		f.fec_group_size = section.fec_group_size;
+		f.received.reset();
+		f.received_repair.reset();
+		f.section_size = 0;
+		f.frame_size = 0;
+	}
+
+	const uint8_t* payload = &datagram[FrameHeader::SIZE];
+	std::size_t data_bytes_in = bytes_transferred - FrameHeader::SIZE;
+	s.stats.sections_received++;
+	s.stats.bytes_received += data_bytes_in;
+
+	unsigned group;
+	if (!is_repair) {
+		// Ignore duplicates and sections that do not fit
+		if (f.received[section.section_index] || section.offset + data_bytes_in > s.indv_buffer_size) return;
+
+		std::memcpy(&f.data[section.offset], payload, data_bytes_in);
+		f.received.set(section.section_index);
+		f.received_sections++;
+		f.received_size += data_bytes_in;
+		group = f.fec_group_size ? section.section_index / f.fec_group_size : 0;
+	} else {
+		group = section.section_index - section.section_count;
+		if (f.fec_group_size == 0 || f.received_repair[group] || data_bytes_in == 0) return;
+		// All repair sections of a frame are the same size
+		if (f.section_size != 0 && f.section_size != data_bytes_in) return;
+
+		f.section_size = data_bytes_in;
+		f.frame_size = section.offset;
+		if (f.repair_data.size() < (group + 1) * data_bytes_in) {
+			f.repair_data.resize((group + 1) * data_bytes_in);
+		}
+		std::memcpy(&f.repair_data[group * data_bytes_in], payload, data_bytes_in);
+		f.received_repair.set(group);
+	}
+
+	if (f.fec_group_size) {
+		recover_section(f, group, s.indv_buffer_size, s.stats);
+	}
+
+	if (f.received_sections == f.section_count) {
+		s.stats.frames_completed++;
+		record_latency(s, f);
+		stats_writer.unlock();
+
+		// Frame is now complete
+		f.sequence = ++s.completed_count;
+		s.complete_frame_sequence = f.frame_sequence;
+		s.have_complete_frame = true;
+
+		// Publish the frame and take back the previously published buffer, which the reader has either
+		// skipped or already swapped for its own. Mark it empty so it is reset on its next use
+		unsigned previous = s.published.exchange(use_buffer | Stream::FRESH, std::memory_order_acq_rel) & ~Stream::FRESH;
+		s.frame_buffers[previous].section_count = 0;
+		s.frame_buffers[previous].received_sections = 0;
+		s.writer_buffers[writer_slot] = previous;
+
+		// Readers only read, and only this thread takes the buffer back (on the next completed frame),
+		// so the handler needs no lock. The frame is already published when the handler runs
+		if (frame_handler) {
+			Frame completed;
+			completed.bind(nullptr, f.data, f.received_size, f.sequence, f.capture_time);
+			frame_handler(section.stream_index, completed);
+		}
+	}
+}
+
+void net::StreamReceiver::record_latency(Stream& s, const FrameBuf& f) {
+	if (f.capture_time == 0) return;
+
+	auto arrival = std::chrono::steady_clock::now();
+	int64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	int64_t latency_us = now_us - static_cast<int64_t>(f.capture_time);
+
+	StreamStats& stats = s.stats;
+	if (latency_us < 0) {
+		stats.latency_invalid++;
+	} else {
+		uint64_t latency_ms = latency_us / 1000;
+		std::size_t bucket = 0;
+		while (bucket < StreamStats::LATENCY_BUCKETS - 1 && latency_ms >= StreamStats::LATENCY_BUCKET_MS[bucket]) {
+			bucket++;
+		}
+		stats.latency_histogram[bucket]++;
+		stats.latency_samples++;
+		stats.latency_sum_us += latency_us;
+		stats.latency_max_us = std::max<uint64_t>(stats.latency_max_us, latency_us);
+	}
+
+	// Frames completing out of order do not move the estimator
+	if (f.capture_time <= s.last_capture_time) return;
+
+	// RFC 3550: D is the change in transit time between consecutive frames, J += (|D| - J) / 16
+	// Only differences of each clock are used, so this works without synchronized clocks
+	if (s.last_capture_time != 0) {
+		double arrival_gap = std::chrono::duration<double, std::micro>(arrival - s.last_arrival).count();
+		double capture_gap = static_cast<double>(f.capture_time - s.last_capture_time);
+		s.jitter_us += (std::abs(arrival_gap - capture_gap) - s.jitter_us) / 16.0;
+		stats.jitter_us = s.jitter_us;
+	}
+	s.last_capture_time = f.capture_time;
+	s.last_arrival = arrival;
+}
+
+uint32_t net::StreamStats::latency_percentile_ms(double percentile) const {
+	if (latency_samples == 0) return 0;
+
+	double target = latency_samples * percentile / 100.0;
+	uint32_t counted = 0;
+	for (std::size_t i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		counted += latency_histogram[i];
+		if (counted >= target) return LATENCY_BUCKET_MS[i];
+	}
+	return std::numeric_limits<uint32_t>::max();
+}
+
+void net::StreamReceiver::recover_section(FrameBuf& f, unsigned group, std::size_t buffer_size, StreamStats& stats) {
+	if (!f.received_repair[group]) return;
+
+	unsigned first = group * f.fec_group_size;
+	unsigned end = std::min<unsigned>(first + f.fec_group_size, f.section_count);
+
+	// XOR can only rebuild a single missing section
+	int missing = -1;
+	for (unsigned i = first; i < end; i++) {
+		if (!f.received[i]) {
+			if (missing != -1) return;
+			missing = i;
+		}
+	}
+	if (missing == -1) return;
+
+	std::size_t offset = missing * f.section_size;
+	if (offset >= f.frame_size || f.frame_size > buffer_size) return;
+	std::size_t len = std::min(f.section_size, f.frame_size - offset);
+
+	// missing = repair ^ (every other section in the group). Sections are zero-padded to section_size
+	uint8_t* out = &f.data[offset];
+	std::memcpy(out, &f.repair_data[group * f.section_size], len);
+	for (unsigned i = first; i < end; i++) {
+		if (static_cast<int>(i) == missing) continue;
+		std::size_t in_offset = i * f.section_size;
+		std::size_t in_len = std::min(len, f.frame_size - in_offset);
+		const uint8_t* in = &f.data[in_offset];
+		for (std::size_t j = 0; j < in_len; j++) {
+			out[j] ^= in[j];
+		}
+	}
+
+	f.received.set(missing);
+	f.received_sections++;
+	f.received_size += len;
+	stats.sections_recovered++;
+}
+
 void net::StreamReceiver::open_stream(int stream) {
 	// Direct map stream index to an entry in streams. Ensure table is big enough
 	if (stream >= 0 && static_cast<unsigned>(stream) >= streams.size()) {
@@ -274,8 +844,8 @@ void net::StreamReceiver::set_frame_buffer_params(std::size_t size, unsigned lev
 	if (size > static_cast<uint64_t>(std::numeric_limits<unsigned>::max()))
 		throw std::out_of_range("net::StreamReceiver::set_frame_buffer_params: max size is 4GB");
 
-	if (level < 2)
-		throw std::invalid_argument("net::StreamReceiver::set_frame_buffer_params: minimum buffer level is 2");
+	if (level < 3)
+		throw std::invalid_argument("net::StreamReceiver::set_frame_buffer_params: minimum buffer level is 3");
 
 	std::unique_lock streams_writer(streams_lock);
 
@@ -304,47 +874,94 @@ void net::StreamReceiver::set_section_buffer_size(std::size_t size) {
 
 }
 
-net::Frame net::StreamReceiver::get_complete_frame(int stream) {
+net::StreamStats net::StreamReceiver::take_stats(int stream) {
 	std::shared_lock<std::shared_mutex> streams_reader(streams_lock);
 	if (static_cast<unsigned>(stream) >= streams.size())
-		throw std::out_of_range("net::StreamReceiver::get_complete_frame: stream index out of range");
+		throw std::out_of_range("net::StreamReceiver::take_stats: stream index out of range");
 
 	Stream& s = streams[stream];
-	s.completion_lock.lock();
+	std::lock_guard<std::mutex> stats_reader(s.stats_lock);
+	StreamStats stats = s.stats;
+	stats.jitter_us = s.jitter_us;
+	s.stats = StreamStats();
+	return stats;
+}
 
-	if (s.complete_buffer == -1)
-		throw std::range_error("net::StreamReceiver::get_complete_frame: no frame available");
+bool net::StreamReceiver::try_get_latest_frame(int stream, Frame& out) {
+	out.release();
+
+	std::shared_lock<std::shared_mutex> streams_reader(streams_lock);
+	if (stream < 0 || static_cast<unsigned>(stream) >= streams.size())
+		return false;
+
+	Stream& s = streams[stream];
+	std::unique_lock<std::mutex> reader(s.reader_lock);
+	if (s.frame_buffers.empty())
+		return false;
+
+	// Trade the buffer we hold for a newer frame, if one was published since we last looked
+	if (s.published.load(std::memory_order_acquire) & Stream::FRESH) {
+		s.reader_buffer = s.published.exchange(s.reader_buffer, std::memory_order_acq_rel) & ~Stream::FRESH;
+		s.reader_has_frame = true;
+	}
+	if (!s.reader_has_frame)
+		return false;
+
+	// reader_lock is intentionally left locked: Frame's destructor unlocks automatically
+	// This guarantees callers have exclusive access to Frame until it is destroyed
+	FrameBuf& f = s.frame_buffers[s.reader_buffer];
+	out.bind(reader.release(), f.data, f.received_size, f.sequence, f.capture_time);
+	return true;
+}
+
+net::Frame net::StreamReceiver::get_complete_frame(int stream) {
+	{
+		std::shared_lock<std::shared_mutex> streams_reader(streams_lock);
+		if (static_cast<unsigned>(stream) >= streams.size())
+			throw std::out_of_range("net::StreamReceiver::get_complete_frame: stream index out of range");
+	}
 
-	// completion_lock is intentionally left unlocked: Frame's destructor unlocks automatically
-	// This guarantees get_complete_frame callers have exclusive access to Frame until it is destroyed
 	Frame completed_frame;
-	completed_frame.bind(&s.completion_lock, &s.all_data[s.complete_buffer * s.indv_buffer_size], s.frame_buffers[s.complete_buffer].received_size);
+	if (!try_get_latest_frame(stream, completed_frame))
+		throw std::range_error("net::StreamReceiver::get_complete_frame: no frame available");
 	return completed_frame;
-
 }
 
 net::Frame::Frame(Frame&& src) :
 	_data(std::move(src._data)),
 	len(std::move(src.len)),
-	completion_lock(std::move(src.completion_lock)) {
+	_sequence(src._sequence),
+	_capture_time(src._capture_time),
+	reader_lock(std::move(src.reader_lock)) {
 
-	src.completion_lock = nullptr;
+	src.reader_lock = nullptr;
 
 }
 
-net::Frame::~Frame() {
-	if (completion_lock) {
-		completion_lock->unlock();
+net::Frame& net::Frame::operator=(Frame&& src) {
+	if (this != &src) {
+		release();
+		bind(src.reader_lock, src._data, src.len, src._sequence, src._capture_time);
+		src.reader_lock = nullptr;
 	}
+	return *this;
 }
 
-void net::Frame::bind(std::mutex* completion_lock, uint8_t* data, std::size_t len) {
+net::Frame::~Frame() {
+	release();
+}
+
+void net::Frame::bind(std::mutex* reader_lock, uint8_t* data, std::size_t len, uint32_t sequence, uint64_t capture_time) {
+	this->_capture_time = capture_time;
 	this->_data = data;
-	this->completion_lock = completion_lock;
+	this->reader_lock = reader_lock;
 	this->len = len;
+	this->_sequence = sequence;
 }
 
 void net::Frame::release() {
-	completion_lock->unlock();
-	completion_lock = nullptr;
+	if (reader_lock) {
+		reader_lock->unlock();
+		reader_lock = nullptr;
+	}
 }
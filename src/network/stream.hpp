@@ -5,6 +5,9 @@
 
 #pragma once
 
+#include <atomic>
+#include <bitset>
+#include <chrono>
 #include <cstdint>
 #include <vector>
 #include <mutex>
@@ -14,31 +17,208 @@
 #include <memory>
 #include <boost/asio.hpp>
 
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
 namespace net {
 
+// Identifies information needed to reconstruct multiple streams from streams split into sections
+//
+// Layout (multi-byte fields are little endian):
+//	0	version (VERSION)
+//	1	stream_index
+//	2	section_index
+//	3	section_count
+//	4	fec_group_size
+//	5-7	reserved (0)
+//	8	frame_sequence (32 bits)
+//	12	offset (32 bits)
+//	16	capture_time (64 bits)
+//
+// Repair sections (FEC) have section_index >= section_count: repair section r covers data
+// sections [r * fec_group_size, (r + 1) * fec_group_size). Their offset holds the frame size
+struct FrameHeader {
+	static constexpr std::size_t SIZE = 24;
+	// The high bit makes receivers of the old 8-byte header see a negative stream index and ignore the section
+	static constexpr uint8_t VERSION = 0x80 | 2;
+	// Receivers ignore sections with a negative stream_index
+	static constexpr int MAX_STREAMS = 128;
+	int8_t stream_index;
+	uint8_t section_index;
+	uint8_t section_count;
+	// Data sections per repair section (0 = no FEC)
+	uint8_t fec_group_size = 0;
+	uint32_t frame_sequence;
+	uint32_t offset;
+	// When the camera captured the frame, in microseconds since the Unix epoch (0 = unknown)
+	uint64_t capture_time = 0;
+	void write(uint8_t* arr) const;
+	// Returns false if the section uses another header version
+	bool read(const uint8_t* arr);
+	void write_new_section(uint8_t* arr) const;
+};
+
 // Stream object may be more useful in the future if we
 // want to support named streams and camera UUID
 struct StreamMetadata {
-	uint8_t frame_index = 0;
+	uint32_t frame_sequence = 0;
+};
+
+// How StreamSender hands sections to the kernel
+enum class SendMode {
+	// One send_to per section. Works everywhere
+	SINGLE,
+	// All of a frame's sections in one sendmmsg call (Linux only)
+	BATCH,
+	// One sendmsg per ~64 sections, split into datagrams by the kernel with UDP GSO (Linux 4.18+).
+	// Falls back to BATCH if the kernel refuses
+	SEGMENT
 };
 
 // Simple stream sender for transmitting frames associated with a stream index.
 // StreamSender is not designed for concurrent sends
+//
+// Optional forward error correction: after every group of n sections, a repair section
+// holding the XOR of the group is sent. The receiver can rebuild any one lost section
+// per group, at the cost of 1/n extra bandwidth.
+//
+// Frames can be sent with the blocking send_frame, or queued with async_send_frame and
+// sent from the io_context. Async sends are paced by a token bucket so a frame goes out
+// at the link's rate instead of as one burst, and wait for room in the socket's buffer
+// without blocking the io_context. Do not mix the two on one sender.
 class StreamSender {
 public:
 	StreamSender(boost::asio::io_context& io_context);
 	void set_destination_endpoint(const boost::asio::ip::udp::endpoint& endpoint);
-	// Blocking send
-	void send_frame(int stream, uint8_t* data, std::size_t len);
+	// Blocking send. capture_time is in microseconds since the Unix epoch (0 = unknown)
+	void send_frame(int stream, const uint8_t* data, std::size_t len, uint64_t capture_time = 0);
+
+	// Queue a frame to be sent from the io_context. Call from the io_context's thread.
+	// owner keeps data valid until the frame is sent or dropped.
+	// A newer frame replaces a queued frame of the same stream that has not started sending
+	void async_send_frame(int stream, const uint8_t* data, std::size_t len, std::shared_ptr<const void> owner, uint64_t capture_time = 0);
+	// Drop the stream's queued and in-progress async frames, releasing their owners
+	void cancel_frames(int stream);
+	// Pace async sends to rate bytes per second, allowing bursts of up to burst bytes (rate 0 = no pacing)
+	void set_pacing(uint64_t rate, std::size_t burst);
+	// Async frames replaced by newer frames before being sent
+	inline uint64_t get_dropped_frame_count() const { return dropped_frames; }
+	// True while async frames are queued or being sent
+	inline bool busy() const { return pumping; }
+
 	void create_streams(int stream_count);
 	void set_max_section_size(uint32_t max);
 	inline uint32_t get_max_section_size() const { return max_section_size; }
+	// Send one repair section per group_size sections (0 = no FEC)
+	inline void set_fec_group_size(uint8_t group_size) { fec_group_size = group_size; }
+	inline uint8_t get_fec_group_size() const { return fec_group_size; }
+	// BATCH and SEGMENT fall back to SINGLE where unsupported
+	void set_send_mode(SendMode mode);
+	inline SendMode get_send_mode() const { return send_mode; }
+	// Number of send system calls made so far
+	inline uint64_t get_send_call_count() const { return send_calls; }
 private:
+	// One datagram: a header and a pointer to its payload
+	struct Section {
+		uint8_t header[FrameHeader::SIZE];
+		const uint8_t* data;
+		std::size_t len;
+	};
+
+	// An async frame waiting to be sent
+	struct QueuedFrame {
+		const uint8_t* data = nullptr;
+		std::size_t len = 0;
+		uint64_t capture_time = 0;
+		std::shared_ptr<const void> owner;
+	};
+
 	std::vector<StreamMetadata> stream_info;
+	// At most one queued frame per stream
+	std::vector<QueuedFrame> queued_frames;
+	// Async frame whose sections are being sent
+	QueuedFrame active_frame;
+	int active_stream = -1;
+	std::size_t next_section = 0;
+	// Queued streams are started round robin
+	std::size_t next_stream = 0;
+	bool pumping = false;
+
+	// Token bucket, in bytes
+	uint64_t pacing_rate = 0;
+	double pacing_burst = 0.0;
+	double tokens = 0.0;
+	std::chrono::steady_clock::time_point last_refill;
+	boost::asio::steady_timer pace_timer;
+	uint64_t dropped_frames = 0;
+
+	// Sections of the frame being sent. Reused between frames
+	std::vector<Section> sections;
+	// Repair section payloads (XOR of each group's sections)
+	std::vector<uint8_t> repair_buffer;
+#ifdef __linux__
+	// Batched send descriptors, two iovecs (header, payload) per section
+	std::vector<mmsghdr> msg_headers;
+	std::vector<iovec> iovecs;
+	bool segment_supported = true;
+#endif
 	boost::asio::io_context& ctx;
 	boost::asio::ip::udp::socket socket;
 	boost::asio::ip::udp::endpoint destination;
 	uint32_t max_section_size = 1024;
+	uint8_t fec_group_size = 0;
+	SendMode send_mode = SendMode::SINGLE;
+	uint64_t send_calls = 0;
+
+	// Send queued async frames until out of frames or tokens
+	void pump();
+	// Build the next queued frame's sections. Returns false if none are queued
+	bool start_next_frame();
+
+	// Split a frame into sections (and repair sections)
+	void build_sections(int stream, const uint8_t* data, std::size_t len, uint64_t capture_time);
+	// Send sections [first, end) of the current frame with the send mode. Each returns the first section not sent:
+	// end if all were, or an earlier section if the socket's buffer is full (would_block is set) or a send failed
+	std::size_t send_sections(std::size_t first, std::size_t end);
+	std::size_t send_single(std::size_t first, std::size_t end);
+	std::size_t send_batch(std::size_t first, std::size_t end);
+	std::size_t send_segmented(std::size_t first, std::size_t end);
+	// Set by the last send_sections if it stopped because the socket's buffer was full
+	bool would_block = false;
+};
+
+// Reception counts for one stream, used to report link quality back to the sender
+struct StreamStats {
+	uint32_t frames_completed = 0;
+	// Frames that were partially received, or skipped entirely, and never completed
+	uint32_t frames_dropped = 0;
+	uint32_t sections_received = 0;
+	// Missing sections of partially received frames. Sections of skipped frames are not counted
+	uint32_t sections_lost = 0;
+	// Lost sections rebuilt from repair sections
+	uint32_t sections_recovered = 0;
+	uint64_t bytes_received = 0;
+
+	// Glass-to-glass latency: from capture on the sender to completion here, for frames with a capture time
+	// Sender and receiver clocks must be synchronized (ex. NTP or PTP) for these to be meaningful
+	static constexpr std::size_t LATENCY_BUCKETS = 12;
+	// Upper bound (exclusive) of each bucket but the last, in milliseconds. The last bucket holds everything slower
+	static constexpr uint32_t LATENCY_BUCKET_MS[LATENCY_BUCKETS - 1] = { 10, 20, 35, 50, 75, 100, 150, 200, 300, 500, 1000 };
+	uint32_t latency_histogram[LATENCY_BUCKETS] = {};
+	uint32_t latency_samples = 0;
+	uint64_t latency_sum_us = 0;
+	uint64_t latency_max_us = 0;
+	// Frames that completed before they were captured: the clocks are not synchronized
+	uint32_t latency_invalid = 0;
+	// Interarrival jitter of frames in microseconds (RFC 3550 estimator). Not reset by take_stats
+	double jitter_us = 0.0;
+
+	inline double mean_latency_ms() const { return latency_samples ? latency_sum_us / 1000.0 / latency_samples : 0.0; }
+	// Upper bound of the histogram bucket holding the given percentile (0 - 100), in milliseconds
+	// Returns 0 with no samples, and UINT32_MAX if it falls in the last bucket
+	uint32_t latency_percentile_ms(double percentile) const;
 };
 
 // Forward declaration for Frame (small cross-dependency for "friend" declaration)
@@ -46,20 +226,26 @@ class StreamReceiver;
 
 // Provides thread-safe, RAII-style access to completed frames
 // Data is valid until calling release() or until going out of scope
+// Holding a Frame never blocks the network thread, only other readers of the same stream
 // Object cannot be copied
 class Frame {
 public:
 	Frame() = default;
 	Frame(Frame&& src);
+	Frame& operator=(Frame&& src);
 
-	// Since Frame owns the completion_lock, do not allow copying
+	// Since Frame owns the reader_lock, do not allow copying
 	Frame(const Frame&) = delete;
 	~Frame();
 
-	// Unlock the completion_lock, allowing StreamReceiver to overwrite this frame buffer if needed
+	// Unlock the reader_lock, allowing other readers to take the stream's latest frame
 	void release();
 
 	inline std::size_t size() const { return len; }
+	// When the sender captured the frame, in microseconds since the Unix epoch (0 = unknown)
+	inline uint64_t capture_time() const { return _capture_time; }
+	// Counts completed frames of the stream. A reader has seen this frame before if the sequence is unchanged
+	inline uint32_t sequence() const { return _sequence; }
 	inline uint8_t* data() { return _data; }
 	inline const uint8_t* data() const { return _data; }
 	inline uint8_t& operator[](std::size_t i) { return _data[i]; }
@@ -67,10 +253,12 @@ public:
 private:
 	uint8_t* _data = nullptr;
 	std::size_t len = 0;
-	std::mutex* completion_lock = nullptr;
+	uint32_t _sequence = 0;
+	uint64_t _capture_time = 0;
+	std::mutex* reader_lock = nullptr;
 
 	friend StreamReceiver;
-	void bind(std::mutex* completion_lock, uint8_t* data, std::size_t len);
+	void bind(std::mutex* reader_lock, uint8_t* data, std::size_t len, uint32_t sequence, uint64_t capture_time);
 };
 
 // Partial thread-safety:
@@ -86,7 +274,22 @@ private:
 		uint8_t* data;
 		std::size_t received_size;
 		uint8_t received_sections;
-		uint8_t frame_index;
+		uint8_t section_count;
+		uint32_t frame_sequence;
+		uint64_t capture_time;
+		// Set when the frame completes. See Frame::sequence
+		uint32_t sequence;
+
+		// Forward error correction state. Only valid when fec_group_size is nonzero
+		uint8_t fec_group_size;
+		// Which data sections and repair sections have arrived
+		std::bitset<256> received;
+		std::bitset<256> received_repair;
+		// Size of every section but the last, and of the whole frame (from a repair section)
+		std::size_t section_size;
+		std::size_t frame_size;
+		// Repair section payloads, each section_size bytes
+		std::vector<uint8_t> repair_data;
 	};
 	
 	// Hold buffers and other metadata necessary for reconstructing a single stream
@@ -100,14 +303,18 @@ private:
 
 		// Buffering design:
 		// Use n equal-sized frame buffers to place sections when they are received
-		// When all sections of a frame are received into a buffer, mark that buffer as complete
-		// The complete buffer is not overwritten until another buffer becomes complete
+		// The buffers are split between three owners, as in a triple buffer:
+		//	- the io thread reconstructs frames in the n - 2 buffers listed in writer_buffers
+		//	- the most recently completed frame is published in the buffer named by published
+		//	- the reader keeps the frame it last took in reader_buffer
 		// 
 		// Thread safety:
-		// Certain operations (decoding) must be assured the complete buffer is not overwritten while in use
-		// Lock completion_lock before changing complete_buffer -or- accessing FrameBuf[complete_buffer]
-		// The Frame object hides this from users:
-		//	- StreamReceiver::get_complete_frame locks the completion_lock and packages it in a Frame obj
+		// Ownership only changes hands through atomic exchanges of published, so neither side waits on the other
+		//	- When a frame completes, the io thread swaps its buffer into published (marked FRESH)
+		//	  and takes back whichever buffer was published before
+		//	- A reader that finds a FRESH buffer swaps its own buffer into published
+		// Readers of the same stream are serialized by reader_lock. The io thread never locks it:
+		//	- StreamReceiver::try_get_latest_frame locks the reader_lock and packages it in a Frame obj
 		//	- Users have exclusive access to Frame while in scope
 		//	- Frame's destructor releases the lock
 
@@ -116,12 +323,36 @@ private:
 		uint8_t* all_data = nullptr;
 		std::vector<FrameBuf> frame_buffers;
 
-		// Lock when the complete buffer is in use to prevent overwriting when another frame completes
-		std::mutex completion_lock;
+		// Set in published when its buffer holds a frame the reader has not taken
+		static constexpr unsigned FRESH = 0x80000000;
+
+		// Io thread only: buffers being reconstructed
+		std::vector<unsigned> writer_buffers;
+		// Buffer index of the latest complete frame, plus the FRESH flag
+		std::atomic<unsigned> published{0};
+		// Reader only (under reader_lock): buffer holding the frame last taken
+		unsigned reader_buffer = 0;
+		bool reader_has_frame = false;
+		std::mutex reader_lock;
+
+		// Io thread only: frame most recently published, and the count of completed frames
+		uint32_t complete_frame_sequence = 0;
+		bool have_complete_frame = false;
+		uint32_t completed_count = 0;
 
-		// Which buffer is complete?
-		int complete_buffer = -1;
 		bool open = false;
+
+		// Newest frame sequence seen, for counting skipped frames
+		uint32_t latest_frame_sequence = 0;
+		bool have_frame_sequence = false;
+
+		// Lock when reading or writing stats
+		std::mutex stats_lock;
+		StreamStats stats;
+		// Jitter estimator state: the last timestamped frame's capture time and arrival
+		double jitter_us = 0.0;
+		uint64_t last_capture_time = 0;
+		std::chrono::steady_clock::time_point last_arrival;
 	};
 public:
 
@@ -162,10 +393,18 @@ public:
 	void set_section_buffer_size(std::size_t);
 	inline std::size_t section_buffer_size() const { return recv_buffer_size; };
 
+	// Get exclusive access to the latest completed frame, without waiting for the network thread
+	// Returns false if the stream is invalid or has not completed a frame yet
+	// Any frame already held in out is released first
+	bool try_get_latest_frame(int stream, Frame& out);
 	// Get exclusive access to the latest completed frame.
 	// throws std::out_of_range if stream is invalid
 	// throws std::range_error if no frame is available
 	Frame get_complete_frame(int stream);
+	// Get the reception stats collected since the last call and reset them
+	// throws std::out_of_range if stream is invalid
+	StreamStats take_stats(int stream);
+	// Called on the io thread for each completed frame, after it is published to try_get_latest_frame
 	inline void on_frame_received(std::function<void(int stream, Frame& frame)> handler) { frame_handler = handler; }
 
 private:
@@ -175,31 +414,34 @@ private:
 	std::unique_ptr<uint8_t> recv_buffer;
 	// start with default size; allocates on write
 	std::size_t recv_buffer_size = 2048;
+#ifdef __linux__
+	// Datagrams read per recvmmsg call
+	static constexpr std::size_t RECV_BATCH = 32;
+	// RECV_BATCH buffers of recv_buffer_size bytes
+	std::vector<uint8_t> recv_batch_buffer;
+	std::vector<mmsghdr> recv_msg_headers;
+	std::vector<iovec> recv_iovecs;
+#endif
 	std::vector<Stream> streams;
 	// Reader-writer lock: stream vector cannot be reallocated while being read
 	std::shared_mutex streams_lock;
 	std::function<void(int stream, Frame& frame)> frame_handler;
+	// Sections this many frames behind the newest are late. Farther away, the sender must have restarted
+	static constexpr int32_t SEQUENCE_WINDOW = 1024;
 	// Default size: 4MB
 	unsigned _frame_buffer_size = 4 * 1024 * 1024;
-	unsigned _frame_buffer_level = 3;
+	// Two buffers to reconstruct frames in, plus the published and reader buffers
+	unsigned _frame_buffer_level = 4;
 	uint16_t port;
 	void receive();
+	// Read every datagram waiting on the socket, a batch per system call
+	void receive_batch();
+	void handle_section(const uint8_t* datagram, std::size_t bytes_transferred);
+	// Rebuild the one missing section of a group, if the group has its repair section
+	void recover_section(FrameBuf& f, unsigned group, std::size_t buffer_size, StreamStats& stats);
+	// Add a completed frame's latency and arrival time to the stream's stats. Caller holds stats_lock
+	void record_latency(Stream& s, const FrameBuf& f);
 
 };
 
-// Identifies information needed to reconstruct multiple streams from streams split into sections
-// Only 3 LSB of offset
-struct FrameHeader {
-	static constexpr std::size_t SIZE = 4 * sizeof(int8_t) + 3;
-	int8_t stream_index;
-	uint8_t frame_index;
-	uint8_t section_index;
-	uint8_t section_count;
-	// Max: 16 MB
-	uint32_t offset;
-	void write(uint8_t* arr) const;
-	void read(const uint8_t* arr);
-	void write_new_section(uint8_t* arr) const;
-};
-
 } // end namespace net
\ No newline at end of file
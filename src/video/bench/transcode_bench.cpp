@@ -0,0 +1,126 @@
+/*
+    Compare the CPU cost of the video transcode modes on recorded camera frames
+
+    Input is a single JPEG or an MJPEG stream of concatenated JPEGs, such as one
+    recorded with: ffmpeg -f v4l2 -input_format mjpeg -i /dev/video0 -c copy -f mjpeg out.mjpeg
+*/
+
+#include <replay_source.hpp>
+#include <transcoder.hpp>
+
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
+
+namespace opt = boost::program_options;
+
+static void run_mode(TranscodeMode mode, const std::vector<uint8_t>& data, const std::vector<FrameSpan>& frames, unsigned count, int quality, bool greyscale, int scale) {
+    Transcoder transcoder;
+
+    TranscodeSettings settings;
+    settings.mode = mode;
+    settings.quality = quality;
+    settings.greyscale = greyscale;
+    settings.scale_denominator = scale;
+
+    unsigned failed = 0;
+    std::size_t out_bytes = 0;
+
+    auto wall_start = std::chrono::steady_clock::now();
+    std::clock_t cpu_start = std::clock();
+
+    for (unsigned i = 0; i < count; i++) {
+        const FrameSpan& f = frames[i % frames.size()];
+        if (transcoder.transcode(&data[f.offset], f.size, settings)) {
+            out_bytes += transcoder.size();
+        } else {
+            failed++;
+        }
+    }
+
+    std::clock_t cpu_end = std::clock();
+    auto wall_end = std::chrono::steady_clock::now();
+
+    double wall_s = std::chrono::duration<double>(wall_end - wall_start).count();
+    double cpu_ms = 1000.0 * (cpu_end - cpu_start) / CLOCKS_PER_SEC;
+    unsigned ok = count - failed;
+
+    std::cout << get_transcode_mode_string(mode) << ":\n";
+    std::cout << "\tframes/s:        " << count / wall_s << "\n";
+    std::cout << "\tcpu ms/frame:    " << cpu_ms / count << "\n";
+    std::cout << "\tavg output size: " << (ok ? out_bytes / ok : 0) << " bytes\n";
+    std::cout << "\tfailed frames:   " << failed << "\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::string input_path;
+    std::string mode_name;
+    unsigned count;
+    int quality;
+    int scale;
+    bool greyscale = false;
+
+    opt::options_description opts("Usage");
+    opts.add_options()
+        ("help,h", "list these options")
+        ("input,i", opt::value<std::string>(&input_path)->required(), "JPEG or MJPEG file to transcode")
+        ("frames,n", opt::value<unsigned>(&count)->default_value(500), "number of frames to transcode per mode")
+        ("quality,q", opt::value<int>(&quality)->default_value(30), "output JPEG quality")
+        ("scale,s", opt::value<int>(&scale)->default_value(1), "downscale output by 1/scale (1, 2, 4, or 8)")
+        ("mode,m", opt::value<std::string>(&mode_name), "only run one mode (decode or requantize)")
+        ("greyscale,g", "produce greyscale output")
+    ;
+
+    try {
+        opt::variables_map map;
+        opt::store(opt::parse_command_line(argc, argv, opts), map);
+        if (map.count("help")) {
+            std::cout << opts << "\n";
+            return 0;
+        }
+        opt::notify(map);
+        greyscale = map.count("greyscale") > 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid options: " << e.what() << "\n" << opts << "\n";
+        return 1;
+    }
+
+    if (!is_supported_scale(scale)) {
+        std::cerr << "Unsupported scale: 1/" << scale << "\n";
+        return 1;
+    }
+
+    std::ifstream input(input_path, std::ios::binary);
+    if (!input) {
+        std::cerr << "Could not open " << input_path << "\n";
+        return 1;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    std::vector<FrameSpan> frames = split_mjpeg_frames(data);
+    if (frames.empty()) {
+        std::cerr << "No JPEG frames found in " << input_path << "\n";
+        return 1;
+    }
+
+    std::cout << "Transcoding " << count << " frames (" << frames.size() << " unique) at quality " << quality
+        << (greyscale ? ", greyscale" : "") << (scale != 1 ? ", scale 1/" + std::to_string(scale) : "") << "\n";
+
+    if (mode_name.empty()) {
+        run_mode(TranscodeMode::DECODE, data, frames, count, quality, greyscale, scale);
+        run_mode(TranscodeMode::REQUANTIZE, data, frames, count, quality, greyscale, scale);
+    } else {
+        TranscodeMode mode;
+        if (!parse_transcode_mode(mode_name, &mode)) {
+            std::cerr << "Unknown mode: " << mode_name << "\n";
+            return 1;
+        }
+        run_mode(mode, data, frames, count, quality, greyscale, scale);
+    }
+
+    return 0;
+}
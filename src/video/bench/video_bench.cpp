@@ -0,0 +1,340 @@
+/*
+    Measure the whole video pipeline over loopback: capture, transcode, send, and receive
+
+    Streams come from a recorded MJPEG file or a generated test pattern, so no camera is needed.
+    For each quality setting the session is told the new quality with a control message,
+    given time to settle, and then measured from the receiving end
+*/
+
+#include <session.hpp>
+#include <stream.hpp>
+#include <rover_system_messages.hpp>
+
+#include <chrono>
+#include <algorithm>
+#include <ctime>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/program_options.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+namespace opt = boost::program_options;
+
+static std::vector<int> parse_list(const std::string& list) {
+    std::vector<int> values;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        values.push_back(std::stoi(item));
+    }
+    return values;
+}
+
+static std::vector<float> parse_fractions(const std::string& list) {
+    std::vector<float> values;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        values.push_back(std::stof(item));
+    }
+    return values;
+}
+
+static std::string latency_bound(uint32_t ms) {
+    return ms == std::numeric_limits<uint32_t>::max() ? std::string("inf") : std::to_string(ms);
+}
+
+int main(int argc, char* argv[]) {
+    std::string input_path;
+    std::string mode_name;
+    std::string quality_list;
+    unsigned width;
+    unsigned height;
+    unsigned fps;
+    int stream_count;
+    double warmup_s;
+    double duration_s;
+    bool static_scene;
+    bool mosaic;
+    int focus;
+    std::string roi_list;
+    unsigned roi_quality;
+    bool roi_weighted;
+    bool still;
+    uint16_t port;
+
+    opt::options_description opts("Usage");
+    opts.add_options()
+        ("help,h", "list these options")
+        ("input,i", opt::value<std::string>(&input_path), "MJPEG file to replay (default: generated test pattern)")
+        ("width", opt::value<unsigned>(&width)->default_value(CAMERA_WIDTH), "test pattern width")
+        ("height", opt::value<unsigned>(&height)->default_value(CAMERA_HEIGHT), "test pattern height")
+        ("fps,f", opt::value<unsigned>(&fps)->default_value(30), "frames per second of each stream")
+        ("streams,s", opt::value<int>(&stream_count)->default_value(1), "number of streams sent at once")
+        ("qualities,q", opt::value<std::string>(&quality_list)->default_value("10,30,50,70,90"), "comma separated JPEG qualities to measure")
+        ("mode,m", opt::value<std::string>(&mode_name)->default_value("decode"), "transcode mode")
+        ("static-scene", opt::bool_switch(&static_scene), "hold back frames while the scene does not change")
+        ("mosaic", opt::bool_switch(&mosaic), "also send a mosaic of every stream, on the stream after the last")
+        ("focus", opt::value<int>(&focus)->default_value(-1), "with --mosaic, the only stream also sent on its own (-1 = none)")
+        ("roi", opt::value<std::string>(&roi_list), "region of interest of every stream as x,y,width,height fractions of the frame")
+        ("roi-quality", opt::value<unsigned>(&roi_quality)->default_value(0), "quality of the region of interest (0 = the stream's quality)")
+        ("roi-weighted", opt::bool_switch(&roi_weighted), "send the whole frame with the region at its own quality, instead of cropping")
+        ("still", opt::bool_switch(&still), "take a still of stream 0 and download it while the streams are measured")
+        ("warmup", opt::value<double>(&warmup_s)->default_value(1.0), "seconds to settle after changing quality")
+        ("duration,d", opt::value<double>(&duration_s)->default_value(5.0), "seconds to measure each quality")
+        ("port,p", opt::value<uint16_t>(&port)->default_value(43200), "loopback stream port. The next two are used for control messages and announcements")
+    ;
+
+    std::vector<int> qualities;
+    std::vector<float> roi;
+    try {
+        opt::variables_map map;
+        opt::store(opt::parse_command_line(argc, argv, opts), map);
+        if (map.count("help")) {
+            std::cout << opts << "\n";
+            return 0;
+        }
+        opt::notify(map);
+        qualities = parse_list(quality_list);
+        if (!roi_list.empty()) roi = parse_fractions(roi_list);
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid options: " << e.what() << "\n" << opts << "\n";
+        return 1;
+    }
+
+    TranscodeMode mode;
+    if (!parse_transcode_mode(mode_name, &mode)) {
+        std::cerr << "Unknown transcode mode: " << mode_name << "\n";
+        return 1;
+    }
+    if (stream_count < 1 || stream_count > MAX_STREAMS || qualities.empty() || fps == 0) {
+        std::cerr << "Need at least one stream, quality, and frame per second\n" << opts << "\n";
+        return 1;
+    }
+    if (!roi.empty() && roi.size() != 4) {
+        std::cerr << "A region of interest is four fractions: x,y,width,height\n";
+        return 1;
+    }
+
+    logger::register_handler(logger::stderr_handler);
+    register_messages();
+
+    namespace tree = boost::property_tree;
+    tree::ptree cfg;
+    cfg.put("video.network.stream_ip.addr", "127.0.0.1");
+    cfg.put("video.network.stream_ip.port", port);
+    cfg.put("video.network.command_ip.port", port + 1);
+    cfg.put("video.network.announce_port", port + 2);
+    cfg.put("video.camera_init.jpeg_quality", qualities.front());
+    cfg.put("video.camera_init.transcode", mode_name);
+    cfg.put("video.camera_init.fps", fps);
+    cfg.put("video.camera_init.detect_cameras", false);
+    cfg.put("video.static_scene.enabled", static_scene);
+    cfg.put("video.mosaic.enabled", mosaic);
+    cfg.put("video.mosaic.stream", stream_count);
+    cfg.put("video.mosaic.focus", focus);
+    // Stills from earlier runs would be announced too
+    std::filesystem::path still_dir = std::filesystem::temp_directory_path() / "video_bench_stills";
+    std::filesystem::remove_all(still_dir);
+    cfg.put("video.stills.directory", still_dir.string());
+    for (int i = 0; i < stream_count; i++) {
+        std::string id = std::to_string(i);
+        cfg.put("video.camera_init.enable_streams." + id, true);
+        tree::ptree source;
+        source.put("file", input_path);
+        source.put("width", width);
+        source.put("height", height);
+        source.put("fps", fps);
+        cfg.put_child("video.sources." + id, source);
+    }
+
+    VideoConfig config;
+    if (!config.read_from(cfg)) {
+        return 1;
+    }
+
+    boost::asio::io_context session_ctx;
+    auto session_work = boost::asio::make_work_guard(session_ctx);
+    Session session(config, session_ctx);
+    session.start();
+    std::thread session_thread([&session_ctx] { session_ctx.run(); });
+
+    boost::asio::io_context recv_ctx;
+    auto recv_work = boost::asio::make_work_guard(recv_ctx);
+    net::StreamReceiver receiver(recv_ctx);
+    receiver.begin(port);
+    // The mosaic is one more stream
+    int receive_count = stream_count + (mosaic ? 1 : 0);
+    for (int i = 0; i < receive_count; i++) {
+        receiver.open_stream(i);
+    }
+    net::MessageSender control(recv_ctx, net::Destination(boost::asio::ip::address_v4::loopback(), port + 1));
+
+    // Still download, on the receive thread. Chunks are taken in order, and a gap or a stall asks again from the first missing byte
+    net::MessageReceiver still_receiver(recv_ctx, port + 2);
+    boost::asio::steady_timer still_timer(recv_ctx);
+    uint32_t still_id = 0;
+    std::vector<uint8_t> still_data;
+    uint32_t still_received = 0;
+    unsigned still_requests = 0;
+    std::chrono::steady_clock::time_point still_start, still_progress, still_end;
+    auto request_still = [&]() {
+        video_msg::StillRequest msg;
+        msg.data.set_id(still_id);
+        msg.data.set_offset(still_received);
+        control.send_message(msg);
+        still_requests++;
+        still_progress = std::chrono::steady_clock::now();
+    };
+    std::function<void()> watch_still = [&]() {
+        still_timer.expires_after(std::chrono::milliseconds(500));
+        still_timer.async_wait([&](const boost::system::error_code& ec) {
+            if (ec || (still_id && still_received == still_data.size())) return;
+            if (still_id && std::chrono::steady_clock::now() - still_progress > std::chrono::milliseconds(500)) request_still();
+            watch_still();
+        });
+    };
+    still_receiver.register_handler<video_msg::StreamAnnouncement>([&](const uint8_t buf[], std::size_t len) {
+        video::StreamAnnouncement msg;
+        if (still_id || !msg.ParseFromArray(buf, len) || msg.stills_size() == 0) return;
+        still_id = msg.stills(0).id();
+        still_data.resize(msg.stills(0).size());
+        still_start = std::chrono::steady_clock::now();
+        request_still();
+        watch_still();
+    });
+    still_receiver.register_handler<video_msg::StillChunk>([&](const uint8_t buf[], std::size_t len) {
+        video::StillChunk msg;
+        if (!msg.ParseFromArray(buf, len) || msg.id() != still_id || still_received == still_data.size()) return;
+        if (msg.offset() != still_received || msg.offset() + msg.data().size() > still_data.size()) {
+            if (msg.offset() > still_received) request_still();
+            return;
+        }
+        std::copy(msg.data().begin(), msg.data().end(), still_data.begin() + still_received);
+        still_received += msg.data().size();
+        still_progress = std::chrono::steady_clock::now();
+        if (still_received == still_data.size()) still_end = still_progress;
+    });
+    std::thread recv_thread([&recv_ctx] { recv_ctx.run(); });
+
+    std::cout << "Sending " << stream_count << " stream(s) of " << (input_path.empty() ? "test pattern" : input_path)
+        << " at " << fps << " fps over loopback, " << get_transcode_mode_string(mode) << " mode\n";
+    if (mode == TranscodeMode::PASSTHROUGH) {
+        std::cout << "Passthrough sends the source's frames unchanged: quality has no effect\n";
+    }
+
+    if (!roi.empty()) {
+        // Messages are built on the receive thread, because a copied message still refers to the original's data
+        boost::asio::post(recv_ctx, [&]() {
+            for (int i = 0; i < stream_count; i++) {
+                video_msg::RegionOfInterest msg;
+                msg.data.set_stream(i);
+                msg.data.set_enabled(true);
+                msg.data.set_x(roi[0]);
+                msg.data.set_y(roi[1]);
+                msg.data.set_width(roi[2]);
+                msg.data.set_height(roi[3]);
+                msg.data.set_quality(roi_quality);
+                msg.data.set_weighted(roi_weighted);
+                control.send_message(msg);
+            }
+        });
+    }
+
+    for (int quality : qualities) {
+        boost::asio::post(recv_ctx, [&control, quality]() {
+            video_msg::Quality msg;
+            msg.data.set_jpeg_quality(quality);
+            msg.data.set_grayscale(false);
+            control.send_message(msg);
+        });
+
+        std::this_thread::sleep_for(std::chrono::duration<double>(warmup_s));
+        // Once the sources are open, so the still is downloaded while the first quality is measured
+        if (still && quality == qualities.front()) {
+            boost::asio::post(recv_ctx, [&control]() {
+                video_msg::StillCapture msg;
+                msg.data.set_stream(0);
+                control.send_message(msg);
+            });
+        }
+        for (int i = 0; i < receive_count; i++) {
+            receiver.take_stats(i);
+        }
+        session.dropped_frames = 0;
+        session.suppressed_frames = 0;
+
+        auto wall_start = std::chrono::steady_clock::now();
+        std::clock_t cpu_start = std::clock();
+        std::this_thread::sleep_for(std::chrono::duration<double>(duration_s));
+        std::clock_t cpu_end = std::clock();
+        double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+        net::StreamStats total;
+        net::StreamStats mosaic_stats;
+        for (int i = 0; i < receive_count; i++) {
+            net::StreamStats stats = receiver.take_stats(i);
+            if (i == stream_count) mosaic_stats = stats;
+            total.frames_completed += stats.frames_completed;
+            total.frames_dropped += stats.frames_dropped;
+            total.bytes_received += stats.bytes_received;
+            total.latency_samples += stats.latency_samples;
+            total.latency_sum_us += stats.latency_sum_us;
+            total.latency_max_us = std::max(total.latency_max_us, stats.latency_max_us);
+            for (std::size_t b = 0; b < net::StreamStats::LATENCY_BUCKETS; b++) {
+                total.latency_histogram[b] += stats.latency_histogram[b];
+            }
+        }
+        // Includes the receiver, which runs in this process too
+        double cpu_ms = 1000.0 * (cpu_end - cpu_start) / CLOCKS_PER_SEC;
+        uint32_t frames = total.frames_completed;
+
+        std::cout << "quality " << quality << ":\n";
+        std::cout << "\tframes/s:        " << frames / wall_s << "\n";
+        std::cout << "\tKiB/s:           " << total.bytes_received / wall_s / 1024 << "\n";
+        std::cout << "\tavg frame size:  " << (frames ? total.bytes_received / frames : 0) << " bytes\n";
+        std::cout << "\tdropped frames:  " << session.dropped_frames.load() << " by the sender, " << total.frames_dropped << " in transit\n";
+        if (mosaic) {
+            std::cout << "\tmosaic:          " << mosaic_stats.frames_completed / wall_s << " frames/s, "
+                << (mosaic_stats.frames_completed ? mosaic_stats.bytes_received / mosaic_stats.frames_completed : 0) << " bytes avg\n";
+        }
+        if (static_scene) {
+            std::cout << "\tstatic frames:   " << session.suppressed_frames.load() << " held back\n";
+        }
+        std::cout << "\tlatency:         mean " << total.mean_latency_ms() << " ms, p50 < " << latency_bound(total.latency_percentile_ms(50))
+            << " ms, p95 < " << latency_bound(total.latency_percentile_ms(95)) << " ms, max " << total.latency_max_us / 1000.0 << " ms\n";
+        std::cout << "\tcpu ms/frame:    " << (frames ? cpu_ms / frames : 0.0) << "\n";
+    }
+
+    if (still) {
+        // Read on the receive thread, which is still writing them
+        std::promise<void> printed;
+        boost::asio::post(recv_ctx, [&]() {
+            if (!still_id) {
+                std::cout << "still: not taken\n";
+            } else if (still_received < still_data.size()) {
+                std::cout << "still: " << still_received << " of " << still_data.size() << " bytes received, " << still_requests << " request(s)\n";
+            } else {
+                double seconds = std::chrono::duration<double>(still_end - still_start).count();
+                std::cout << "still: " << still_data.size() << " bytes in " << seconds << " s (" << still_data.size() / seconds / 1024
+                    << " KiB/s), " << still_requests << " request(s)\n";
+            }
+            printed.set_value();
+        });
+        printed.get_future().wait();
+    }
+
+    session_work.reset();
+    recv_work.reset();
+    session_ctx.stop();
+    recv_ctx.stop();
+    session_thread.join();
+    recv_thread.join();
+}
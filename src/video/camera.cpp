@@ -4,8 +4,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <time.h>
 #include <stdio.h>
 
 #include "camera.hpp"
@@ -21,7 +22,7 @@ const char* get_error_string(Error error) {
     return error_names[(int) error];
 }
 
-bool is_video_device(const char* dev_name) {
+bool is_video_device(const char* dev_name, char (*out_name)[32], char (*out_hardware_location)[32]) {
     auto fd = ::open(dev_name, O_RDONLY);
     if (fd == -1) return false;
 
@@ -29,23 +30,244 @@ bool is_video_device(const char* dev_name) {
     struct v4l2_capability cap;
 
     // Query for capability.
-    if (ioctl(fd, VIDIOC_QUERYCAP, &cap) != 0) {
+    bool queried = ioctl(fd, VIDIOC_QUERYCAP, &cap) == 0;
+    ::close(fd);
+    if (!queried) {
         return false;
     }
 
+    if (out_name) {
+        strncpy(*out_name, (char*) cap.card, sizeof(*out_name) - 1);
+        (*out_name)[sizeof(*out_name) - 1] = '\0';
+    }
+    if (out_hardware_location) {
+        strncpy(*out_hardware_location, (char*) cap.bus_info, sizeof(*out_hardware_location) - 1);
+        (*out_hardware_location)[sizeof(*out_hardware_location) - 1] = '\0';
+    }
+
     // Does the camera support video capture?
     return (cap.device_caps & V4L2_CAP_VIDEO_CAPTURE) && (cap.device_caps & V4L2_CAP_STREAMING);
 
 }
 
-Error open(CaptureSession* session, const char* device_filepath, size_t width, size_t height, uint8_t dev_id, util::Clock* clock, int framerate) {
+// Pick the slowest frame interval the driver lists that is still at least fps
+// frames per second, or the slowest one available if the camera cannot go that slow.
+// Returns false if the driver does not enumerate discrete intervals.
+static bool choose_frame_interval(CaptureSession* session, unsigned fps, struct v4l2_fract* out_interval) {
+    struct v4l2_frmivalenum ival;
+    memset(&ival, 0, sizeof(ival));
+    ival.pixel_format = session->pixel_format;
+    ival.width = session->width;
+    ival.height = session->height;
+
+    bool found = false;
+    bool found_fast_enough = false;
+    double best_fps = 0;
+
+    for (ival.index = 0; ioctl(session->fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0; ival.index++) {
+        if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+            // Stepwise or continuous: any rate in range works, so ask for exactly what we want
+            out_interval->numerator = 1;
+            out_interval->denominator = fps;
+            return true;
+        }
+        if (ival.discrete.numerator == 0) continue;
+
+        double rate = (double) ival.discrete.denominator / ival.discrete.numerator;
+        bool fast_enough = rate >= fps;
+
+        // Prefer rates that are fast enough, and among those the slowest.
+        // Otherwise take the fastest of the rates that are too slow.
+        bool better = !found
+            || (fast_enough && !found_fast_enough)
+            || (fast_enough && rate < best_fps)
+            || (!fast_enough && !found_fast_enough && rate > best_fps);
+
+        if (better) {
+            *out_interval = ival.discrete;
+            best_fps = rate;
+            found = true;
+            found_fast_enough = fast_enough;
+        }
+    }
+    return found;
+}
+
+// Whether the driver lists width x height for a format.
+// Drivers that do not enumerate frame sizes are assumed to support it.
+static bool supports_frame_size(int fd, uint32_t format, size_t width, size_t height) {
+    struct v4l2_frmsizeenum size;
+    memset(&size, 0, sizeof(size));
+    size.pixel_format = format;
+
+    for (size.index = 0; ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++) {
+        if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+            if (size.discrete.width == width && size.discrete.height == height) return true;
+        } else {
+            const struct v4l2_frmsize_stepwise& range = size.stepwise;
+            return width >= range.min_width && width <= range.max_width
+                && height >= range.min_height && height <= range.max_height
+                && (range.step_width == 0 || (width - range.min_width) % range.step_width == 0)
+                && (range.step_height == 0 || (height - range.min_height) % range.step_height == 0);
+        }
+    }
+    return size.index == 0;
+}
+
+// The fastest rate the driver lists for a format and size (0 if it does not list any).
+static double max_framerate(int fd, uint32_t format, size_t width, size_t height) {
+    struct v4l2_frmivalenum ival;
+    memset(&ival, 0, sizeof(ival));
+    ival.pixel_format = format;
+    ival.width = width;
+    ival.height = height;
+
+    double best = 0;
+    for (ival.index = 0; ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0; ival.index++) {
+        // Stepwise or continuous: the minimum interval is the fastest rate
+        const struct v4l2_fract& interval = (ival.type == V4L2_FRMIVAL_TYPE_DISCRETE) ? ival.discrete : ival.stepwise.min;
+        if (interval.numerator != 0) {
+            double rate = (double) interval.denominator / interval.numerator;
+            if (rate > best) best = rate;
+        }
+        if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE) break;
+    }
+    return best;
+}
+
+// Pick the pixel format to capture in. Of our formats that the camera offers at the
+// session's size, take the first (in order of preference) that is fast enough for fps,
+// or else the first one offered. Returns false if the camera offers none of them.
+static bool choose_pixel_format(CaptureSession* session, unsigned fps, const CaptureOptions* options, uint32_t* out_format) {
+    uint32_t preference[sizeof(PIXEL_FORMATS) / sizeof(PIXEL_FORMATS[0])];
+    size_t num_formats = 0;
+    if (options->pixel_format != 0) {
+        preference[num_formats++] = options->pixel_format;
+    } else {
+        if (options->prefer_raw) {
+            preference[num_formats++] = V4L2_PIX_FMT_YUYV;
+        }
+        for (uint32_t format : PIXEL_FORMATS) {
+            if (!(options->prefer_raw && format == V4L2_PIX_FMT_YUYV)) preference[num_formats++] = format;
+        }
+    }
+
+    // Which of our formats the driver lists
+    bool offered[sizeof(preference) / sizeof(preference[0])] = {};
+    struct v4l2_fmtdesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (desc.index = 0; ioctl(session->fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++) {
+        for (size_t i = 0; i < num_formats; i++) {
+            if (desc.pixelformat == preference[i]) offered[i] = true;
+        }
+    }
+
+    bool found = false;
+    for (size_t i = 0; i < num_formats; i++) {
+        if (!offered[i] || !supports_frame_size(session->fd, preference[i], session->width, session->height)) continue;
+
+        double rate = max_framerate(session->fd, preference[i], session->width, session->height);
+        if (fps == 0 || rate == 0 || rate >= fps) {
+            *out_format = preference[i];
+            return true;
+        }
+        if (!found) {
+            *out_format = preference[i];
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool largest_frame_size(const char* dev_name, size_t* out_width, size_t* out_height) {
+    auto fd = ::open(dev_name, O_RDONLY);
+    if (fd == -1) return false;
+
+    size_t best_width = 0, best_height = 0;
+    for (uint32_t format : PIXEL_FORMATS) {
+        struct v4l2_frmsizeenum size;
+        memset(&size, 0, sizeof(size));
+        size.pixel_format = format;
+
+        for (size.index = 0; ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++) {
+            // Stepwise or continuous: the maximum is the largest
+            size_t width = (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) ? size.discrete.width : size.stepwise.max_width;
+            size_t height = (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) ? size.discrete.height : size.stepwise.max_height;
+            if (width * height > best_width * best_height) {
+                best_width = width;
+                best_height = height;
+            }
+            if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE) break;
+        }
+    }
+    ::close(fd);
+
+    if (best_width == 0) return false;
+    *out_width = best_width;
+    *out_height = best_height;
+    return true;
+}
+
+Error set_framerate(CaptureSession* session, unsigned fps) {
+    session->target_fps = fps;
+    Error result = Error::OK;
+
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    // Only ask the driver if it supports setting the frame interval at all
+    if (fps > 0 && ioctl(session->fd, VIDIOC_G_PARM, &parm) == 0 && (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+        struct v4l2_fract interval;
+        if (!choose_frame_interval(session, fps, &interval)) {
+            interval.numerator = 1;
+            interval.denominator = fps;
+        }
+        parm.parm.capture.timeperframe = interval;
+
+        if (ioctl(session->fd, VIDIOC_S_PARM, &parm) != 0) {
+            result = Error::SET_FRAMERATE;
+        }
+    }
+
+    // Read back what the driver is actually doing.
+    session->native_fps = 0;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl(session->fd, VIDIOC_G_PARM, &parm) == 0 && parm.parm.capture.timeperframe.numerator != 0) {
+        struct v4l2_fract tpf = parm.parm.capture.timeperframe;
+        session->native_fps = (tpf.denominator + tpf.numerator - 1) / tpf.numerator;
+    }
+
+    // Drop frames in software only when the camera delivers more than we want.
+    // Allow 10% early arrival so jitter does not make us drop every other frame.
+    uint32_t interval_ms = 0;
+    if (fps > 0 && (session->native_fps == 0 || session->native_fps > fps)) {
+        interval_ms = (1000 / fps) * 9 / 10;
+    }
+    session->timer.interval = interval_ms;
+
+    return result;
+}
+
+Error open(CaptureSession* session, const char* device_filepath, size_t width, size_t height, uint8_t dev_id, util::Clock* clock, unsigned fps, const CaptureOptions* options) {
     // Set the width and height.
     session->width = width;
     session->height = height;
     session->dev_video_id = dev_id;
 
+    // No buffers yet, so `close` is safe to call if opening fails partway.
+    session->num_buffers = 0;
+    for (unsigned i = 0; i < MAX_BUFFERS; i++) {
+        session->buffers[i].data = nullptr;
+        session->buffers[i].size = 0;
+        session->buffers[i].dmabuf_fd = -1;
+    }
+
     // Call Linux open on the device file.
-    session->fd = ::open(device_filepath, O_RDWR);
+    // Non-blocking so the caller can wait for frames with poll/epoll and never stalls in grab_frame.
+    session->fd = ::open(device_filepath, O_RDWR | O_NONBLOCK);
     // On failure, open returns -1.
     if (session->fd == -1) {
         return Error::OPEN;
@@ -91,9 +313,17 @@ Error open(CaptureSession* session, const char* device_filepath, size_t width, s
         return Error::QUERY_FORMAT;
     }
 
+    CaptureOptions default_options;
+    if (!options) options = &default_options;
+
+    // Find the cheapest of our formats the camera can capture in.
+    if (!choose_pixel_format(session, fps, options, &session->pixel_format)) {
+        return Error::UNSUPPORTED_FORMAT;
+    }
+
     // Then set the pixel format we want.
     // Also set our desired resolution.
-    fmt.fmt.pix.pixelformat = PIXEL_FORMAT;
+    fmt.fmt.pix.pixelformat = session->pixel_format;
     fmt.fmt.pix.width = session->width;
     fmt.fmt.pix.height = session->height;
 
@@ -105,7 +335,7 @@ Error open(CaptureSession* session, const char* device_filepath, size_t width, s
     // Check the returned pixel format.
     // If the camera does not support the pixel format we desire,
     // it will return whatever it can use.
-    if (fmt.fmt.pix.pixelformat != PIXEL_FORMAT) {
+    if (fmt.fmt.pix.pixelformat != session->pixel_format) {
         return Error::UNSUPPORTED_FORMAT;
     }
 
@@ -116,35 +346,41 @@ Error open(CaptureSession* session, const char* device_filepath, size_t width, s
 
     // Record the frame size (in bytes).
     session->image_size = (size_t) fmt.fmt.pix.sizeimage;
+    session->bytes_per_line = fmt.fmt.pix.bytesperline ? (size_t) fmt.fmt.pix.bytesperline : session->width * 2;
+
+    // Negotiate the capture rate so the camera only produces frames we will use.
+    // A refusal here is not fatal: the software limit still applies.
+    util::Timer::init(&(session->timer), 0, clock);
+    set_framerate(session, fps);
 
     //
     // Buffer Initialization.
     //
 
+    session->memory = options->memory;
+    uint32_t v4l2_memory = (session->memory == MemoryMode::MMAP) ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+
     // Allocate and clear a requestbuffers struct, since we need it later.
     struct v4l2_requestbuffers req;
     memset(&req, 0, sizeof(req));
 
     // Number of buffers to register.
-    req.count = NUM_BUFFERS;
+    req.count = options->buffer_count;
+    if (req.count < 2) req.count = 2;
+    if (req.count > MAX_BUFFERS) req.count = MAX_BUFFERS;
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    // Specify the memory mode. We are using "user pointer" mode.
-    // We will supply pointers to buffers we allocate.
-    req.memory = V4L2_MEMORY_USERPTR;
+    // Specify the memory mode.
+    // MMAP: the driver allocates buffers that we map.
+    // USERPTR: we will supply pointers to buffers we allocate.
+    req.memory = v4l2_memory;
 
-    // Request the ability to use our own buffers.
-    if (ioctl(session->fd, VIDIOC_REQBUFS, &req) != 0) {
+    // Request the buffers. The driver may give us a different number than we asked for.
+    if (ioctl(session->fd, VIDIOC_REQBUFS, &req) != 0 || req.count == 0 || req.count > MAX_BUFFERS) {
         return Error::REQUEST_BUFFERS;
     }
 
-    // Allocate our buffers.
-    for (uint32_t i = 0; i < NUM_BUFFERS; i++) {
-        session->buffers[i].size = session->image_size;
-        session->buffers[i].data = new uint8_t[session->image_size];
-    }
-
-    // Link each buffer with the driver.
-    for (uint32_t i = 0; i < NUM_BUFFERS; i++) {
+    // Set up and link each buffer with the driver.
+    for (uint32_t i = 0; i < req.count; i++) {
         // Allocate a V4L2 "buffer".
         // This really isn't a buffer, but a struct that contains information
         // about the buffers we will provide.
@@ -152,14 +388,49 @@ Error open(CaptureSession* session, const char* device_filepath, size_t width, s
         memset(&vbuf, 0, sizeof(vbuf));
 
         vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        // USERPTR mode: provide our own pointers.
-        vbuf.memory = V4L2_MEMORY_USERPTR;
+        vbuf.memory = v4l2_memory;
         // Which buffer is this?
         vbuf.index = i;
-        // Pointer to buffer's data.
-        vbuf.m.userptr = (unsigned long) session->buffers[i].data;
-        // How big is the buffer?
-        vbuf.length = session->buffers[i].size;
+
+        Buffer& buf = session->buffers[i];
+
+        if (session->memory == MemoryMode::MMAP) {
+            // Ask where the driver's buffer is and how big it is.
+            if (ioctl(session->fd, VIDIOC_QUERYBUF, &vbuf) != 0) {
+                return Error::MAP_BUFFERS;
+            }
+
+            void* mapped = mmap(NULL, vbuf.length, PROT_READ | PROT_WRITE, MAP_SHARED, session->fd, vbuf.m.offset);
+            if (mapped == MAP_FAILED) {
+                return Error::MAP_BUFFERS;
+            }
+            buf.data = (uint8_t*) mapped;
+            buf.size = vbuf.length;
+            session->num_buffers = i + 1;
+
+            if (options->export_dmabuf) {
+                struct v4l2_exportbuffer expbuf;
+                memset(&expbuf, 0, sizeof(expbuf));
+                expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                expbuf.index = i;
+                expbuf.flags = O_RDONLY | O_CLOEXEC;
+
+                if (ioctl(session->fd, VIDIOC_EXPBUF, &expbuf) != 0) {
+                    return Error::EXPORT_BUFFERS;
+                }
+                buf.dmabuf_fd = expbuf.fd;
+            }
+        } else {
+            // USERPTR mode: provide our own pointers.
+            buf.size = session->image_size;
+            buf.data = new uint8_t[session->image_size];
+            session->num_buffers = i + 1;
+
+            // Pointer to buffer's data.
+            vbuf.m.userptr = (unsigned long) buf.data;
+            // How big is the buffer?
+            vbuf.length = buf.size;
+        }
 
         // Link the buffer.
         if (ioctl(session->fd, VIDIOC_QBUF, &vbuf) != 0) {
@@ -167,12 +438,6 @@ Error open(CaptureSession* session, const char* device_filepath, size_t width, s
         }
     }
 
-    // Initialize the frame buffer.
-    session->frame_buffer = new uint8_t[session->image_size];
-
-    // Start the timer.
-    util::Timer::init(&(session->timer), framerate, clock);
-
     return Error::OK;
 }
 
@@ -188,62 +453,83 @@ Error start(CaptureSession* session) {
     return Error::OK;
 }
 
-Error grab_frame(CaptureSession* session, uint8_t** out_frame, size_t* out_frame_size) {
-    // Set up structs for the select call.
-    fd_set fds;
-    struct timeval tv;
-
-    // Set up our file descriptors to watch (only fd).
-    FD_ZERO(&fds);
-    FD_SET(session->fd, &fds);
-
-    // Set the timeout.
-    
-    tv.tv_sec = 0;
-    //tv.tv_usec = SELECT_TIMEOUT * 1000;
-    tv.tv_usec = 0;
-
-    // Wait for the next frame. See man select(2) for more information.
-    if (select(session->fd + 1, &fds, NULL, NULL, &tv) == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            return Error::AGAIN;
+// Convert a dequeued buffer's timestamp to microseconds since the Unix epoch.
+// Drivers stamp frames with the monotonic clock, which is meaningless on another machine.
+static uint64_t get_capture_time(const struct v4l2_buffer& vbuf) {
+    struct timespec now_real;
+    clock_gettime(CLOCK_REALTIME, &now_real);
+    uint64_t now_us = now_real.tv_sec * 1000000ULL + now_real.tv_nsec / 1000;
 
-        return Error::SELECT;
+    // Without a monotonic timestamp, the frame is assumed to be fresh
+    if ((vbuf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        return now_us;
     }
 
+    struct timespec now_mono;
+    clock_gettime(CLOCK_MONOTONIC, &now_mono);
+    int64_t age_us = (now_mono.tv_sec - vbuf.timestamp.tv_sec) * 1000000LL + now_mono.tv_nsec / 1000 - vbuf.timestamp.tv_usec;
+    return (age_us > 0) ? now_us - age_us : now_us;
+}
+
+Error grab_frame(CaptureSession* session, uint8_t** out_frame, size_t* out_frame_size, uint32_t* out_index, uint64_t* out_capture_time) {
     // Set up the video4linux "buffer" (which points to our buffer).
     struct v4l2_buffer vbuf;
     memset(&vbuf, 0, sizeof(vbuf));
 
     vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vbuf.memory = V4L2_MEMORY_USERPTR;
+    vbuf.memory = (session->memory == MemoryMode::MMAP) ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
 
-    // Read the frame.
+    // Read the frame. The device is non-blocking, so this fails with EAGAIN if no buffer is filled yet.
     if (ioctl(session->fd, VIDIOC_DQBUF, &vbuf) != 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return Error::AGAIN;
+
+        return Error::READ_FRAME;
+    }
+
+    if (vbuf.index >= session->num_buffers) {
         return Error::READ_FRAME;
     }
 
     // Get the pointer to our frame data.
-    *out_frame = (uint8_t*) vbuf.m.userptr;
+    *out_frame = session->buffers[vbuf.index].data;
 
     // Get the actual size of the frame data.
     *out_frame_size = vbuf.bytesused;
 
-    // Set the buffer we used!
-    session->last_capture_buffer = vbuf;
+    // Which buffer to return later.
+    *out_index = vbuf.index;
+
+    if (out_capture_time) {
+        *out_capture_time = get_capture_time(vbuf);
+    }
 
     // Now that we actually got a frame, only return it if we actually need it.
     if (!session->timer.ready()) {
-        return_buffer(session);
+        return_buffer(session, vbuf.index);
         return Error::AGAIN;
     }
 
     return Error::OK;
 }
 
-Error return_buffer(CaptureSession* session) {
+Error return_buffer(CaptureSession* session, uint32_t index) {
+    struct v4l2_buffer vbuf;
+    memset(&vbuf, 0, sizeof(vbuf));
+
+    vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vbuf.index = index;
+
+    if (session->memory == MemoryMode::MMAP) {
+        vbuf.memory = V4L2_MEMORY_MMAP;
+    } else {
+        vbuf.memory = V4L2_MEMORY_USERPTR;
+        vbuf.m.userptr = (unsigned long) session->buffers[index].data;
+        vbuf.length = session->buffers[index].size;
+    }
+
     // Reset the buffer we just used.
-    if (ioctl(session->fd, VIDIOC_QBUF, &session->last_capture_buffer) != 0) {
+    if (ioctl(session->fd, VIDIOC_QBUF, &vbuf) != 0) {
         return Error::PREPARE_BUFFER;
     }
 
@@ -251,10 +537,28 @@ Error return_buffer(CaptureSession* session) {
 }
 
 void close(CaptureSession* session) {
-    ::close(session->fd);
+    if (session->fd != -1) {
+        // Stop the stream so the driver releases its references to our buffers.
+        enum v4l2_buf_type buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        ioctl(session->fd, VIDIOC_STREAMOFF, &buf_type);
+    }
+
+    for (unsigned i = 0; i < session->num_buffers; i++) {
+        Buffer& buf = session->buffers[i];
+        if (session->memory == MemoryMode::MMAP) {
+            munmap(buf.data, buf.size);
+        } else {
+            delete[] buf.data;
+        }
+        if (buf.dmabuf_fd != -1) {
+            ::close(buf.dmabuf_fd);
+        }
+    }
+    session->num_buffers = 0;
 
-    for (int i = 0; i < NUM_BUFFERS; i++) {
-        delete[] session->buffers[i].data;
+    if (session->fd != -1) {
+        ::close(session->fd);
+        session->fd = -1;
     }
 }
 
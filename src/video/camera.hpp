@@ -27,14 +27,20 @@
             // ... handle error ...
 
             while (true) {
+                // Wait for a frame: the device is non-blocking.
+                struct pollfd pfd = { session.fd, POLLIN, 0 };
+                poll(&pfd, 1, -1);
+
                 // Grab a frame.
                 uint8_t* frame_buffer;
                 size_t frame_size;
-                err = camera::grab_frame(&session, &frame_buffer, &frame_size);
-                // ... handle error ...
+                uint32_t buffer_index;
+                uint64_t capture_time;
+                err = camera::grab_frame(&session, &frame_buffer, &frame_size, &buffer_index, &capture_time);
+                // ... handle error (Error::AGAIN: no frame yet) ...
 
                 // Return the buffer.
-                err = camera::return_buffer(&session, frame_buffer);
+                err = camera::return_buffer(&session, buffer_index);
                 // ... handle error ...
 
                 if (program_should_close) break;
@@ -51,22 +57,50 @@ namespace camera {
 // The number of buffers to use while capturing frames.
 // Since each buffer corresponds to a single frame, this value represents
 // the maximum number of frames which can be read at a time.
-const int NUM_BUFFERS = 4;
+// Frames sent by reference keep their buffer until sent, so more buffers
+// may be needed to keep the camera from stalling.
+const unsigned DEFAULT_NUM_BUFFERS = 4;
+const unsigned MAX_BUFFERS = 32;
+
+// The video formats we accept, in the order we prefer them.
+// MJPEG frames can be sent or requantized without decoding. YUYV is
+// uncompressed, so its frames are compressed directly with no JPEG decode.
+const uint32_t PIXEL_FORMATS[] = { V4L2_PIX_FMT_MJPEG, V4L2_PIX_FMT_YUYV };
+
+// How frame buffers are shared with the driver.
+enum class MemoryMode {
+    // The driver allocates buffers and we map them into our address space. No copies.
+    MMAP,
+    // We allocate buffers and give the driver pointers to them.
+    USERPTR
+};
+
+// Capture settings that are not part of the image format.
+struct CaptureOptions {
+    MemoryMode memory = MemoryMode::MMAP;
+
+    // Number of buffers to request. The driver may adjust this.
+    unsigned buffer_count = DEFAULT_NUM_BUFFERS;
 
-// The video format we accept. This is pretty standard, but some
-// webcams may use a different one. We need to make sure that
-// the ones we use will support this. If not, it is not so hard
-// to change later.
-const uint32_t PIXEL_FORMAT = V4L2_PIX_FMT_MJPEG;
+    // Export each buffer as a DMABUF file descriptor (MMAP only) so hardware
+    // encoders or other devices can read frames without a copy.
+    bool export_dmabuf = false;
 
-// The timeout used when waiting for frames, in milliseconds.
-// TODO: Make this more reasonable.
-const int SELECT_TIMEOUT = 50;
+    // Capture in this format only (0 = choose from PIXEL_FORMATS).
+    uint32_t pixel_format = 0;
+
+    // When choosing, prefer YUYV over MJPEG if the camera offers both at the
+    // requested size and rate. Cheaper when every frame is decoded and re-encoded anyway.
+    bool prefer_raw = false;
+};
 
 // Represents a buffer that has a size.
 struct Buffer {
     size_t size;
     uint8_t* data;
+
+    // DMABUF file descriptor for the buffer, or -1 if not exported.
+    int dmabuf_fd;
 };
 
 // Represents an open capture session for a specific camera.
@@ -85,14 +119,19 @@ struct CaptureSession {
     // The size of each frame, in bytes.
     size_t image_size;
 
-    // An array of buffers to use when reading from the camera.
-    Buffer buffers[NUM_BUFFERS];
+    // The pixel format frames are captured in (one of PIXEL_FORMATS).
+    uint32_t pixel_format;
+
+    // The length of each row of a YUYV frame, in bytes, including any padding.
+    size_t bytes_per_line;
 
-    // A buffer to use when capturing frames.
-    uint8_t* frame_buffer;
+    // How buffers are shared with the driver.
+    MemoryMode memory;
 
-    // The last buffer we used to capture a frame.
-    struct v4l2_buffer last_capture_buffer;
+    // An array of buffers to use when reading from the camera.
+    // Only the first num_buffers are valid.
+    Buffer buffers[MAX_BUFFERS];
+    unsigned num_buffers;
 
     // The name of the camera.
     char name[32];
@@ -102,7 +141,14 @@ struct CaptureSession {
     // unless a camera is moved to a different port on the machine.
     char hardware_location[32];
 
-    // A timer that limits the camera's framerate.
+    // The framerate requested by the user (0 = no limit).
+    unsigned target_fps;
+
+    // The framerate the driver agreed to capture at (0 if the driver does not report it).
+    unsigned native_fps;
+
+    // A timer that limits the camera's framerate when the driver cannot capture
+    // at the target rate itself. Its interval is 0 when the driver handles it.
     util::Timer timer;
 };
 
@@ -114,7 +160,7 @@ struct CaptureSession {
 #define ERROR_DEF(X) \
     X(OK), X(AGAIN), X(OPEN), X(QUERY_CAPABILITIES), X(NO_VIDEOCAPTURE), X(NO_STREAMING), X(QUERY_FORMAT), X(SET_FORMAT), \
         X(UNSUPPORTED_FORMAT), X(UNSUPPORTED_RESOLUTION), X(REQUEST_BUFFERS), X(LINK_BUFFERS), X(START_STREAM), \
-        X(SELECT), X(READ_FRAME), X(PREPARE_BUFFER)
+        X(SELECT), X(READ_FRAME), X(PREPARE_BUFFER), X(MAP_BUFFERS), X(EXPORT_BUFFERS), X(SET_FRAMERATE)
 
 /*
     Enum definition for the error values.
@@ -137,6 +183,10 @@ const char* get_error_string(Error error);
     located at the given device filepath. Then ensures that the chosen device
     supports the chosen resolution and data format.
 
+    The pixel format is negotiated from the formats the driver lists (VIDIOC_ENUM_FMT).
+    Among the formats in PIXEL_FORMATS that are offered at the requested size, the
+    first one that can capture at fps is used, in the order set by `options`.
+
     Once the above is checked, the buffers used for frame transfer are initialized.
 
     Parameters:
@@ -145,7 +195,10 @@ const char* get_error_string(Error error);
         width, height: The capture resolution.
         dev_video_id: The /dev/video* id.
         clock: A clock to use for framerate limiting.
-        framerate: The max framerate of the camera.
+        fps: The max framerate of the camera (0 = as fast as the camera runs).
+             The driver is asked to capture at this rate so unneeded frames are never
+             captured. If it cannot go that slow, extra frames are dropped in `grab_frame`.
+        options: Buffer settings. Uses the CaptureOptions defaults if null.
 
     Returns:
         Error::OK on success, and a suitable error on failure:
@@ -155,14 +208,62 @@ const char* get_error_string(Error error);
             Error::NO_STREAMING: The device does not support video streaming.
             Error::QUERY_FORMAT: Failed to retrieve device pixel format and resolution.
             Error::SET_FORMAT: Failed to offer our desired format to the device.
-            Error::UNSUPPORTED_FORMAT: The device does not support our format.
+            Error::UNSUPPORTED_FORMAT: The device does not support any of our formats.
             Error::UNSUPPORTED_RESOLUTION: The device does not support the supplied resolution.
             Error::REQUEST_BUFFERS: Failed to request the ability to use our buffers.
             Error::LINK_BUFFERS: Failed to link our buffers to the device.
+            Error::MAP_BUFFERS: Failed to map the driver's buffers (MMAP mode).
+            Error::EXPORT_BUFFERS: Failed to export DMABUF file descriptors.
+*/
+Error open(CaptureSession* session, const char* device_filepath, size_t width, size_t height, uint8_t dev_video_id, util::Clock* clock, unsigned fps, const CaptureOptions* options = nullptr);
+
+/*
+    Changes the capture framerate of an open session, choosing the closest rate
+    the driver supports that is not faster than requested.
+
+    Many drivers refuse to change the rate while streaming. In that case the
+    software limit is still updated, and the caller may reopen the camera to
+    apply the rate natively.
+
+    Parameters:
+        session: The capture session.
+        fps: The max framerate (0 = no limit).
+
+    Returns:
+        Error::OK if the driver accepted the rate (or does not support setting it).
+        Error::SET_FRAMERATE if the driver refused the rate.
+*/
+Error set_framerate(CaptureSession* session, unsigned fps);
+
+/*
+    Checks whether a device can capture and stream video, and reads its identity.
+
+    Parameters:
+        dev_name: The device path.
+
+    Return Parameters:
+        out_name: The camera's name, as in CaptureSession::name. May be null.
+        out_hardware_location: The camera's port, as in CaptureSession::hardware_location. May be null.
+
+    Returns:
+        True if the device supports video capture and streaming.
 */
-Error open(CaptureSession* session, const char* device_filepath, size_t width, size_t height, uint8_t dev_video_id, util::Clock* clock, int framerate);
+bool is_video_device(const char* dev_name, char (*out_name)[32] = nullptr, char (*out_hardware_location)[32] = nullptr);
+
+/*
+    Finds the largest frame size a device offers in one of our formats, by area.
+    Used to capture stills at the camera's full resolution.
+
+    Parameters:
+        dev_name: The device path. The device may be streaming in another session.
+
+    Return Parameters:
+        out_width, out_height: The largest size (on success).
 
-bool is_video_device(const char* dev_name);
+    Returns:
+        True if the driver lists a frame size for one of PIXEL_FORMATS.
+*/
+bool largest_frame_size(const char* dev_name, size_t* out_width, size_t* out_height);
 
 /*
     Starts the capture session. The device will begin to offer frames.
@@ -177,9 +278,13 @@ bool is_video_device(const char* dev_name);
 Error start(CaptureSession* session);
 
 /*
-    Grabs the next frame from the camera device.
+    Grabs the next frame from the camera device. Does not block: wait for the
+    session's `fd` to become readable (poll, epoll, or an asio descriptor) to
+    know when a frame is ready.
 
     The frame buffer MUST be returned after it is processed by calling `return_buffer`.
+    Several frames may be held at once, and they may be returned in any order
+    and from any thread. The driver stalls when it has no buffers left.
 
     Parameters:
         session: The capture session. `start` must be called prior to this function.
@@ -187,14 +292,17 @@ Error start(CaptureSession* session);
     Return Parameters:
         out_frame: The frame data (on success).
         out_frame_size: The size of the captured frame (on success).
+        out_index: The buffer index to pass to `return_buffer` (on success).
+        out_capture_time: When the driver captured the frame, in microseconds since the
+                          Unix epoch (on success). May be null.
 
     Returns:
         Error::OK when a frame was read.
+        Error::AGAIN when no frame is ready yet.
         Otherwise, a suitable error is returned:
-            Error::SELECT: Failed while waiting to read from the device.
             Error::READ_FRAME: Failed to read raw frame data.
 */
-Error grab_frame(CaptureSession* session, uint8_t** out_frame, size_t* out_frame_size);
+Error grab_frame(CaptureSession* session, uint8_t** out_frame, size_t* out_frame_size, uint32_t* out_index, uint64_t* out_capture_time = nullptr);
 
 /*
     Returns the frame buffer so that V4L can reuse it. MUST be called after
@@ -202,15 +310,16 @@ Error grab_frame(CaptureSession* session, uint8_t** out_frame, size_t* out_frame
 
     Parameters:
         session: The capture session.
+        index: The buffer index given by `grab_frame`.
 
     Returns:
         Error::OK on success and a suitable error on failure:
             Error::PREPARE_BUFFER: Failed to prepare the buffer for another read.
 */
-Error return_buffer(CaptureSession* session);
+Error return_buffer(CaptureSession* session, uint32_t index);
 
 /*
-    Stops capture and closes the device.
+    Stops capture and closes the device. All grabbed buffers must be returned first.
 
     Parameters:
         session: The capture session.
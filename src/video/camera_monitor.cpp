@@ -0,0 +1,103 @@
+#include "camera_monitor.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+
+#include <unistd.h>
+
+#include <roversystem/logger.hpp>
+
+CameraMonitor::CameraMonitor(boost::asio::io_context& ctx) : inotify_fd(ctx) {}
+
+CameraMonitor::~CameraMonitor() {
+    stop();
+}
+
+bool CameraMonitor::start(DeviceHandler added, DeviceHandler removed) {
+    if (inotify_fd.is_open()) return true;
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1) {
+        logger::log(logger::WARNING, "Unable to create inotify instance: %s", strerror(errno));
+        return false;
+    }
+    // Nodes are created by devtmpfs, then udev fixes up their permissions
+    if (inotify_add_watch(fd, "/dev", IN_CREATE | IN_ATTRIB | IN_DELETE) == -1) {
+        logger::log(logger::WARNING, "Unable to watch /dev for cameras: %s", strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    on_added = std::move(added);
+    on_removed = std::move(removed);
+    inotify_fd.assign(fd);
+    read_events();
+    return true;
+}
+
+void CameraMonitor::stop() {
+    if (inotify_fd.is_open()) {
+        boost::system::error_code ec;
+        inotify_fd.close(ec);
+    }
+}
+
+void CameraMonitor::read_events() {
+    inotify_fd.async_read_some(boost::asio::buffer(event_buffer), [this](const boost::system::error_code& ec, std::size_t len) {
+        if (ec == boost::asio::error::operation_aborted) return;
+        if (ec) {
+            logger::log(logger::WARNING, "Stopped watching for cameras: %s", ec.message().c_str());
+            return;
+        }
+
+        // The kernel only returns whole events
+        std::size_t offset = 0;
+        while (offset + sizeof(struct inotify_event) <= len) {
+            const auto* event = reinterpret_cast<const struct inotify_event*>(event_buffer.data() + offset);
+            offset += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost. Treat every current node as possibly new
+                for (int dev : list_devices()) on_added(dev);
+                continue;
+            }
+            if (event->len == 0 || (event->mask & IN_ISDIR)) continue;
+
+            int dev = parse_device_name(event->name);
+            if (dev == -1) continue;
+
+            if (event->mask & IN_DELETE) {
+                on_removed(dev);
+            } else {
+                on_added(dev);
+            }
+        }
+        read_events();
+    });
+}
+
+int CameraMonitor::parse_device_name(const char* name) {
+    if (std::strncmp(name, "video", 5) != 0) return -1;
+
+    const char* digits = name + 5;
+    if (*digits == '\0') return -1;
+    for (const char* c = digits; *c; c++) {
+        if (!std::isdigit(static_cast<unsigned char>(*c))) return -1;
+    }
+    return std::atoi(digits);
+}
+
+std::vector<int> CameraMonitor::list_devices() {
+    std::vector<int> devices;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator("/dev", ec)) {
+        int dev = parse_device_name(entry.path().filename().c_str());
+        if (dev != -1) devices.push_back(dev);
+    }
+    std::sort(devices.begin(), devices.end());
+    return devices;
+}
@@ -0,0 +1,46 @@
+#ifndef CAMERA_MONITOR_H
+#define CAMERA_MONITOR_H
+
+#include <array>
+#include <functional>
+#include <vector>
+
+#include <sys/inotify.h>
+
+#include <boost/asio.hpp>
+
+// Reports /dev/video<N> nodes as they appear and disappear, using inotify on /dev.
+// Events are read on the io_context, so watching costs nothing between hot-plugs.
+class CameraMonitor {
+public:
+    // Called with the N of /dev/video<N>
+    using DeviceHandler = std::function<void(int)>;
+
+    explicit CameraMonitor(boost::asio::io_context& ctx);
+    ~CameraMonitor();
+
+    CameraMonitor(const CameraMonitor&) = delete;
+    CameraMonitor& operator=(const CameraMonitor&) = delete;
+
+    // Start watching /dev. Returns false if inotify is unavailable.
+    // on_added may be called more than once for a device: udev changes the node's
+    // permissions after creating it, and opening can fail until it has
+    bool start(DeviceHandler on_added, DeviceHandler on_removed);
+    void stop();
+
+    // The ids of the /dev/video<N> nodes that exist now, in increasing order
+    static std::vector<int> list_devices();
+    // Parse "video<N>" into N. Returns -1 for any other name
+    static int parse_device_name(const char* name);
+
+private:
+    void read_events();
+
+    boost::asio::posix::stream_descriptor inotify_fd;
+    alignas(struct inotify_event) std::array<char, 4096> event_buffer;
+
+    DeviceHandler on_added;
+    DeviceHandler on_removed;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#include "camera_source.hpp"
+
+CameraSource::CameraSource(camera::CaptureSession* cs) : cs(cs) {}
+
+CameraSource::~CameraSource() {
+    camera::close(cs);
+    delete cs;
+}
+
+int CameraSource::fd() const {
+    return cs->fd;
+}
+
+camera::Error CameraSource::grab_frame(uint8_t** out_frame, std::size_t* out_frame_size, uint32_t* out_index, uint64_t* out_capture_time) {
+    return camera::grab_frame(cs, out_frame, out_frame_size, out_index, out_capture_time);
+}
+
+void CameraSource::return_buffer(uint32_t index) {
+    camera::return_buffer(cs, index);
+}
+
+camera::Error CameraSource::set_framerate(unsigned fps) {
+    return camera::set_framerate(cs, fps);
+}
+
+unsigned CameraSource::framerate() const {
+    return cs->native_fps ? cs->native_fps : cs->target_fps;
+}
+
+std::size_t CameraSource::width() const {
+    return cs->width;
+}
+
+std::size_t CameraSource::height() const {
+    return cs->height;
+}
+
+uint32_t CameraSource::pixel_format() const {
+    return cs->pixel_format;
+}
+
+std::size_t CameraSource::bytes_per_line() const {
+    return cs->bytes_per_line;
+}
+
+std::string CameraSource::name() const {
+    return cs->name;
+}
+
+std::string CameraSource::location() const {
+    return cs->hardware_location;
+}
@@ -0,0 +1,35 @@
+#ifndef CAMERA_SOURCE_H
+#define CAMERA_SOURCE_H
+
+#include "camera.hpp"
+#include "frame_source.hpp"
+
+// Frames from a V4L2 camera
+class CameraSource : public FrameSource {
+public:
+    // Takes ownership of an open and started camera. It is closed with the source
+    explicit CameraSource(camera::CaptureSession* cs);
+    ~CameraSource() override;
+
+    CameraSource(const CameraSource&) = delete;
+    CameraSource& operator=(const CameraSource&) = delete;
+
+    int fd() const override;
+    camera::Error grab_frame(uint8_t** out_frame, std::size_t* out_frame_size, uint32_t* out_index, uint64_t* out_capture_time) override;
+    void return_buffer(uint32_t index) override;
+    camera::Error set_framerate(unsigned fps) override;
+    unsigned framerate() const override;
+    std::size_t width() const override;
+    std::size_t height() const override;
+    uint32_t pixel_format() const override;
+    std::size_t bytes_per_line() const override;
+    std::string name() const override;
+    std::string location() const override;
+
+    inline int dev_video_id() const { return cs->dev_video_id; }
+
+private:
+    camera::CaptureSession* cs;
+};
+
+#endif
@@ -0,0 +1,243 @@
+#include "capture_worker.hpp"
+#include "session.hpp"
+
+#include <algorithm>
+#include <vector>
+
+CaptureWorker::CaptureWorker(Session& session, int stream, FrameSource* source, StreamSettings& settings) :
+    session(session),
+    stream(stream),
+    source(source),
+    settings(settings),
+    work(boost::asio::make_work_guard(ctx)),
+    source_fd(ctx)
+{
+    transcoder.reserve(source->width(), source->height());
+    if (session.static_scene.enabled) {
+        scene_detector = std::make_unique<SceneDetector>(session.static_scene);
+    }
+}
+
+CaptureWorker::~CaptureWorker() {
+    stop();
+}
+
+void CaptureWorker::start() {
+    if (thread.joinable()) return;
+
+    source_fd.assign(source->fd());
+    wait_for_frame();
+    thread = std::thread([this]() { ctx.run(); });
+}
+
+void CaptureWorker::stop() {
+    ctx.stop();
+    if (thread.joinable()) {
+        thread.join();
+    }
+    // The source owns the fd. Release it so the descriptor does not close it
+    if (source_fd.is_open()) {
+        source_fd.release();
+    }
+}
+
+void CaptureWorker::resume() {
+    boost::asio::post(ctx, [this]() {
+        if (!waiting && !camera_failed) wait_for_frame();
+    });
+}
+
+void CaptureWorker::set_framerate(unsigned fps) {
+    boost::asio::post(ctx, [this, fps]() {
+        if (camera_failed) return;
+        if (source->set_framerate(fps) != camera::Error::OK) {
+            session.framerate_refused(stream);
+        }
+    });
+}
+
+void CaptureWorker::request_still(int quality) {
+    still_quality = std::clamp(quality, 1, 100);
+    resume();
+}
+
+void CaptureWorker::wait_for_frame() {
+    // Leave frames in the driver while disabled. The camera drops them when its queue is full
+    if (!settings.enabled && still_quality == 0) {
+        waiting = false;
+        return;
+    }
+
+    waiting = true;
+    source_fd.async_wait(boost::asio::posix::stream_descriptor::wait_read, [this](const boost::system::error_code& ec) {
+        waiting = false;
+        if (ec) {
+            if (ec != boost::asio::error::operation_aborted) {
+                fail(camera::Error::SELECT);
+            }
+            return;
+        }
+
+        process_frame();
+        if (!camera_failed) wait_for_frame();
+    });
+}
+
+void CaptureWorker::process_frame() {
+    // Grab a frame.
+    uint8_t* frame_buffer;
+    size_t frame_size;
+    uint32_t buffer_index;
+    uint64_t capture_time;
+    camera::Error err = source->grab_frame(&frame_buffer, &frame_size, &buffer_index, &capture_time);
+    if (err != camera::Error::OK) {
+        // AGAIN: spurious wakeup, or the frame was dropped by the software framerate limit
+        if (err != camera::Error::AGAIN) fail(err);
+        return;
+    }
+
+    // The capture buffer goes back to the source when the last user drops this reference
+    FrameSource* frame_source = source;
+    FrameRef frame(frame_buffer, [frame_source, buffer_index](const uint8_t*) {
+        frame_source->return_buffer(buffer_index);
+    });
+
+    // Raw frames are always compressed, whatever the mode
+    bool raw = source->pixel_format() == V4L2_PIX_FMT_YUYV;
+    if (still_quality != 0) {
+        take_still(frame.get(), frame_size, capture_time, raw);
+    }
+    // Woken only for the still
+    if (!settings.enabled) return;
+
+    TranscodeSettings transcode;
+    transcode.mode = session.transcode_mode;
+    transcode.quality = settings.quality;
+    transcode.greyscale = session.greyscale;
+    transcode.scale_denominator = settings.scale;
+    apply_region(raw, &transcode);
+
+    if (session.mosaic) {
+        update_tile(frame.get(), frame_size, capture_time, raw);
+        // Only the focused camera is also sent on its own
+        if (session.focus != stream) return;
+    }
+
+    bool refresh = settings.refresh_requested.exchange(false);
+    if (scene_detector && !should_send(frame.get(), frame_size, raw, refresh)) {
+        session.suppressed_frames++;
+        return;
+    }
+
+    if (!raw && transcode.mode == TranscodeMode::PASSTHROUGH && transcode.scale_denominator == 1 && transcode.crop.width == 0) {
+        // Zero copy: the sender reads straight from the capture buffer
+        session.queue_frame(stream, std::move(frame), frame_size, capture_time);
+        return;
+    }
+
+    // With a frame budget, the stream's quality is the most the predictor may use
+    std::size_t budget = settings.frame_budget;
+    if (budget) {
+        // A different mode, resolution, or colour changes how size responds to quality
+        if (transcode.mode != predicted_settings.mode || transcode.greyscale != predicted_settings.greyscale
+                || transcode.scale_denominator != predicted_settings.scale_denominator
+                || transcode.crop != predicted_settings.crop || transcode.detail != predicted_settings.detail) {
+            quality_predictor.reset();
+            predicted_settings = transcode;
+        }
+        transcode.quality = quality_predictor.next_quality(budget, transcode.quality);
+    }
+
+    // Transcode the frame to set our desired quality.
+    bool transcoded = raw
+        ? transcoder.compress_yuyv(frame.get(), frame_size, source->bytes_per_line(), source->width(), source->height(), transcode)
+        : transcoder.transcode(frame.get(), frame_size, transcode);
+
+    // The encoded copy is independent of the capture buffer, so return it before queueing
+    frame.reset();
+
+    if (transcoded) {
+        if (budget) quality_predictor.record(transcode.quality, transcoder.size());
+        session.queue_frame(stream, transcoder.data(), transcoder.size(), capture_time);
+    }
+}
+
+void CaptureWorker::apply_region(bool raw, TranscodeSettings* transcode) {
+    RegionOfInterest region;
+    {
+        std::lock_guard<std::mutex> guard(settings.region_lock);
+        region = settings.region;
+    }
+    if (!region.enabled) return;
+
+    int width = source->width();
+    int height = source->height();
+    FrameRegion pixels;
+    pixels.x = static_cast<int>(region.x * width);
+    pixels.y = static_cast<int>(region.y * height);
+    pixels.width = std::max(static_cast<int>(region.width * width), 1);
+    pixels.height = std::max(static_cast<int>(region.height * height), 1);
+
+    // Only requantizing can vary the quality within a frame
+    if (region.weighted && !raw && transcode->mode == TranscodeMode::REQUANTIZE && transcode->scale_denominator == 1) {
+        transcode->detail = pixels;
+        transcode->detail_quality = region.quality ? region.quality : transcode->quality;
+    } else {
+        transcode->crop = pixels;
+        if (region.quality) transcode->quality = region.quality;
+    }
+}
+
+void CaptureWorker::update_tile(const uint8_t* frame, std::size_t frame_size, uint64_t capture_time, bool raw) {
+    int scale;
+    if (!session.mosaic->tile_due(stream, source->width(), source->height(), &scale)) return;
+
+    bool decoded = raw
+        ? transcoder.yuyv_i420(frame, frame_size, source->bytes_per_line(), source->width(), source->height(), scale, session.greyscale)
+        : transcoder.decode_i420(frame, frame_size, scale, session.greyscale);
+    if (!decoded) return;
+
+    const uint8_t* planes[3] = { transcoder.plane(0), transcoder.plane(1), transcoder.plane(2) };
+    session.mosaic->update_tile(stream, planes, transcoder.plane_strides(), transcoder.frame_width(), transcoder.frame_height(), capture_time);
+}
+
+bool CaptureWorker::should_send(const uint8_t* frame, std::size_t frame_size, bool raw, bool refresh) {
+    bool sampled = raw
+        ? scene_detector->sample_yuyv(frame, frame_size, source->bytes_per_line(), source->width(), source->height())
+        : scene_detector->sample_jpeg(frame, frame_size);
+    // Let the transcoder decide what to do with unreadable frames
+    if (!sampled) return true;
+
+    bool changed = scene_detector->changed();
+    settings.scene_static = !changed;
+
+    auto now = std::chrono::steady_clock::now();
+    if (!changed && !refresh && now - last_sent < std::chrono::milliseconds(session.static_scene.keepalive_ms)) {
+        return false;
+    }
+    // Later frames are compared with the last one sent, so slow changes add up
+    scene_detector->accept();
+    last_sent = now;
+    return true;
+}
+
+void CaptureWorker::take_still(const uint8_t* frame, std::size_t frame_size, uint64_t capture_time, bool raw) {
+    int quality = still_quality.exchange(0);
+    std::vector<uint8_t> jpeg;
+    if (raw) {
+        TranscodeSettings still;
+        still.quality = quality;
+        if (!transcoder.compress_yuyv(frame, frame_size, source->bytes_per_line(), source->width(), source->height(), still)) return;
+        jpeg.assign(transcoder.data(), transcoder.data() + transcoder.size());
+    } else {
+        // The camera's own JPEG, untouched
+        jpeg.assign(frame, frame + frame_size);
+    }
+    session.still_captured(stream, std::move(jpeg), capture_time);
+}
+
+void CaptureWorker::fail(camera::Error err) {
+    logger::log(logger::DEBUG, "Stream %d source %s errored: %s", stream, source->name().c_str(), camera::get_error_string(err));
+    camera_failed = true;
+    session.worker_failed(stream);
+}
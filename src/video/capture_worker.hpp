@@ -0,0 +1,128 @@
+#ifndef CAPTURE_WORKER_H
+#define CAPTURE_WORKER_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <boost/asio.hpp>
+
+#include "frame_source.hpp"
+#include "quality_predictor.hpp"
+#include "scene_detector.hpp"
+#include "transcoder.hpp"
+
+class Session;
+
+// Part of a stream's frames to send in more detail than the rest
+struct RegionOfInterest {
+    bool enabled = false;
+    // Fractions of the frame, from its top left corner
+    float x = 0.0F;
+    float y = 0.0F;
+    float width = 1.0F;
+    float height = 1.0F;
+    // 0 = the stream's quality
+    int quality = 0;
+    // Send the whole frame with the region at its own quality, instead of cropping to the region.
+    // Only MJPEG streams in requantize mode can. Others are cropped
+    bool weighted = false;
+};
+
+// A stream's settings. Written by the Session's control message handlers and read by the capture worker
+struct StreamSettings {
+    std::atomic<bool> enabled{false};
+    // Capture rate. Negotiated with the camera driver
+    std::atomic<unsigned> fps{0};
+    // The stream is sent at 1/scale of the camera resolution
+    std::atomic<int> scale{1};
+    std::atomic<int> quality{0};
+    // Byte budget for each encoded frame (0 = fixed quality). quality becomes the maximum
+    std::atomic<uint32_t> frame_budget{0};
+    // Set when a receiver needs a complete picture: it has just started watching, or the picture
+    // changed. The next frame is sent even if the scene is static
+    std::atomic<bool> refresh_requested{false};
+    // Set by the worker while the scene is static and frames are being held back
+    std::atomic<bool> scene_static{false};
+    // The region's fields change together, so they are guarded by region_lock rather than atomic
+    std::mutex region_lock;
+    RegionOfInterest region;
+};
+
+// Captures and transcodes frames from one source (usually a camera) on a dedicated thread.
+// Encoded frames are handed to the Session's frame queue for sending, so a slow
+// camera or an expensive transcode does not delay the other streams.
+//
+// The thread sleeps in its io_context until the source's fd reports a frame (for a
+// camera, a filled V4L2 buffer), so an idle or disabled stream costs no CPU.
+class CaptureWorker {
+public:
+    // The worker does not own the source or settings. Both must outlive the worker
+    CaptureWorker(Session& session, int stream, FrameSource* source, StreamSettings& settings);
+    ~CaptureWorker();
+
+    CaptureWorker(const CaptureWorker&) = delete;
+    CaptureWorker& operator=(const CaptureWorker&) = delete;
+
+    void start();
+    // Signal the thread to finish and wait for it
+    void stop();
+
+    // Start waiting for frames again after the stream is re-enabled. Safe to call from any thread
+    void resume();
+
+    // Change the source's capture rate on the worker thread. Safe to call from any thread
+    void set_framerate(unsigned fps);
+
+    // Copy the next frame, at the source's own size, and hand it to the session as a still.
+    // Raw frames are compressed at quality. Works while the stream is disabled. Safe to call from any thread
+    void request_still(int quality);
+
+    // True once the source has errored. The worker stops and the source should be closed
+    inline bool failed() const { return camera_failed; }
+    inline FrameSource* frame_source() const { return source; }
+
+private:
+    void wait_for_frame();
+    void process_frame();
+    // Copy a reduced frame into the session's mosaic, if its tile is due
+    void update_tile(const uint8_t* frame, std::size_t frame_size, uint64_t capture_time, bool raw);
+    // Crop to the stream's region of interest, or keep the region at a higher quality
+    void apply_region(bool raw, TranscodeSettings* transcode);
+    // Whether a frame should be sent, or held back because the scene has not changed since the last one
+    bool should_send(const uint8_t* frame, std::size_t frame_size, bool raw, bool refresh);
+    // Copy a frame into a JPEG still for the session
+    void take_still(const uint8_t* frame, std::size_t frame_size, uint64_t capture_time, bool raw);
+    void fail(camera::Error err);
+
+    Session& session;
+    int stream;
+    FrameSource* source;
+    StreamSettings& settings;
+
+    // Each worker needs its own JPEG handles and scratch buffers
+    Transcoder transcoder;
+    // Picks the quality when the stream has a frame size budget
+    QualityPredictor quality_predictor;
+    // The settings the predictor's history was recorded with
+    TranscodeSettings predicted_settings;
+    // Set when static scene suppression is enabled
+    std::unique_ptr<SceneDetector> scene_detector;
+    std::chrono::steady_clock::time_point last_sent;
+
+    boost::asio::io_context ctx;
+    // Keeps ctx.run() from returning while the stream is disabled and nothing is waiting
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+    boost::asio::posix::stream_descriptor source_fd;
+    // Only accessed on the worker thread
+    bool waiting = false;
+
+    std::thread thread;
+    std::atomic<bool> camera_failed{false};
+    // JPEG quality of the requested still, or 0 if none is requested
+    std::atomic<int> still_quality{0};
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "frame_queue.hpp"
+
+#include <cstring>
+#include <utility>
+
+FrameQueue::FrameQueue(std::size_t capacity) : max_frames(capacity > 0 ? capacity : 1) { }
+
+EncodedFrame& FrameQueue::make_slot(int stream, uint64_t capture_time, bool* dropped) {
+    *dropped = false;
+    while (frames.size() >= max_frames) {
+        recycle(frames.front());
+        frames.pop_front();
+        *dropped = true;
+    }
+
+    frames.emplace_back();
+    EncodedFrame& frame = frames.back();
+    frame.stream = stream;
+    frame.capture_time = capture_time;
+    return frame;
+}
+
+void FrameQueue::recycle(EncodedFrame& frame) {
+    // Releasing the reference may return a buffer to its owner
+    frame.ref.reset();
+    frame.ref_size = 0;
+    if (frame.data.capacity() > 0) {
+        spare_buffers.push_back(std::move(frame.data));
+        frame.data = std::vector<uint8_t>();
+    }
+}
+
+bool FrameQueue::push(int stream, const uint8_t* data, std::size_t len, uint64_t capture_time) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    bool dropped;
+    EncodedFrame& frame = make_slot(stream, capture_time, &dropped);
+    if (!spare_buffers.empty()) {
+        frame.data = std::move(spare_buffers.back());
+        spare_buffers.pop_back();
+    }
+    frame.data.resize(len);
+    std::memcpy(frame.data.data(), data, len);
+
+    return !dropped;
+}
+
+bool FrameQueue::push_ref(int stream, FrameRef ref, std::size_t len, uint64_t capture_time) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    bool dropped;
+    EncodedFrame& frame = make_slot(stream, capture_time, &dropped);
+    frame.ref = std::move(ref);
+    frame.ref_size = len;
+
+    return !dropped;
+}
+
+bool FrameQueue::pop(EncodedFrame& out_frame) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    recycle(out_frame);
+    if (frames.empty()) return false;
+
+    out_frame = std::move(frames.front());
+    frames.pop_front();
+    return true;
+}
+
+void FrameQueue::release(EncodedFrame& frame) {
+    std::lock_guard<std::mutex> guard(lock);
+    recycle(frame);
+}
+
+void FrameQueue::discard(int stream) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (auto it = frames.begin(); it != frames.end(); ) {
+        if (it->stream == stream) {
+            recycle(*it);
+            it = frames.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+std::size_t FrameQueue::size() {
+    std::lock_guard<std::mutex> guard(lock);
+    return frames.size();
+}
+
+void FrameQueue::set_capacity(std::size_t capacity) {
+    std::lock_guard<std::mutex> guard(lock);
+    max_frames = capacity > 0 ? capacity : 1;
+}
@@ -0,0 +1,70 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Frame data borrowed from elsewhere (ex. a camera buffer). The deleter releases it
+// (ex. returns the buffer to the driver) when the last reference is dropped.
+typedef std::shared_ptr<const uint8_t> FrameRef;
+
+// An encoded frame waiting to be sent on a stream
+// The frame is either copied into data or borrowed through ref
+struct EncodedFrame {
+    int stream;
+    std::vector<uint8_t> data;
+    FrameRef ref;
+    std::size_t ref_size = 0;
+    // Microseconds since the Unix epoch (0 = unknown)
+    uint64_t capture_time = 0;
+
+    inline const uint8_t* bytes() const { return ref ? ref.get() : data.data(); }
+    inline std::size_t size() const { return ref ? ref_size : data.size(); }
+};
+
+// Bounded hand-off from the capture workers to the network sender.
+// When the queue is full, the oldest frame is dropped: a late frame is worth less than a new one.
+// Frame buffers are recycled so steady-state operation does not allocate.
+class FrameQueue {
+public:
+    explicit FrameQueue(std::size_t capacity);
+
+    // Copy an encoded frame into the queue. Safe to call from any thread.
+    // Returns false if an older frame had to be dropped to make room.
+    bool push(int stream, const uint8_t* data, std::size_t len, uint64_t capture_time);
+
+    // Queue a borrowed frame without copying. The reference is held until the frame is
+    // popped and the popped EncodedFrame is reused or destroyed.
+    bool push_ref(int stream, FrameRef ref, std::size_t len, uint64_t capture_time);
+
+    // Drop every queued frame for a stream, releasing any borrowed frames.
+    void discard(int stream);
+
+    // Move the oldest frame into out_frame. The previous contents of out_frame are recycled/released.
+    // Returns false if the queue is empty.
+    bool pop(EncodedFrame& out_frame);
+
+    // Recycle/release a popped frame that is no longer needed. Safe to call from any thread.
+    void release(EncodedFrame& frame);
+
+    std::size_t size();
+    inline std::size_t capacity() const { return max_frames; }
+    // Change the capacity. Extra frames are dropped as new ones are pushed
+    void set_capacity(std::size_t capacity);
+
+private:
+    // Make room for one frame and return an empty frame to fill. Caller holds the lock
+    EncodedFrame& make_slot(int stream, uint64_t capture_time, bool* dropped);
+    void recycle(EncodedFrame& frame);
+
+    std::mutex lock;
+    std::deque<EncodedFrame> frames;
+    std::vector<std::vector<uint8_t>> spare_buffers;
+    std::size_t max_frames;
+};
+
+#endif
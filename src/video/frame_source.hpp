@@ -0,0 +1,42 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "camera.hpp"
+
+// Where a capture worker gets its frames: a camera, a recording, or a generated test pattern.
+//
+// Every source is driven like a camera: wait for fd() to become readable, then grab a frame.
+// A grabbed frame stays valid until it is returned, so it can be sent without copying.
+class FrameSource {
+public:
+    virtual ~FrameSource() = default;
+
+    // Readable when a frame may be ready. The source owns the descriptor
+    virtual int fd() const = 0;
+
+    // Same contract as camera::grab_frame. Called from one thread at a time
+    virtual camera::Error grab_frame(uint8_t** out_frame, std::size_t* out_frame_size, uint32_t* out_index, uint64_t* out_capture_time) = 0;
+    // Give back a grabbed frame. Safe to call from any thread, in any order
+    virtual void return_buffer(uint32_t index) = 0;
+
+    // Same contract as camera::set_framerate
+    virtual camera::Error set_framerate(unsigned fps) = 0;
+    // The rate frames are produced at (0 if unknown)
+    virtual unsigned framerate() const = 0;
+
+    virtual std::size_t width() const = 0;
+    virtual std::size_t height() const = 0;
+    // Frames are MJPEG, or raw YUYV with rows bytes_per_line() apart
+    virtual uint32_t pixel_format() const { return V4L2_PIX_FMT_MJPEG; }
+    virtual std::size_t bytes_per_line() const { return 0; }
+    // Describes the source in logs and stream announcements
+    virtual std::string name() const = 0;
+    // Where the source is attached. For cameras, the port it is plugged into
+    virtual std::string location() const = 0;
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "session.hpp"
 
+#include <rover_system_messages.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
 boost::asio::io_context net_io_ctx;
@@ -8,6 +9,9 @@ VideoConfig session_config;
 int main() {
     logger::register_handler(logger::stderr_handler);
 
+    // Control message handlers are only registered for known types
+    register_messages();
+
     namespace tree = boost::property_tree;
     tree::ptree video_cfg;
     tree::json_parser::read_json("cfg/video_config.json", video_cfg);
@@ -16,23 +20,9 @@ int main() {
     }
 
     Session video_session(session_config, net_io_ctx);
-    video_session.update_available_streams();
-    
-    for (;;) {
-        
-        net_io_ctx.poll();
-
-        video_session.send_frames();
+    video_session.start();
 
-        if (video_session.camera_update_timer.ready()) {
-            video_session.update_available_streams();
-        }
-
-        // Tick.
-        video_session.ticks++;
-        uint32_t last_tick_interval;
-        if (video_session.tick_timer.ready(&last_tick_interval)) {
-            video_session.ticks = 0;
-        }
-    }
+    // Everything is event driven: control messages, camera hot-plug events, and frames
+    // from the capture workers are dispatched as they become ready
+    net_io_ctx.run();
 }
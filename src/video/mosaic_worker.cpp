@@ -0,0 +1,167 @@
+#include "mosaic_worker.hpp"
+#include "session.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// Background of empty tiles and of the borders around cameras with another aspect ratio
+static const uint8_t BLACK_LUMA = 0;
+static const uint8_t NEUTRAL_CHROMA = 128;
+
+// Copy a plane into a smaller rectangle of another, picking the nearest source pixel
+static void shrink_plane(const uint8_t* src, int src_stride, int src_width, int src_height,
+        uint8_t* dst, int dst_stride, int dst_width, int dst_height) {
+    // 16.16 fixed point steps through the source
+    uint32_t step_x = (static_cast<uint32_t>(src_width) << 16) / dst_width;
+    uint32_t step_y = (static_cast<uint32_t>(src_height) << 16) / dst_height;
+    for (int y = 0; y < dst_height; y++) {
+        const uint8_t* in = src + static_cast<std::size_t>((y * step_y) >> 16) * src_stride;
+        uint8_t* out = dst + static_cast<std::size_t>(y) * dst_stride;
+        uint32_t sx = 0;
+        for (int x = 0; x < dst_width; x++, sx += step_x) {
+            out[x] = in[sx >> 16];
+        }
+    }
+}
+
+MosaicWorker::MosaicWorker(Session& session, const MosaicConfig& config, StreamSettings& settings) :
+    session(session),
+    cfg(config),
+    settings(settings),
+    work(boost::asio::make_work_guard(ctx)),
+    frame_timer(ctx)
+{
+}
+
+MosaicWorker::~MosaicWorker() {
+    stop();
+}
+
+void MosaicWorker::start() {
+    if (thread.joinable()) return;
+
+    frame_timer.expires_at(std::chrono::steady_clock::now());
+    schedule_frame();
+    thread = std::thread([this]() { ctx.run(); });
+}
+
+void MosaicWorker::stop() {
+    ctx.stop();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void MosaicWorker::set_members(const std::vector<int>& streams) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (streams == members) return;
+
+    members = streams;
+    // New tiles take the next frame of their camera
+    tile_due_at.assign(members.size(), std::chrono::steady_clock::time_point());
+    arrange();
+}
+
+void MosaicWorker::layout(std::vector<int>* out_members, int* out_columns, int* out_width, int* out_height) {
+    std::lock_guard<std::mutex> guard(lock);
+    *out_members = members;
+    *out_columns = columns;
+    *out_width = width;
+    *out_height = height;
+}
+
+void MosaicWorker::arrange() {
+    int count = members.size();
+    columns = count ? static_cast<int>(std::ceil(std::sqrt(count))) : 0;
+    int rows = columns ? (count + columns - 1) / columns : 0;
+    width = columns * cfg.tile_width;
+    height = rows * cfg.tile_height;
+
+    strides[0] = width;
+    strides[1] = strides[2] = width / 2;
+    planes[0].assign(static_cast<std::size_t>(width) * height, BLACK_LUMA);
+    planes[1].assign(static_cast<std::size_t>(width / 2) * (height / 2), NEUTRAL_CHROMA);
+    planes[2].assign(static_cast<std::size_t>(width / 2) * (height / 2), NEUTRAL_CHROMA);
+    dirty = true;
+}
+
+bool MosaicWorker::tile_due(int stream, std::size_t frame_width, std::size_t frame_height, int* out_scale_denominator) {
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto member = std::find(members.begin(), members.end(), stream);
+        if (member == members.end()) return false;
+
+        auto& due = tile_due_at[member - members.begin()];
+        if (now < due) return false;
+        unsigned fps = std::max(settings.fps ? settings.fps.load() : cfg.fps, 1U);
+        due = now + std::chrono::microseconds(1000000 / fps);
+    }
+
+    // Decoding at a reduced size is much cheaper, and the tile is smaller still
+    int scale = 1;
+    while (scale < 8 && frame_width / (scale * 2) >= cfg.tile_width && frame_height / (scale * 2) >= cfg.tile_height) {
+        scale *= 2;
+    }
+    *out_scale_denominator = scale;
+    return true;
+}
+
+void MosaicWorker::update_tile(int stream, const uint8_t* const src_planes[3], const int src_strides[3], int src_width, int src_height, uint64_t frame_capture_time) {
+    if (src_width < 2 || src_height < 2) return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto member = std::find(members.begin(), members.end(), stream);
+    if (member == members.end()) return;
+    int index = member - members.begin();
+
+    // Fit the frame in the tile, centred, on even pixels so the chroma lines up
+    int tile_width = cfg.tile_width;
+    int tile_height = cfg.tile_height;
+    int fit_width = tile_width;
+    int fit_height = tile_height;
+    if (static_cast<int64_t>(src_width) * tile_height > static_cast<int64_t>(src_height) * tile_width) {
+        fit_height = static_cast<int64_t>(src_height) * tile_width / src_width;
+    } else {
+        fit_width = static_cast<int64_t>(src_width) * tile_height / src_height;
+    }
+    fit_width = std::max(fit_width & ~1, 2);
+    fit_height = std::max(fit_height & ~1, 2);
+    int x = (index % columns) * tile_width + ((tile_width - fit_width) / 2 & ~1);
+    int y = (index / columns) * tile_height + ((tile_height - fit_height) / 2 & ~1);
+
+    shrink_plane(src_planes[0], src_strides[0], src_width, src_height,
+        planes[0].data() + static_cast<std::size_t>(y) * strides[0] + x, strides[0], fit_width, fit_height);
+    for (int i = 1; i < 3; i++) {
+        shrink_plane(src_planes[i], src_strides[i], (src_width + 1) / 2, (src_height + 1) / 2,
+            planes[i].data() + static_cast<std::size_t>(y / 2) * strides[i] + x / 2, strides[i], fit_width / 2, fit_height / 2);
+    }
+
+    dirty = true;
+    capture_time = std::max(capture_time, frame_capture_time);
+}
+
+void MosaicWorker::schedule_frame() {
+    unsigned fps = std::max(settings.fps ? settings.fps.load() : cfg.fps, 1U);
+    // Skip frames rather than catching up after a stall
+    auto next = std::max(frame_timer.expiry() + std::chrono::microseconds(1000000 / fps), std::chrono::steady_clock::now());
+    frame_timer.expires_at(next);
+    frame_timer.async_wait([this](const boost::system::error_code& ec) {
+        if (ec) return;
+        send_frame();
+        schedule_frame();
+    });
+}
+
+void MosaicWorker::send_frame() {
+    bool refresh = settings.refresh_requested.exchange(false);
+
+    // Tiles wait while the mosaic encodes. Both are small
+    std::lock_guard<std::mutex> guard(lock);
+    if (!settings.enabled || width == 0 || (!dirty && !refresh)) return;
+    dirty = false;
+
+    const uint8_t* src_planes[3] = { planes[0].data(), planes[1].data(), planes[2].data() };
+    if (!transcoder.compress_i420(src_planes, strides, width, height, settings.quality)) return;
+    session.queue_frame(cfg.stream, transcoder.data(), transcoder.size(), capture_time);
+}
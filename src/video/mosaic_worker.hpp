@@ -0,0 +1,95 @@
+#ifndef MOSAIC_WORKER_H
+#define MOSAIC_WORKER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "transcoder.hpp"
+
+class Session;
+struct StreamSettings;
+
+struct MosaicConfig {
+    bool enabled = false;
+    // The mosaic is sent on this stream id, which is never given to a camera
+    int stream = 15;
+    // Each camera is shrunk to fit a tile of this size, keeping its aspect ratio
+    unsigned tile_width = 320;
+    unsigned tile_height = 180;
+    // Frames per second of the mosaic
+    unsigned fps = 5;
+    // The camera sent in full when the session starts (-1 = none)
+    int focus = -1;
+};
+
+// Composites a thumbnail of every camera into a single stream, so operators can watch all of
+// them for a fraction of the bandwidth of sending each one.
+//
+// Capture workers decode a reduced frame whenever their tile is due and copy it in with
+// update_tile. The worker's own thread encodes the mosaic at the mosaic stream's fps,
+// and only when a tile has changed since the last frame.
+class MosaicWorker {
+public:
+    // The worker does not own the settings. They must outlive the worker
+    MosaicWorker(Session& session, const MosaicConfig& config, StreamSettings& settings);
+    ~MosaicWorker();
+
+    MosaicWorker(const MosaicWorker&) = delete;
+    MosaicWorker& operator=(const MosaicWorker&) = delete;
+
+    void start();
+    // Signal the thread to finish and wait for it
+    void stop();
+
+    // Show these streams, in this order. Clears the mosaic if the layout changes. Safe to call from any thread
+    void set_members(const std::vector<int>& streams);
+    // The streams shown and the size of the mosaic. Safe to call from any thread
+    void layout(std::vector<int>* out_members, int* out_columns, int* out_width, int* out_height);
+
+    // Whether a stream's tile wants a new frame, ignoring ones the mosaic would not show.
+    // Also gives the largest reduction that still fills the tile. Safe to call from any thread
+    bool tile_due(int stream, std::size_t width, std::size_t height, int* out_scale_denominator);
+    // Shrink 4:2:0 planes into the stream's tile. Ignored if the stream is not shown. Safe to call from any thread
+    void update_tile(int stream, const uint8_t* const planes[3], const int strides[3], int width, int height, uint64_t capture_time);
+
+private:
+    void schedule_frame();
+    void send_frame();
+    // Lay out the members in a grid and clear the mosaic. Called with lock held
+    void arrange();
+
+    Session& session;
+    const MosaicConfig& cfg;
+    StreamSettings& settings;
+
+    // Guards everything below it up to the encoders
+    std::mutex lock;
+    std::vector<int> members;
+    int columns = 0;
+    int width = 0;
+    int height = 0;
+    // When each member's tile next wants a frame, in the same order as members
+    std::vector<std::chrono::steady_clock::time_point> tile_due_at;
+    std::vector<uint8_t> planes[3];
+    int strides[3] = { 0, 0, 0 };
+    // Set when a tile changes, and cleared when the mosaic is sent
+    bool dirty = false;
+    // Newest capture time of the tiles in the mosaic
+    uint64_t capture_time = 0;
+
+    // Compresses the mosaic
+    Transcoder transcoder;
+
+    boost::asio::io_context ctx;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+    boost::asio::steady_timer frame_timer;
+    std::thread thread;
+};
+
+#endif
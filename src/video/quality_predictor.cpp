@@ -0,0 +1,57 @@
+#include "quality_predictor.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+static const int MIN_QUALITY = 5;
+static const int START_QUALITY = 30;
+// Limit how far one frame can move the quality, so one odd frame cannot swing it
+static const int MAX_QUALITY_STEP = 15;
+// Aim slightly under the budget so normal frame-to-frame variation stays inside it
+static const double TARGET_MARGIN = 0.9;
+// Typical for camera JPEGs between quality 10 and 90
+static const double DEFAULT_SLOPE = 0.03;
+static const double MIN_SLOPE = 0.005;
+static const double MAX_SLOPE = 0.2;
+// Weight of each new slope measurement
+static const double SLOPE_SMOOTHING = 0.3;
+
+QualityPredictor::QualityPredictor() {
+    reset();
+}
+
+int QualityPredictor::next_quality(std::size_t target_size, int max_quality) {
+    int min_quality = std::min(MIN_QUALITY, max_quality);
+    if (!have_sample || target_size == 0) {
+        return std::clamp(START_QUALITY, min_quality, max_quality);
+    }
+
+    double target_log_size = std::log(target_size * TARGET_MARGIN);
+    int step = static_cast<int>(std::floor((target_log_size - last_log_size) / slope));
+    step = std::clamp(step, -MAX_QUALITY_STEP, MAX_QUALITY_STEP);
+    return std::clamp(last_quality + step, min_quality, max_quality);
+}
+
+void QualityPredictor::record(int quality, std::size_t size) {
+    if (size == 0) return;
+    double log_size = std::log(static_cast<double>(size));
+
+    if (have_sample && quality != last_quality) {
+        double measured = (log_size - last_log_size) / (quality - last_quality);
+        // Scene changes between the two frames can produce nonsense slopes. Only trust plausible ones
+        if (measured >= MIN_SLOPE && measured <= MAX_SLOPE) {
+            slope += SLOPE_SMOOTHING * (measured - slope);
+        }
+    }
+
+    have_sample = true;
+    last_quality = quality;
+    last_log_size = log_size;
+}
+
+void QualityPredictor::reset() {
+    have_sample = false;
+    last_quality = 0;
+    last_log_size = 0.0;
+    slope = DEFAULT_SLOPE;
+}
@@ -0,0 +1,33 @@
+#ifndef QUALITY_PREDICTOR_H
+#define QUALITY_PREDICTOR_H
+
+#include <cstddef>
+
+// Picks the JPEG quality for each frame so the encoded size lands under a byte budget.
+//
+// Encoded size grows roughly exponentially with quality, so the predictor tracks the
+// slope of log(size) against quality from the frames it has already encoded and steps
+// from the last frame's quality along that slope. Each frame is encoded once; a miss
+// corrects the next frame instead of re-encoding this one.
+class QualityPredictor {
+public:
+    QualityPredictor();
+
+    // The quality to encode the next frame with, at most max_quality
+    int next_quality(std::size_t target_size, int max_quality);
+
+    // Record the size produced by the quality returned from next_quality
+    void record(int quality, std::size_t size);
+
+    // Forget previous frames. Call when the size curve changes (ex. resolution or greyscale)
+    void reset();
+
+private:
+    bool have_sample = false;
+    int last_quality = 0;
+    double last_log_size = 0.0;
+    // Change in log(size) per quality step
+    double slope;
+};
+
+#endif
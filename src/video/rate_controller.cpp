@@ -0,0 +1,97 @@
+#include "rate_controller.hpp"
+
+#include <algorithm>
+
+// Quality lost per step down
+static const int QUALITY_STEP = 10;
+// Smallest scale the decoder supports
+static const int MAX_SCALE_DENOMINATOR = 8;
+// Consecutive good reports needed to step back up
+static const int GOOD_REPORTS_TO_STEP_UP = 3;
+// A stream only steps up while well under its share of the bandwidth
+static const double STEP_UP_HEADROOM = 0.7;
+
+RateController::RateController(const RateControlConfig& config, int stream_count) :
+    cfg(config),
+    states(stream_count)
+{ }
+
+void RateController::add_streams(int stream_count) {
+    if (stream_count > 0 && states.size() < static_cast<std::size_t>(stream_count)) {
+        states.resize(stream_count);
+    }
+}
+
+void RateController::set_base(int stream, const StreamRate& rate) {
+    State& s = states[stream];
+    s.base = rate;
+    s.level = std::min(s.level, max_level(rate));
+}
+
+StreamRate RateController::current(int stream) const {
+    return rate_at(states[stream].base, states[stream].level);
+}
+
+bool RateController::update(int stream, const LinkReport& report, int active_streams) {
+    State& s = states[stream];
+    uint32_t frames = report.frames_completed + report.frames_dropped;
+    if (!cfg.enabled || frames == 0 || report.interval_ms == 0) return false;
+
+    double loss = static_cast<double>(report.frames_dropped) / frames;
+    double bandwidth = 1000.0 * report.bytes_received / report.interval_ms;
+    double budget = static_cast<double>(cfg.target_bandwidth) / std::max(active_streams, 1);
+
+    if (loss > cfg.target_loss || bandwidth > budget) {
+        s.good_reports = 0;
+        if (s.level < max_level(s.base)) {
+            s.level++;
+            return true;
+        }
+    } else if (loss <= cfg.target_loss / 2 && bandwidth < budget * STEP_UP_HEADROOM) {
+        if (++s.good_reports >= GOOD_REPORTS_TO_STEP_UP && s.level > 0) {
+            s.good_reports = 0;
+            s.level--;
+            return true;
+        }
+    } else {
+        s.good_reports = 0;
+    }
+    return false;
+}
+
+void RateController::reset(int stream) {
+    states[stream].level = 0;
+    states[stream].good_reports = 0;
+}
+
+StreamRate RateController::rate_at(const StreamRate& base, int level) const {
+    StreamRate rate = base;
+
+    while (level > 0 && rate.quality > cfg.min_quality) {
+        rate.quality = std::max(cfg.min_quality, rate.quality - QUALITY_STEP);
+        level--;
+    }
+    while (level > 0 && rate.scale_denominator < MAX_SCALE_DENOMINATOR) {
+        rate.scale_denominator *= 2;
+        level--;
+    }
+    // An unlimited framerate (0) is left alone
+    while (level > 0 && rate.fps > cfg.min_fps) {
+        rate.fps = std::max(cfg.min_fps, rate.fps / 2);
+        level--;
+    }
+    return rate;
+}
+
+int RateController::max_level(const StreamRate& base) const {
+    int level = 0;
+    StreamRate rate = base;
+    for (;;) {
+        StreamRate next = rate_at(base, level + 1);
+        if (next.quality == rate.quality && next.scale_denominator == rate.scale_denominator && next.fps == rate.fps) {
+            return level;
+        }
+        rate = next;
+        level++;
+    }
+}
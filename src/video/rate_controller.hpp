@@ -0,0 +1,74 @@
+#ifndef RATE_CONTROLLER_H
+#define RATE_CONTROLLER_H
+
+#include <cstdint>
+#include <vector>
+
+// The settings that decide how many bytes a stream sends
+struct StreamRate {
+    int quality = 30;
+    int scale_denominator = 1;
+    unsigned fps = 0;
+};
+
+struct RateControlConfig {
+    bool enabled = false;
+    // Bandwidth shared evenly between the streams being sent, in bytes per second
+    uint32_t target_bandwidth = 1000000;
+    // A stream steps down when more than this fraction of its frames are lost
+    double target_loss = 0.05;
+    int min_quality = 10;
+    unsigned min_fps = 2;
+};
+
+// Receiver counts for one stream over one feedback interval
+struct LinkReport {
+    uint32_t interval_ms;
+    uint32_t frames_completed;
+    uint32_t frames_dropped;
+    uint64_t bytes_received;
+};
+
+// Closed-loop rate control for each stream, driven by receiver feedback.
+//
+// Each stream sits on a ladder of settings. The top is the operator's settings (the base),
+// and each step down lowers quality, then resolution, then framerate. A report showing
+// loss or too much bandwidth steps down immediately. Several good reports in a row step
+// back up, so a stream does not oscillate around the link's limit.
+class RateController {
+public:
+    RateController(const RateControlConfig& config, int stream_count);
+
+    inline bool enabled() const { return cfg.enabled; }
+
+    // Make room for stream_count streams. Existing streams are kept
+    void add_streams(int stream_count);
+
+    // Set the operator's settings for a stream. The current step is kept
+    void set_base(int stream, const StreamRate& rate);
+    inline const StreamRate& base(int stream) const { return states[stream].base; }
+
+    // The settings the stream should be sent with now
+    StreamRate current(int stream) const;
+
+    // Feed a receiver report. Returns true if the stream's settings changed
+    bool update(int stream, const LinkReport& report, int active_streams);
+
+    // Return a stream to its base settings
+    void reset(int stream);
+
+private:
+    struct State {
+        StreamRate base;
+        int level = 0;
+        int good_reports = 0;
+    };
+
+    StreamRate rate_at(const StreamRate& base, int level) const;
+    int max_level(const StreamRate& base) const;
+
+    RateControlConfig cfg;
+    std::vector<State> states;
+};
+
+#endif
@@ -0,0 +1,194 @@
+#include "replay_source.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <turbojpeg.h>
+
+// Frames per second used when none is given
+static const unsigned DEFAULT_REPLAY_FPS = 15;
+
+// The eight colour bars of the test pattern
+static const uint8_t BAR_COLOURS[8][3] = {
+    { 192, 192, 192 }, { 192, 192, 0 }, { 0, 192, 192 }, { 0, 192, 0 },
+    { 192, 0, 192 }, { 192, 0, 0 }, { 0, 0, 192 }, { 16, 16, 16 }
+};
+
+std::vector<FrameSpan> split_mjpeg_frames(const std::vector<uint8_t>& data) {
+    std::vector<FrameSpan> frames;
+    std::size_t start = std::string::npos;
+    for (std::size_t i = 0; i + 2 < data.size(); i++) {
+        if (data[i] == 0xFF && data[i + 1] == 0xD8 && data[i + 2] == 0xFF) {
+            if (start != std::string::npos) {
+                frames.push_back({start, i - start});
+            }
+            start = i;
+        }
+    }
+    if (start != std::string::npos) {
+        frames.push_back({start, data.size() - start});
+    }
+    return frames;
+}
+
+std::unique_ptr<ReplaySource> ReplaySource::from_file(const std::string& path, unsigned fps) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) return nullptr;
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+
+    std::vector<FrameSpan> frames = split_mjpeg_frames(data);
+    if (frames.empty()) return nullptr;
+
+    tjhandle decompressor = tjInitDecompress();
+    if (!decompressor) return nullptr;
+    int width, height, subsamp, colorspace;
+    int err = tjDecompressHeader3(decompressor, &data[frames[0].offset], frames[0].size, &width, &height, &subsamp, &colorspace);
+    tjDestroy(decompressor);
+    if (err != 0) return nullptr;
+
+    std::unique_ptr<ReplaySource> source(new ReplaySource("Recording", path, std::move(data), std::move(frames), width, height));
+    source->set_framerate(fps ? fps : DEFAULT_REPLAY_FPS);
+    return source;
+}
+
+std::unique_ptr<ReplaySource> ReplaySource::test_pattern(std::size_t width, std::size_t height, unsigned fps, unsigned frame_count) {
+    if (width == 0 || height == 0) return nullptr;
+    frame_count = std::max(frame_count, 1U);
+
+    tjhandle compressor = tjInitCompress();
+    if (!compressor) return nullptr;
+
+    std::vector<uint8_t> rgb(width * height * 3);
+    std::vector<uint8_t> data;
+    std::vector<FrameSpan> frames;
+    unsigned char* jpeg = nullptr;
+    unsigned long jpeg_size = 0;
+
+    for (unsigned f = 0; f < frame_count; f++) {
+        // Colour bars, a white band sweeping across them, and a moving gradient along the bottom
+        std::size_t band = f * width / frame_count;
+        for (std::size_t y = 0; y < height; y++) {
+            uint8_t* row = &rgb[y * width * 3];
+            for (std::size_t x = 0; x < width; x++) {
+                uint8_t* px = &row[x * 3];
+                if (y >= height * 3 / 4) {
+                    uint8_t v = static_cast<uint8_t>((x + y + f * 8) & 0xFF);
+                    px[0] = v;
+                    px[1] = static_cast<uint8_t>(255 - v);
+                    px[2] = static_cast<uint8_t>(x * 255 / width);
+                } else if (x >= band && x < band + width / 32 + 1) {
+                    px[0] = px[1] = px[2] = 235;
+                } else {
+                    const uint8_t* colour = BAR_COLOURS[x * 8 / width];
+                    px[0] = colour[0];
+                    px[1] = colour[1];
+                    px[2] = colour[2];
+                }
+            }
+        }
+
+        // Cameras deliver 4:2:2 MJPEG at high quality
+        if (tjCompress2(compressor, rgb.data(), width, 0, height, TJPF_RGB, &jpeg, &jpeg_size, TJSAMP_422, 90, TJFLAG_FASTDCT) != 0) {
+            tjFree(jpeg);
+            tjDestroy(compressor);
+            return nullptr;
+        }
+        frames.push_back({data.size(), jpeg_size});
+        data.insert(data.end(), jpeg, jpeg + jpeg_size);
+    }
+    tjFree(jpeg);
+    tjDestroy(compressor);
+
+    std::string location = std::to_string(width) + "x" + std::to_string(height);
+    std::unique_ptr<ReplaySource> source(new ReplaySource("Test pattern", location, std::move(data), std::move(frames), width, height));
+    source->set_framerate(fps ? fps : DEFAULT_REPLAY_FPS);
+    return source;
+}
+
+ReplaySource::ReplaySource(std::string name, std::string location, std::vector<uint8_t> data, std::vector<FrameSpan> frames, std::size_t width, std::size_t height) :
+    source_name(std::move(name)),
+    source_location(std::move(location)),
+    data(std::move(data)),
+    frames(std::move(frames)),
+    frame_width(width),
+    frame_height(height)
+{
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        throw std::runtime_error("ReplaySource: unable to create frame timer");
+    }
+}
+
+ReplaySource::~ReplaySource() {
+    ::close(timer_fd);
+}
+
+int ReplaySource::fd() const {
+    return timer_fd;
+}
+
+camera::Error ReplaySource::grab_frame(uint8_t** out_frame, std::size_t* out_frame_size, uint32_t* out_index, uint64_t* out_capture_time) {
+    uint64_t expirations;
+    if (::read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return errno == EAGAIN ? camera::Error::AGAIN : camera::Error::READ_FRAME;
+    }
+
+    // Like a camera, drop the frames that were due while the grabber was busy
+    next_frame = (next_frame + expirations - 1) % frames.size();
+    const FrameSpan& frame = frames[next_frame];
+    next_frame = (next_frame + 1) % frames.size();
+
+    *out_frame = &data[frame.offset];
+    *out_frame_size = frame.size;
+    *out_index = 0;
+    if (out_capture_time) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        *out_capture_time = static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+    }
+    return camera::Error::OK;
+}
+
+void ReplaySource::return_buffer(uint32_t) {}
+
+camera::Error ReplaySource::set_framerate(unsigned new_fps) {
+    if (new_fps == 0) return camera::Error::OK;
+
+    long interval_ns = 1000000000L / new_fps;
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = interval_ns / 1000000000L;
+    spec.it_interval.tv_nsec = interval_ns % 1000000000L;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(timer_fd, 0, &spec, nullptr) != 0) {
+        return camera::Error::SET_FRAMERATE;
+    }
+    fps = new_fps;
+    return camera::Error::OK;
+}
+
+unsigned ReplaySource::framerate() const {
+    return fps;
+}
+
+std::size_t ReplaySource::width() const {
+    return frame_width;
+}
+
+std::size_t ReplaySource::height() const {
+    return frame_height;
+}
+
+std::string ReplaySource::name() const {
+    return source_name;
+}
+
+std::string ReplaySource::location() const {
+    return source_location;
+}
@@ -0,0 +1,69 @@
+#ifndef REPLAY_SOURCE_H
+#define REPLAY_SOURCE_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "frame_source.hpp"
+
+// Where one frame lies in a buffer of back to back frames
+struct FrameSpan {
+    std::size_t offset;
+    std::size_t size;
+};
+
+// Split an MJPEG recording (concatenated JPEGs) into frames at each start-of-image marker (FF D8 FF)
+std::vector<FrameSpan> split_mjpeg_frames(const std::vector<uint8_t>& data);
+
+// Plays a set of JPEG frames in a loop, paced by a timer. Lets the pipeline run and be
+// profiled without a camera.
+//
+// Frames are encoded up front and never change, so grabbed frames are shared with the
+// sender without copying and returning them is free.
+class ReplaySource : public FrameSource {
+public:
+    // Replay an MJPEG recording (concatenated JPEGs), such as one made with:
+    // ffmpeg -f v4l2 -input_format mjpeg -i /dev/video0 -c copy -f mjpeg out.mjpeg
+    // The resolution is the recording's. Returns null if the file cannot be read or has no frames
+    static std::unique_ptr<ReplaySource> from_file(const std::string& path, unsigned fps);
+    // Generate a moving test pattern that repeats every frame_count frames.
+    // Returns null if the frames cannot be encoded
+    static std::unique_ptr<ReplaySource> test_pattern(std::size_t width, std::size_t height, unsigned fps, unsigned frame_count = 30);
+
+    ~ReplaySource() override;
+
+    ReplaySource(const ReplaySource&) = delete;
+    ReplaySource& operator=(const ReplaySource&) = delete;
+
+    int fd() const override;
+    camera::Error grab_frame(uint8_t** out_frame, std::size_t* out_frame_size, uint32_t* out_index, uint64_t* out_capture_time) override;
+    void return_buffer(uint32_t index) override;
+    // A replay has no natural maximum rate, so 0 keeps the current rate
+    camera::Error set_framerate(unsigned fps) override;
+    unsigned framerate() const override;
+    std::size_t width() const override;
+    std::size_t height() const override;
+    std::string name() const override;
+    std::string location() const override;
+
+private:
+    ReplaySource(std::string name, std::string location, std::vector<uint8_t> data, std::vector<FrameSpan> frames, std::size_t width, std::size_t height);
+
+    std::string source_name;
+    std::string source_location;
+    // All frames, back to back
+    std::vector<uint8_t> data;
+    std::vector<FrameSpan> frames;
+    std::size_t frame_width;
+    std::size_t frame_height;
+
+    // Expires once per frame interval
+    int timer_fd = -1;
+    std::atomic<unsigned> fps{0};
+    // Only accessed by the grabbing thread
+    std::size_t next_frame = 0;
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include "requantizer.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+#include <jerror.h>
+
+void Requantizer::error_exit(j_common_ptr cinfo) {
+    ErrorManager* err = reinterpret_cast<ErrorManager*>(cinfo->err);
+    longjmp(err->env, 1);
+}
+
+void Requantizer::output_message(j_common_ptr) { }
+
+void Requantizer::init_destination(j_compress_ptr cinfo) {
+    Requantizer* self = static_cast<Requantizer*>(cinfo->client_data);
+    cinfo->dest->next_output_byte = self->out_buffer;
+    cinfo->dest->free_in_buffer = self->out_capacity;
+}
+
+boolean Requantizer::empty_output_buffer(j_compress_ptr cinfo) {
+    // libjpeg only calls this once the whole buffer is full
+    Requantizer* self = static_cast<Requantizer*>(cinfo->client_data);
+    unsigned long capacity = std::max(self->out_capacity * 2, 4096UL);
+    unsigned char* buffer = static_cast<unsigned char*>(realloc(self->out_buffer, capacity));
+    if (!buffer) {
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+    }
+    cinfo->dest->next_output_byte = buffer + self->out_capacity;
+    cinfo->dest->free_in_buffer = capacity - self->out_capacity;
+    self->out_buffer = buffer;
+    self->out_capacity = capacity;
+    return TRUE;
+}
+
+void Requantizer::term_destination(j_compress_ptr cinfo) {
+    Requantizer* self = static_cast<Requantizer*>(cinfo->client_data);
+    self->out_size = self->out_capacity - cinfo->dest->free_in_buffer;
+}
+
+Requantizer::Requantizer() {
+    src.err = jpeg_std_error(&err.pub);
+    dst.err = &err.pub;
+    err.pub.error_exit = error_exit;
+    err.pub.output_message = output_message;
+    dest.init_destination = init_destination;
+    dest.empty_output_buffer = empty_output_buffer;
+    dest.term_destination = term_destination;
+
+    if (setjmp(err.env)) {
+        throw std::runtime_error("Requantizer::Requantizer: could not initialize libjpeg");
+    }
+
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+    dst.client_data = this;
+}
+
+Requantizer::~Requantizer() {
+    jpeg_destroy_decompress(&src);
+    jpeg_destroy_compress(&dst);
+    free(out_buffer);
+}
+
+bool Requantizer::requantize(const uint8_t* jpeg, std::size_t len, int quality, bool greyscale, const QualityRegion* region) {
+    // Reserve enough output space that libjpeg rarely has to grow the buffer
+    unsigned long want_capacity = len + len / 2 + 4096;
+    if (out_capacity < want_capacity) {
+        free(out_buffer);
+        out_buffer = static_cast<unsigned char*>(malloc(want_capacity));
+        out_capacity = out_buffer ? want_capacity : 0;
+    }
+
+    // Both objects jump here on a fatal error. Abort returns them to the idle state for the next frame.
+    // The output buffer stays with the Requantizer, even if it grew before the error
+    if (setjmp(err.env)) {
+        jpeg_abort_compress(&dst);
+        jpeg_abort_decompress(&src);
+        return false;
+    }
+
+    jpeg_mem_src(&src, jpeg, len);
+    jpeg_read_header(&src, TRUE);
+    jvirt_barray_ptr* coef_arrays = jpeg_read_coefficients(&src);
+
+    // Copies the image size, sampling factors, and the source quantization tables
+    jpeg_copy_critical_parameters(&src, &dst);
+
+    if (greyscale && dst.num_components == 3) {
+        // The luma coefficients alone form a valid greyscale image
+        jpeg_set_colorspace(&dst, JCS_GRAYSCALE);
+    }
+
+    if (region) {
+        jpeg_set_quality(&dst, region->background_quality, TRUE);
+        for (int i = 0; i < 2; i++) {
+            std::copy_n(dst.quant_tbl_ptrs[i]->quantval, DCTSIZE2, background_tables[i]);
+        }
+    }
+
+    // Standard tables: 0 for luma and 1 for chroma
+    jpeg_set_quality(&dst, quality, TRUE);
+    for (int ci = 0; ci < dst.num_components; ci++) {
+        dst.comp_info[ci].quant_tbl_no = (ci == 0) ? 0 : 1;
+    }
+
+    rescale_coefficients(coef_arrays, region);
+
+    dst.dest = &dest;
+    jpeg_write_coefficients(&dst, coef_arrays);
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+
+    return true;
+}
+
+static JCOEF round_to_step(int value, int step) {
+    if (value >= 0) {
+        return static_cast<JCOEF>((value + step / 2) / step);
+    }
+    return static_cast<JCOEF>(-((-value + step / 2) / step));
+}
+
+void Requantizer::rescale_coefficients(jvirt_barray_ptr* coef_arrays, const QualityRegion* region) {
+    for (int ci = 0; ci < dst.num_components; ci++) {
+        jpeg_component_info* comp = &src.comp_info[ci];
+        const JQUANT_TBL* src_table = comp->quant_table;
+        const JQUANT_TBL* dst_table = dst.quant_tbl_ptrs[dst.comp_info[ci].quant_tbl_no];
+
+        // Coefficients at positions where the tables match keep their values
+        bool differs = false;
+        for (int k = 0; k < DCTSIZE2; k++) {
+            differs |= src_table->quantval[k] != dst_table->quantval[k];
+        }
+        if (!differs && !region) continue;
+
+        // The region in this component's blocks, which cover more pixels when the component is subsampled
+        JDIMENSION region_left = 0, region_right = comp->width_in_blocks;
+        JDIMENSION region_top = 0, region_bottom = comp->height_in_blocks;
+        int background_steps[DCTSIZE2];
+        if (region) {
+            int block_width = DCTSIZE * src.max_h_samp_factor / comp->h_samp_factor;
+            int block_height = DCTSIZE * src.max_v_samp_factor / comp->v_samp_factor;
+            region_left = region->x / block_width;
+            region_right = (region->x + region->width + block_width - 1) / block_width;
+            region_top = region->y / block_height;
+            region_bottom = (region->y + region->height + block_height - 1) / block_height;
+
+            // Never finer than the frame's own steps
+            const UINT16* background = background_tables[ci == 0 ? 0 : 1];
+            for (int k = 0; k < DCTSIZE2; k++) {
+                background_steps[k] = std::max<int>(background[k], dst_table->quantval[k]);
+            }
+        }
+
+        for (JDIMENSION row = 0; row < comp->height_in_blocks; row += comp->v_samp_factor) {
+            JBLOCKARRAY rows = (*src.mem->access_virt_barray)(
+                reinterpret_cast<j_common_ptr>(&src), coef_arrays[ci], row, comp->v_samp_factor, TRUE
+            );
+
+            for (int y = 0; y < comp->v_samp_factor && row + y < comp->height_in_blocks; y++) {
+                JDIMENSION block_row = row + y;
+                bool row_in_region = block_row >= region_top && block_row < region_bottom;
+                for (JDIMENSION x = 0; x < comp->width_in_blocks; x++) {
+                    JCOEFPTR block = rows[y][x];
+                    bool background = !row_in_region || x < region_left || x >= region_right;
+                    for (int k = 0; k < DCTSIZE2; k++) {
+                        // Most coefficients are zero after quantization and stay zero
+                        if (block[k] == 0) continue;
+
+                        // Dequantize with the old step and round to the nearest new step
+                        int value = block[k] * src_table->quantval[k];
+                        int step = dst_table->quantval[k];
+                        if (background) {
+                            // Round to the coarse step first, so more coefficients become zero
+                            int coarse_step = background_steps[k];
+                            value = round_to_step(value, coarse_step) * coarse_step;
+                        }
+                        block[k] = round_to_step(value, step);
+                    }
+                }
+            }
+        }
+    }
+}
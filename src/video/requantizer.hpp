@@ -0,0 +1,87 @@
+#ifndef REQUANTIZER_H
+#define REQUANTIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <csetjmp>
+#include <cstdio>
+
+#include <jpeglib.h>
+
+// Part of a frame to keep at the target quality, in pixels. The rest is quantized at background_quality
+struct QualityRegion {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+    int background_quality = 0;
+};
+
+/*
+    Changes the quality of a JPEG without decoding it to pixels.
+
+    The quantized DCT coefficients are read with the libjpeg coefficient API,
+    rescaled from the source quantization tables to the tables for the target
+    quality, and written to a new JPEG. This skips the IDCT, color conversion,
+    and forward DCT that a full decode/encode needs. Greyscale output drops the
+    chroma components entirely.
+
+    Requantizing can only remove detail: a target quality higher than the
+    source quality produces a larger frame with no visual improvement.
+
+    A QualityRegion keeps detail in one part of the frame: blocks outside it are
+    rounded to the coarser steps of a lower quality, while the tables written to
+    the frame are those of the region's quality.
+
+    A Requantizer reuses its libjpeg objects and output buffer between frames,
+    so use one per thread.
+*/
+class Requantizer {
+public:
+    Requantizer();
+    ~Requantizer();
+
+    Requantizer(const Requantizer&) = delete;
+    Requantizer& operator=(const Requantizer&) = delete;
+
+    // Requantize a baseline or progressive JPEG to the given quality (1-100).
+    // Returns false if the input could not be read. The output is valid until the next call.
+    bool requantize(const uint8_t* jpeg, std::size_t len, int quality, bool greyscale, const QualityRegion* region = nullptr);
+
+    inline const uint8_t* data() const { return out_buffer; }
+    inline std::size_t size() const { return out_size; }
+
+private:
+    // libjpeg reports fatal errors through error_exit, which would otherwise call exit()
+    struct ErrorManager {
+        struct jpeg_error_mgr pub;
+        jmp_buf env;
+    };
+    static void error_exit(j_common_ptr cinfo);
+    // Corrupt camera frames are common enough that libjpeg warnings would flood stderr
+    static void output_message(j_common_ptr cinfo);
+
+    // Writes straight into out_buffer, growing it as needed. Unlike jpeg_mem_dest, a grown buffer
+    // is never held only by libjpeg, so nothing leaks when error_exit jumps out mid-frame
+    static void init_destination(j_compress_ptr cinfo);
+    static boolean empty_output_buffer(j_compress_ptr cinfo);
+    static void term_destination(j_compress_ptr cinfo);
+
+    void rescale_coefficients(jvirt_barray_ptr* coef_arrays, const QualityRegion* region);
+
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    // Shared by both objects so one setjmp covers the whole transcode
+    ErrorManager err;
+    struct jpeg_destination_mgr dest;
+
+    // Luma and chroma tables for the background of a QualityRegion
+    UINT16 background_tables[2][DCTSIZE2];
+
+    // Allocated with malloc so the destination can grow it with realloc
+    unsigned char* out_buffer = nullptr;
+    unsigned long out_capacity = 0;
+    std::size_t out_size = 0;
+};
+
+#endif
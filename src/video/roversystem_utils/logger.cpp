@@ -2,6 +2,7 @@
 
 #include <stdarg.h>
 #include <cassert>
+#include <mutex>
 
 namespace logger {
 
@@ -27,6 +28,10 @@ void log(Level level, const char* format, ...) {
         va_list list;
         va_start(list, format);
 
+        // Capture workers log from their own threads and share the buffer
+        static std::mutex log_lock;
+        std::lock_guard<std::mutex> lock(log_lock);
+
         static char log_buffer[LOG_BUFFER_SIZE];
 
         vsprintf(log_buffer, format, list);
@@ -0,0 +1,89 @@
+#include "scene_detector.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+static const int BLOCK_SIZE = 8;
+
+SceneDetector::SceneDetector(const StaticSceneConfig& config) : cfg(config) {
+    decompressor = tjInitDecompress();
+    if (!decompressor) {
+        throw std::runtime_error(tjGetErrorStr2(nullptr));
+    }
+}
+
+SceneDetector::~SceneDetector() {
+    tjDestroy(decompressor);
+}
+
+bool SceneDetector::sample_jpeg(const uint8_t* jpeg, std::size_t len) {
+    int width, height, subsamp, colorspace;
+    if (tjDecompressHeader3(decompressor, jpeg, len, &width, &height, &subsamp, &colorspace) != 0) {
+        return false;
+    }
+
+    // At 1/8 scale each output pixel is a block's DC coefficient. Greyscale output skips the chroma components
+    const tjscalingfactor scale = { 1, BLOCK_SIZE };
+    sample_width = TJSCALED(width, scale);
+    sample_height = TJSCALED(height, scale);
+    sample.resize(static_cast<std::size_t>(sample_width) * sample_height);
+    if (tjDecompress2(decompressor, jpeg, len, sample.data(), sample_width, 0, sample_height, TJPF_GRAY, TJFLAG_FASTDCT) != 0
+            && tjGetErrorCode(decompressor) == TJERR_FATAL) {
+        return false;
+    }
+    return true;
+}
+
+bool SceneDetector::sample_yuyv(const uint8_t* yuyv, std::size_t len, std::size_t stride, int width, int height) {
+    if (stride < static_cast<std::size_t>(width) * 2 || len < stride * (height - 1) + width * 2) {
+        return false;
+    }
+
+    // Whole blocks only. The partial blocks at the edges are too small to matter
+    sample_width = width / BLOCK_SIZE;
+    sample_height = height / BLOCK_SIZE;
+    sample.resize(static_cast<std::size_t>(sample_width) * sample_height);
+
+    std::vector<unsigned> sums(sample_width);
+    for (int block_row = 0; block_row < sample_height; block_row++) {
+        std::fill(sums.begin(), sums.end(), 0);
+        for (int y = 0; y < BLOCK_SIZE; y++) {
+            const uint8_t* row = yuyv + static_cast<std::size_t>(block_row * BLOCK_SIZE + y) * stride;
+            for (int x = 0; x < sample_width * BLOCK_SIZE; x++) {
+                // Luma is every even byte
+                sums[x / BLOCK_SIZE] += row[2 * x];
+            }
+        }
+        uint8_t* out = sample.data() + static_cast<std::size_t>(block_row) * sample_width;
+        for (int x = 0; x < sample_width; x++) {
+            out[x] = static_cast<uint8_t>(sums[x] / (BLOCK_SIZE * BLOCK_SIZE));
+        }
+    }
+    return true;
+}
+
+bool SceneDetector::changed() const {
+    if (reference.empty() || sample_width != reference_width || sample_height != reference_height) {
+        return true;
+    }
+
+    std::size_t limit = static_cast<std::size_t>(cfg.changed_fraction * sample.size());
+    std::size_t changed_blocks = 0;
+    for (std::size_t i = 0; i < sample.size(); i++) {
+        if (std::abs(sample[i] - reference[i]) > cfg.block_threshold && ++changed_blocks > limit) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void SceneDetector::accept() {
+    reference.swap(sample);
+    reference_width = sample_width;
+    reference_height = sample_height;
+}
+
+void SceneDetector::reset() {
+    reference.clear();
+}
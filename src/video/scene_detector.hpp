@@ -0,0 +1,60 @@
+#ifndef SCENE_DETECTOR_H
+#define SCENE_DETECTOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <turbojpeg.h>
+
+struct StaticSceneConfig {
+    bool enabled = false;
+    // A thumbnail block has changed when its mean luma moves by more than this (0-255)
+    int block_threshold = 8;
+    // The scene has changed when more than this fraction of blocks have
+    double changed_fraction = 0.002;
+    // Unchanged frames are still sent this often, in milliseconds
+    unsigned keepalive_ms = 1000;
+};
+
+// Tells whether a stream's frames differ from the last one sent, so a parked rover stops
+// sending the same picture over and over.
+//
+// Frames are reduced to a thumbnail of the mean luma of each 8x8 block: a JPEG's DC
+// coefficients, which libjpeg-turbo decodes at 1/8 scale without running the IDCT, or an
+// average of the raw luma. Comparing the blocks of the thumbnail against the one from the
+// last sent frame ignores sensor noise, and slow changes such as a shadow crossing the scene
+// add up until they count.
+class SceneDetector {
+public:
+    // throws std::runtime_error if the JPEG handle cannot be created
+    explicit SceneDetector(const StaticSceneConfig& config);
+    ~SceneDetector();
+
+    SceneDetector(const SceneDetector&) = delete;
+    SceneDetector& operator=(const SceneDetector&) = delete;
+
+    // Build the thumbnail of a frame. Returns false if the frame is unreadable
+    bool sample_jpeg(const uint8_t* jpeg, std::size_t len);
+    bool sample_yuyv(const uint8_t* yuyv, std::size_t len, std::size_t stride, int width, int height);
+
+    // Whether the sampled frame differs from the reference. Always true without a reference
+    bool changed() const;
+    // Make the sampled frame the reference the next ones are compared against
+    void accept();
+    // Forget the reference, so the next frame counts as changed
+    void reset();
+
+private:
+    StaticSceneConfig cfg;
+    tjhandle decompressor;
+
+    std::vector<uint8_t> sample;
+    std::vector<uint8_t> reference;
+    int sample_width = 0;
+    int sample_height = 0;
+    int reference_width = 0;
+    int reference_height = 0;
+};
+
+#endif
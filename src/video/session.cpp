@@ -1,9 +1,12 @@
 #include "session.hpp"
+#include "camera_source.hpp"
+#include "replay_source.hpp"
 
+#include <algorithm>
 #include <cstring>
+#include <poll.h>
 #include <stdexcept>
 #include <rover_system_messages.hpp>
-#include <filesystem>
 #include <iostream>
 
 bool VideoConfig::read_from(boost::property_tree::ptree& src) {
@@ -16,9 +19,77 @@ bool VideoConfig::read_from(boost::property_tree::ptree& src) {
         );
 
         video_command_port = src.get<uint16_t>("video.network.command_ip.port");
+        video_announce_port = src.get<uint16_t>("video.network.announce_port", 22203);
+        unsigned fec_group = src.get<unsigned>("video.network.fec_group_size", 0);
+        if (fec_group > 0xFF) {
+            std::cerr << "Invalid FEC group size in config: " << fec_group << "\n";
+            success = false;
+        }
+        fec_group_size = fec_group;
+
+        pacing_rate = src.get<uint64_t>("video.network.pacing_rate", 5000000);
+        pacing_burst = src.get<std::size_t>("video.network.pacing_burst", 16 * 1024);
+
+        std::string send_mode_name = src.get<std::string>("video.network.send_mode", "single");
+        if (send_mode_name == "single") {
+            send_mode = net::SendMode::SINGLE;
+        } else if (send_mode_name == "batch") {
+            send_mode = net::SendMode::BATCH;
+        } else if (send_mode_name == "segment") {
+            send_mode = net::SendMode::SEGMENT;
+        } else {
+            std::cerr << "Invalid send mode in config: " << send_mode_name << "\n";
+            success = false;
+        }
 
         default_jpeg_quality = src.get<uint8_t>("video.camera_init.jpeg_quality", 30);
         default_greyscale_enable = src.get<bool>("video.camera_init.greyscale", false);
+
+        std::string transcode_name = src.get<std::string>("video.camera_init.transcode", "decode");
+        if (!parse_transcode_mode(transcode_name, &default_transcode_mode)) {
+            std::cerr << "Invalid transcode mode in config: " << transcode_name << "\n";
+            success = false;
+        }
+
+        std::string memory_name = src.get<std::string>("video.camera_init.capture_memory", "mmap");
+        if (memory_name == "mmap") {
+            capture_options.memory = camera::MemoryMode::MMAP;
+        } else if (memory_name == "userptr") {
+            capture_options.memory = camera::MemoryMode::USERPTR;
+        } else {
+            std::cerr << "Invalid capture memory mode in config: " << memory_name << "\n";
+            success = false;
+        }
+
+        // "auto" picks per camera. Raw frames skip the JPEG decode, so they are preferred when
+        // every frame is decoded anyway. The other modes need the camera's JPEG to save work
+        std::string format_name = src.get<std::string>("video.camera_init.pixel_format", "auto");
+        if (format_name == "auto") {
+            capture_options.pixel_format = 0;
+        } else if (format_name == "mjpeg") {
+            capture_options.pixel_format = V4L2_PIX_FMT_MJPEG;
+        } else if (format_name == "yuyv") {
+            capture_options.pixel_format = V4L2_PIX_FMT_YUYV;
+        } else {
+            std::cerr << "Invalid pixel format in config: " << format_name << "\n";
+            success = false;
+        }
+        capture_options.prefer_raw = default_transcode_mode == TranscodeMode::DECODE;
+        default_fps = src.get<unsigned>("video.camera_init.fps", DEFAULT_CAMERA_FPS);
+        default_frame_budget = src.get<uint32_t>("video.camera_init.frame_budget", 0);
+        capture_options.buffer_count = src.get<unsigned>("video.camera_init.capture_buffers", camera::DEFAULT_NUM_BUFFERS);
+        capture_options.export_dmabuf = src.get<bool>("video.camera_init.export_dmabuf", false);
+
+        rate_control.enabled = src.get<bool>("video.rate_control.enabled", false);
+        rate_control.target_bandwidth = src.get<uint32_t>("video.rate_control.target_bandwidth", rate_control.target_bandwidth);
+        rate_control.target_loss = src.get<double>("video.rate_control.target_loss", rate_control.target_loss);
+        rate_control.min_quality = src.get<int>("video.rate_control.min_quality", rate_control.min_quality);
+        rate_control.min_fps = src.get<unsigned>("video.rate_control.min_fps", rate_control.min_fps);
+
+        static_scene.enabled = src.get<bool>("video.static_scene.enabled", false);
+        static_scene.block_threshold = src.get<int>("video.static_scene.block_threshold", static_scene.block_threshold);
+        static_scene.changed_fraction = src.get<double>("video.static_scene.changed_fraction", static_scene.changed_fraction);
+        static_scene.keepalive_ms = src.get<unsigned>("video.static_scene.keepalive_ms", static_scene.keepalive_ms);
         
         std::fill(default_enabled_streams.begin(), default_enabled_streams.end(), false);
 
@@ -41,6 +112,73 @@ bool VideoConfig::read_from(boost::property_tree::ptree& src) {
             }
         }
 
+        detect_cameras = src.get<bool>("video.camera_init.detect_cameras", true);
+
+        sources.clear();
+        boost::optional source_list = src.get_child_optional("video.sources");
+        if (source_list) {
+            for (const auto& elem : source_list.get()) {
+                try {
+                    SourceConfig source;
+                    source.stream = std::stoi(elem.first);
+                    if (source.stream < 0 || source.stream >= MAX_STREAMS) {
+                        throw std::out_of_range("stream index");
+                    }
+                    source.file = elem.second.get<std::string>("file", "");
+                    source.width = elem.second.get<unsigned>("width", source.width);
+                    source.height = elem.second.get<unsigned>("height", source.height);
+                    source.fps = elem.second.get<unsigned>("fps", 0);
+                    sources.push_back(source);
+                } catch (const std::logic_error& e) {
+                    std::cerr << "Invalid stream index for source in config: " << elem.first << "\n";
+                    success = false;
+                }
+            }
+        }
+
+        mosaic.enabled = src.get<bool>("video.mosaic.enabled", false);
+        mosaic.stream = src.get<int>("video.mosaic.stream", mosaic.stream);
+        // 4:2:0 chroma needs even tiles
+        mosaic.tile_width = std::max(src.get<unsigned>("video.mosaic.tile_width", mosaic.tile_width), 16U) & ~1U;
+        mosaic.tile_height = std::max(src.get<unsigned>("video.mosaic.tile_height", mosaic.tile_height), 16U) & ~1U;
+        mosaic.fps = src.get<unsigned>("video.mosaic.fps", mosaic.fps);
+        mosaic.focus = src.get<int>("video.mosaic.focus", mosaic.focus);
+        if (mosaic.stream < 0 || mosaic.stream >= MAX_STREAMS) {
+            std::cerr << "Invalid mosaic stream index in config: " << mosaic.stream << "\n";
+            success = false;
+        }
+        for (const SourceConfig& source : sources) {
+            if (mosaic.enabled && source.stream == mosaic.stream) {
+                std::cerr << "Source uses the mosaic's stream index in config: " << source.stream << "\n";
+                success = false;
+            }
+        }
+
+        stills.directory = src.get<std::string>("video.stills.directory", stills.directory);
+        stills.transfer_rate = src.get<uint32_t>("video.stills.transfer_rate", stills.transfer_rate);
+        stills.min_transfer_rate = src.get<uint32_t>("video.stills.min_transfer_rate", stills.min_transfer_rate);
+        stills.quality = std::clamp(src.get<int>("video.stills.quality", stills.quality), 1, 100);
+        stills.settle_frames = src.get<unsigned>("video.stills.settle_frames", stills.settle_frames);
+        stills.max_stills = src.get<unsigned>("video.stills.max_stills", stills.max_stills);
+        if (stills.min_transfer_rate == 0 || stills.min_transfer_rate > stills.transfer_rate) {
+            std::cerr << "Invalid still transfer rates in config: " << stills.min_transfer_rate << " to " << stills.transfer_rate << "\n";
+            success = false;
+        }
+
+        camera_streams.clear();
+        boost::optional cameras = src.get_child_optional("video.camera_streams");
+        if (cameras) {
+            for (const auto& elem : cameras.get()) {
+                int stream = elem.second.get_value<int>();
+                if (stream >= 0 && stream < MAX_STREAMS && !(mosaic.enabled && stream == mosaic.stream)) {
+                    camera_streams[elem.first] = stream;
+                } else {
+                    std::cerr << "Invalid stream index for camera " << elem.first << " in config: " << stream << "\n";
+                    success = false;
+                }
+            }
+        }
+
     } catch (const boost::property_tree::ptree_bad_path& e) {
         std::cerr << "Missing required config value: " << e.what() << "\n";
         success = false;
@@ -52,222 +190,856 @@ bool VideoConfig::read_from(boost::property_tree::ptree& src) {
 }
 
 Session::Session(const VideoConfig& config, boost::asio::io_context& ctx) :
+    io_ctx(ctx),
     ctrl_message_receiver(ctx, config.video_command_port),
     video_streams_out(ctx),
+    stream_announcer(ctx),
     cfg(config),
-    compressor(tjInitCompress()),
-    decompressor(tjInitDecompress()),
-    jpeg_quality(cfg.default_jpeg_quality),
-    greyscale(cfg.default_greyscale_enable)
+    camera_monitor(ctx),
+    camera_update_timer(ctx),
+    announce_timer(ctx),
+    greyscale(cfg.default_greyscale_enable),
+    transcode_mode(cfg.default_transcode_mode),
+    static_scene(cfg.static_scene),
+    focus(cfg.mosaic.focus),
+    rate_controller(cfg.rate_control, 0),
+    frame_queue(FRAME_QUEUE_FRAMES_PER_SOURCE),
+    camera_work(boost::asio::make_work_guard(camera_ctx)),
+    camera_streams(cfg.camera_streams),
+    default_quality(cfg.default_jpeg_quality),
+    still_store(cfg.stills.directory),
+    still_sender(ctx),
+    still_timer(ctx),
+    video_window_start(std::chrono::steady_clock::now())
 {
 
-    if (!compressor || !decompressor) {
-        throw std::runtime_error("Session::Session: Could not initialize JPEG compressors");
-    }
-
     util::Clock::init(&global_clock);
-    util::Timer::init(&camera_update_timer, CAMERA_UPDATE_INTERVAL, &global_clock);
-    util::Timer::init(&tick_timer, TICK_INTERVAL, &global_clock);
-    util::Timer::init(&network_update_timer, NETWORK_UPDATE_INTERVAL, &global_clock);
-
-    for (bool& b : send_stream) {
-        b = false;
-    }
 
     ctrl_message_receiver.register_handler<video_msg::Quality>([this](const uint8_t buf[], std::size_t len) {
         video::Quality msg;
         if (msg.ParseFromArray(buf, len)) {
-            jpeg_quality = msg.jpeg_quality();
             greyscale = msg.grayscale();
+            default_quality = msg.jpeg_quality();
+            for (std::size_t i = 0; i < streams.size(); i++) {
+                StreamRate rate = rate_controller.base(i);
+                rate.quality = msg.jpeg_quality();
+                rate_controller.set_base(i, rate);
+                apply_rate(i);
+            }
         }
     });
 
     ctrl_message_receiver.register_handler<video_msg::Switch>([this](const uint8_t buf[], std::size_t len) {
         video::Switch msg;
         if (msg.ParseFromArray(buf, len)) {
-            if (msg.stream() < MAX_STREAMS) send_stream[msg.stream()] = msg.enabled();
+            if (msg.stream() < MAX_STREAMS) {
+                VideoStream& stream = get_stream(msg.stream());
+                bool changed = stream.settings.enabled.exchange(msg.enabled()) != msg.enabled();
+                // Workers stop waiting on their source while disabled
+                if (msg.enabled() && stream.worker) stream.worker->resume();
+                // Only enabled streams have a tile
+                if (changed && mosaic && stream.source) {
+                    update_mosaic();
+                    announce_streams();
+                }
+            }
+        }
+    });
+    ctrl_message_receiver.register_handler<video_msg::FrameRate>([this](const uint8_t buf[], std::size_t len) {
+        video::FrameRate msg;
+        if (msg.ParseFromArray(buf, len)) {
+            if (msg.stream() < MAX_STREAMS) {
+                get_stream(msg.stream());
+                StreamRate rate = rate_controller.base(msg.stream());
+                rate.fps = msg.fps();
+                rate_controller.set_base(msg.stream(), rate);
+                apply_rate(msg.stream());
+            }
+        }
+    });
+    ctrl_message_receiver.register_handler<video_msg::Resolution>([this](const uint8_t buf[], std::size_t len) {
+        video::Resolution msg;
+        if (msg.ParseFromArray(buf, len)) {
+            if (msg.stream() < MAX_STREAMS && is_supported_scale(msg.scale_denominator())) {
+                get_stream(msg.stream());
+                StreamRate rate = rate_controller.base(msg.stream());
+                rate.scale_denominator = msg.scale_denominator();
+                rate_controller.set_base(msg.stream(), rate);
+                apply_rate(msg.stream());
+            }
+        }
+    });
+    ctrl_message_receiver.register_handler<video_msg::FrameSize>([this](const uint8_t buf[], std::size_t len) {
+        video::FrameSize msg;
+        if (msg.ParseFromArray(buf, len)) {
+            if (msg.stream() < MAX_STREAMS) get_stream(msg.stream()).settings.frame_budget = msg.max_bytes();
+        }
+    });
+    ctrl_message_receiver.register_handler<video_msg::RefreshRequest>([this](const uint8_t buf[], std::size_t len) {
+        video::RefreshRequest msg;
+        if (msg.ParseFromArray(buf, len) && msg.stream() < streams.size()) {
+            streams[msg.stream()]->settings.refresh_requested = true;
+        }
+    });
+    ctrl_message_receiver.register_handler<video_msg::Focus>([this](const uint8_t buf[], std::size_t len) {
+        video::Focus msg;
+        if (msg.ParseFromArray(buf, len) && (!msg.enabled() || msg.stream() < MAX_STREAMS)) {
+            int stream = msg.enabled() ? static_cast<int>(msg.stream()) : -1;
+            if (focus.exchange(stream) != stream) {
+                // Send the newly focused camera at once, even if its scene is static
+                if (stream != -1) get_stream(stream).settings.refresh_requested = true;
+                announce_streams();
+            }
+        }
+    });
+    ctrl_message_receiver.register_handler<video_msg::RegionOfInterest>([this](const uint8_t buf[], std::size_t len) {
+        video::RegionOfInterest msg;
+        if (msg.ParseFromArray(buf, len) && msg.stream() < MAX_STREAMS) {
+            // Clip the region to the frame. Nothing left of it means the whole frame
+            float left = std::clamp(msg.x(), 0.0F, 1.0F);
+            float top = std::clamp(msg.y(), 0.0F, 1.0F);
+            float right = std::clamp(msg.x() + msg.width(), 0.0F, 1.0F);
+            float bottom = std::clamp(msg.y() + msg.height(), 0.0F, 1.0F);
+
+            RegionOfInterest region;
+            region.enabled = msg.enabled() && right > left && bottom > top;
+            if (region.enabled) {
+                region.x = left;
+                region.y = top;
+                region.width = right - left;
+                region.height = bottom - top;
+                region.quality = std::min(msg.quality(), 100U);
+                region.weighted = msg.weighted();
+            }
+
+            StreamSettings& settings = get_stream(msg.stream()).settings;
+            {
+                std::lock_guard<std::mutex> guard(settings.region_lock);
+                settings.region = region;
+            }
+            // The picture changes, so send it even if the scene is static
+            settings.refresh_requested = true;
+        }
+    });
+    ctrl_message_receiver.register_handler<video_msg::StillCapture>([this](const uint8_t buf[], std::size_t len) {
+        video::StillCapture msg;
+        if (msg.ParseFromArray(buf, len) && msg.stream() < streams.size()) {
+            capture_still(msg.stream());
+        }
+    });
+    ctrl_message_receiver.register_handler<video_msg::StillRequest>([this](const uint8_t buf[], std::size_t len) {
+        video::StillRequest msg;
+        if (!msg.ParseFromArray(buf, len)) return;
+        const StillInfo* still = still_store.find(msg.id());
+        if (!still) return;
+
+        // A new request replaces the last one, so the base station resumes wherever it lost chunks
+        still_transfer.id = still->id;
+        still_transfer.offset = std::min(msg.offset(), still->size);
+        uint32_t available = still->size - still_transfer.offset;
+        still_transfer.end = still_transfer.offset + (msg.length() ? std::min(msg.length(), available) : available);
+        still_transfer.chunk_size = msg.chunk_size()
+            ? std::clamp(msg.chunk_size(), STILL_MIN_CHUNK_SIZE, STILL_MAX_CHUNK_SIZE)
+            : STILL_DEFAULT_CHUNK_SIZE;
+        if (!still_sending) schedule_still_chunk(std::chrono::microseconds(0));
+    });
+    ctrl_message_receiver.register_handler<video_msg::StillReceived>([this](const uint8_t buf[], std::size_t len) {
+        video::StillReceived msg;
+        if (!msg.ParseFromArray(buf, len)) return;
+        const StillInfo* still = still_store.find(msg.id());
+        if (!still || still->capture_time != msg.capture_time()) return;
+
+        logger::log(logger::INFO, "Base station received still %u", msg.id());
+        delete_still(msg.id());
+        // Lists the next still waiting, if there were more than an announcement holds
+        announce_streams();
+    });
+    ctrl_message_receiver.register_handler<video_msg::StreamFeedback>([this](const uint8_t buf[], std::size_t len) {
+        video::StreamFeedback msg;
+        if (msg.ParseFromArray(buf, len) && msg.stream() < streams.size() && rate_controller.enabled()) {
+            int active_streams = 0;
+            // Static streams send little, and cameras only in the mosaic send nothing of their own,
+            // so their share of the bandwidth goes to the others
+            for (std::size_t i = 0; i < streams.size(); i++) {
+                const StreamSettings& settings = streams[i]->settings;
+                bool sent_alone = !mosaic || focus == static_cast<int>(i);
+                if (streams[i]->source && settings.enabled && !settings.scene_static && sent_alone) active_streams++;
+            }
+            if (mosaic && streams[cfg.mosaic.stream]->settings.enabled) active_streams++;
+
+            LinkReport report;
+            report.interval_ms = msg.interval_ms();
+            report.frames_completed = msg.frames_completed();
+            report.frames_dropped = msg.frames_dropped();
+            report.bytes_received = msg.bytes_received();
+
+            if (rate_controller.update(msg.stream(), report, active_streams)) {
+                StreamRate rate = rate_controller.current(msg.stream());
+                logger::log(logger::DEBUG, "Stream %u rate: quality %d, scale 1/%d, %u fps",
+                    msg.stream(), rate.quality, rate.scale_denominator, rate.fps);
+                apply_rate(msg.stream());
+            }
         }
     });
     ctrl_message_receiver.open();
 
-    video_streams_out.create_streams(MAX_STREAMS);
     video_streams_out.set_destination_endpoint(boost::asio::ip::udp::endpoint(
        cfg.video_stream_address,
        cfg.video_stream_port 
     ));
+    video_streams_out.set_fec_group_size(cfg.fec_group_size);
+    video_streams_out.set_send_mode(cfg.send_mode);
+    video_streams_out.set_pacing(cfg.pacing_rate, cfg.pacing_burst);
 
-    send_stream = cfg.default_enabled_streams;
+    stream_announcer.set_destination_endpoint(net::Destination(cfg.video_stream_address, cfg.video_announce_port));
+    still_sender.set_destination_endpoint(net::Destination(cfg.video_stream_address, cfg.video_announce_port));
 
 }
 
-int Session::update_available_streams() {
-    /**
-     * We need 2 arrays to keep track of all of our data.
-     * 1. An array for new cameras found
-     * 2. An array for which camera indices still exist
-     **/
-    int camerasFound[MAX_STREAMS] = {-1};
-    int existingCameras[MAX_STREAMS] = {-1};
-    int cntr = 0;
-    uint8_t open = 1;
-    int numOpen = 0;
-    
-    // Find all video devices available
-    for (int i = 0; cntr < MAX_STREAMS; i++) {
-        std::array<char, 32> fname_buffer;
-        snprintf(fname_buffer.data(), fname_buffer.size(), "/dev/video%i", i);
-
-        // If video device i doesn't exist, then there are no more
-        if (!std::filesystem::exists(fname_buffer.data())) {
-            break;
-        } else {
-            camerasFound[cntr++] = i;
-        }
+Session::~Session() {
+    camera_monitor.stop();
+    camera_update_timer.cancel();
+    announce_timer.cancel();
+    still_timer.cancel();
+    // Let an open in progress finish. Cameras it opens are never published
+    camera_work.reset();
+    if (camera_thread.joinable()) {
+        camera_thread.join();
     }
-    // There are 3 steps here.
-    // 1. Check which cameras exist in the file system.
-    // 2. Iterate through our cameras adding any extras that do exist.
-    // 3. Remove any cameras that don't exist,
-    for (int i = 0; i < cntr; i++) {
-        // 1.  Check which cameras exist in the file system.
-        for(int j = 0; j < MAX_STREAMS; j++) {
-            if(streams[j]) { 
-                if(camerasFound[i] == streams[j]->dev_video_id) {
-                    // Use -1 to say this camera is being used,
-                    // so we don't need to do anything.
-                    camerasFound[i] = -1;
-                    existingCameras[j] = i;
-                    break;
-                }
-            }
-        }
-        // Don't initialize this camera, as it exists 
-        if (camerasFound[i] == -1) {
-            continue;
-        }
-        numOpen++;
+    for (std::size_t i = 0; i < streams.size(); i++) {
+        close_stream(i);
+    }
+    // Capture workers copy into the mosaic until they stop
+    if (mosaic) mosaic->stop();
+}
 
-        while(streams[open])
-            open++;
+void Session::start() {
+    camera_thread = std::thread([this]() { camera_ctx.run(); });
 
-        // "/dev/video" is 10 chars long, leave 2 for numbers, and one for null terminator.
-        std::array<char, 13> device_name_buffer; 
-        snprintf(device_name_buffer.data(), device_name_buffer.size(), "/dev/video%i", camerasFound[i]);
+    if (!still_store.load()) {
+        logger::log(logger::WARNING, "Unable to use still directory %s", cfg.stills.directory.c_str());
+    } else if (!still_store.list().empty()) {
+        logger::log(logger::INFO, "Found %zu stills in %s", still_store.list().size(), cfg.stills.directory.c_str());
+        limit_stills();
+    }
 
-        if (!camera::is_video_device(device_name_buffer.data())) {
-            camerasFound[i] = -1;
-            continue;
-        }
-        camera::CaptureSession* cs = new camera::CaptureSession;
-        logger::log(logger::DEBUG, "Connecting to camera %d", camerasFound[i]);
-        camera::Error err = camera::open(cs, device_name_buffer.data(), CAMERA_WIDTH, CAMERA_HEIGHT, camerasFound[i], &global_clock, CAMERA_FRAME_INTERVAL);
-        
-        if (err != camera::Error::OK) {
-            camerasFound[i] = -1;
-            logger::log(logger::DEBUG, "Camera %d errored while opening", cs->dev_video_id);
-            delete cs;
-            continue;
+    if (cfg.mosaic.enabled) {
+        VideoStream& s = get_stream(cfg.mosaic.stream);
+        s.settings.enabled = true;
+        StreamRate rate = rate_controller.base(cfg.mosaic.stream);
+        rate.fps = cfg.mosaic.fps;
+        rate_controller.set_base(cfg.mosaic.stream, rate);
+        apply_rate(cfg.mosaic.stream);
+        mosaic = std::make_unique<MosaicWorker>(*this, cfg.mosaic, s.settings);
+        mosaic->start();
+        resize_frame_queue();
+    }
+
+    // Configured sources claim their streams before any camera is assigned one
+    for (const SourceConfig& source : cfg.sources) {
+        get_stream(source.stream);
+        if (source.fps) {
+            StreamRate rate = rate_controller.base(source.stream);
+            rate.fps = source.fps;
+            rate_controller.set_base(source.stream, rate);
+            apply_rate(source.stream);
         }
+        open_stream_async(source.stream, -1, [source](unsigned fps) {
+            return open_replay(source, fps);
+        });
+    }
 
-        // Start the camera.
-        err = camera::start(cs);
-        if (err != camera::Error::OK) {
-            camerasFound[i] = -1;
-            logger::log(logger::DEBUG, "Camera %d errored while starting", cs->dev_video_id);
-            camera::close(cs);
-            delete cs;
-            continue;
+    if (cfg.detect_cameras) {
+        bool watching = camera_monitor.start(
+            [this](int dev_video_id) { camera_added(dev_video_id); },
+            [this](int dev_video_id) { camera_removed(dev_video_id); }
+        );
+        update_available_streams();
+        if (!watching) {
+            logger::log(logger::WARNING, "Camera hot-plug unavailable. Scanning for cameras every %d ms", CAMERA_UPDATE_INTERVAL);
+            poll_cameras = true;
+            schedule_camera_update();
         }
-        // 2. Iterate through our cameras adding any extras that do exist.
-        this->streams[open] = cs;
     }
-    for(int i = 0; i < cntr; i++) {
-        if (camerasFound[i] != -1) {
-            logger::log(logger::INFO, "Connected new camera at /dev/video%d", camerasFound[i]);
+    schedule_announcement();
+}
+
+void Session::schedule_camera_update() {
+    camera_update_timer.expires_after(std::chrono::milliseconds(CAMERA_UPDATE_INTERVAL));
+    camera_update_timer.async_wait([this](const boost::system::error_code& ec) {
+        if (ec) return;
+        update_available_streams();
+        if (poll_cameras) schedule_camera_update();
+    });
+}
+
+VideoStream& Session::get_stream(int stream) {
+    while (streams.size() <= static_cast<std::size_t>(stream)) {
+        int id = streams.size();
+        auto created = std::make_unique<VideoStream>();
+        created->settings.enabled = cfg.default_enabled_streams[id];
+        created->settings.frame_budget = cfg.default_frame_budget;
+        streams.push_back(std::move(created));
+
+        rate_controller.add_streams(id + 1);
+        StreamRate rate;
+        rate.quality = default_quality;
+        rate.fps = cfg.default_fps;
+        rate_controller.set_base(id, rate);
+        apply_rate(id);
+    }
+    video_streams_out.create_streams(streams.size());
+    return *streams[stream];
+}
+
+void Session::open_worker(int stream, FrameSource* source) {
+    VideoStream& s = get_stream(stream);
+    s.source.reset(source);
+    s.worker = std::make_unique<CaptureWorker>(*this, stream, source, s.settings);
+    s.worker->start();
+    resize_frame_queue();
+    update_mosaic();
+}
+
+void Session::close_stream(int stream) {
+    if (static_cast<std::size_t>(stream) >= streams.size()) return;
+    VideoStream& s = *streams[stream];
+
+    // Stop the worker first: it uses the source until its thread exits
+    if (s.worker) {
+        s.worker->stop();
+        s.worker.reset();
+    }
+    // Queued frames may still hold this source's buffers
+    frame_queue.discard(stream);
+    video_streams_out.cancel_frames(stream);
+    if (s.source) {
+        s.source.reset();
+        s.dev_video_id = -1;
+        resize_frame_queue();
+        update_mosaic();
+    }
+}
+
+void Session::update_mosaic() {
+    if (!mosaic) return;
+    std::vector<int> members;
+    for (std::size_t i = 0; i < streams.size(); i++) {
+        // Disabled streams' workers stop waiting for frames, so their tiles would never be filled
+        if (streams[i]->source && streams[i]->settings.enabled) members.push_back(i);
+    }
+    mosaic->set_members(members);
+}
+
+void Session::resize_frame_queue() {
+    std::size_t sources = 0;
+    for (const auto& s : streams) {
+        if (s->source) sources++;
+    }
+    // The mosaic is a source too
+    if (mosaic) sources++;
+    frame_queue.set_capacity(FRAME_QUEUE_FRAMES_PER_SOURCE * std::max<std::size_t>(sources, 1));
+}
+
+// Any id the kernel assigns fits, unlike a fixed size buffer
+static std::string device_path(int dev_video_id) {
+    return "/dev/video" + std::to_string(dev_video_id);
+}
+
+FrameSource* Session::open_camera(int dev_video_id, unsigned fps) {
+    std::string device_name = device_path(dev_video_id);
+    if (!camera::is_video_device(device_name.c_str())) {
+        return nullptr;
+    }
+    camera::CaptureSession* cs = new camera::CaptureSession;
+    logger::log(logger::DEBUG, "Connecting to camera %d", dev_video_id);
+    camera::Error err = camera::open(cs, device_name.c_str(), CAMERA_WIDTH, CAMERA_HEIGHT, dev_video_id, &global_clock, fps, &cfg.capture_options);
+    
+    if (err != camera::Error::OK) {
+        logger::log(logger::DEBUG, "Camera %d errored while opening: %s", dev_video_id, camera::get_error_string(err));
+        camera::close(cs);
+        delete cs;
+        return nullptr;
+    }
+
+    // Start the camera.
+    err = camera::start(cs);
+    if (err != camera::Error::OK) {
+        logger::log(logger::DEBUG, "Camera %d errored while starting", dev_video_id);
+        camera::close(cs);
+        delete cs;
+        return nullptr;
+    }
+
+    logger::log(logger::DEBUG, "Camera %d capturing %s at %u fps (requested %u)", dev_video_id,
+        cs->pixel_format == V4L2_PIX_FMT_YUYV ? "YUYV" : "MJPEG", cs->native_fps, fps);
+    return new CameraSource(cs);
+}
+
+FrameSource* Session::open_replay(const SourceConfig& source, unsigned fps) {
+    std::unique_ptr<ReplaySource> replay;
+    if (source.file.empty()) {
+        replay = ReplaySource::test_pattern(source.width, source.height, fps);
+    } else {
+        replay = ReplaySource::from_file(source.file, fps);
+    }
+    if (!replay) {
+        logger::log(logger::WARNING, "Unable to open source for stream %d: %s", source.stream,
+            source.file.empty() ? "test pattern could not be encoded" : source.file.c_str());
+    }
+    return replay.release();
+}
+
+void Session::set_stream_fps(int stream, unsigned fps) {
+    VideoStream& s = *streams[stream];
+    s.settings.fps = fps;
+    if (s.worker) {
+        s.worker->set_framerate(fps);
+    }
+}
+
+void Session::reopen_stream(int stream) {
+    if (static_cast<std::size_t>(stream) >= streams.size() || streams[stream]->dev_video_id == -1) return;
+
+    int dev_video_id = streams[stream]->dev_video_id;
+    close_stream(stream);
+    open_stream_async(stream, dev_video_id, [this, dev_video_id](unsigned fps) {
+        return open_camera(dev_video_id, fps);
+    });
+}
+
+void Session::update_available_streams() {
+    std::vector<int> devices = CameraMonitor::list_devices();
+
+    for (const auto& s : streams) {
+        if (s->dev_video_id != -1 && !std::binary_search(devices.begin(), devices.end(), s->dev_video_id)) {
+            camera_removed(s->dev_video_id);
         }
     }
-    // 3. Remove any cameras that don't exist.
-    for(int j = 0; j < MAX_STREAMS; j++) {
-        if(existingCameras[j] == -1 && this->streams[j] != nullptr) {
-            logger::log(logger::INFO, "Camera %d disconnected.", j);
-            camera::close(this->streams[j]);
-            delete this->streams[j];
-            this->streams[j] = nullptr;
+    for (int dev_video_id : devices) {
+        camera_added(dev_video_id);
+    }
+}
+
+// Drivers report the port a camera is plugged into, which survives renumbering. Fall back to its model
+static std::string camera_identity(const std::string& name, const std::string& hardware_location) {
+    return hardware_location.empty() ? name : hardware_location;
+}
+
+void Session::camera_added(int dev_video_id) {
+    if (opening_devices.count(dev_video_id)) return;
+    for (const auto& s : streams) {
+        if (s->dev_video_id == dev_video_id) return;
+    }
+
+    // The stream id depends on which camera this is, so identify it before opening
+    opening_devices.insert(dev_video_id);
+    boost::asio::post(camera_ctx, [this, dev_video_id]() {
+        std::string device_name = device_path(dev_video_id);
+        char name[32] = "";
+        char hardware_location[32] = "";
+        bool usable = camera::is_video_device(device_name.c_str(), &name, &hardware_location);
+
+        boost::asio::post(io_ctx, [this, dev_video_id, usable, camera_id = camera_identity(name, hardware_location)]() {
+            int stream = usable ? assign_stream(camera_id) : -1;
+            if (stream == -1) {
+                if (usable) logger::log(logger::WARNING, "No free stream for camera %s at /dev/video%d", camera_id.c_str(), dev_video_id);
+                opening_devices.erase(dev_video_id);
+                return;
+            }
+            open_stream_async(stream, dev_video_id, [this, dev_video_id](unsigned fps) {
+                return open_camera(dev_video_id, fps);
+            });
+        });
+    });
+}
+
+void Session::camera_removed(int dev_video_id) {
+    for (std::size_t i = 0; i < streams.size(); i++) {
+        if (streams[i]->dev_video_id == dev_video_id) {
+            logger::log(logger::INFO, "Camera %d disconnected.", static_cast<int>(i));
+            close_stream(i);
+            announce_streams();
         }
     }
-    return numOpen;
+}
+
+bool Session::stream_busy(int stream) const {
+    if (static_cast<std::size_t>(stream) >= streams.size()) return false;
+    return streams[stream]->source || streams[stream]->opening;
+}
+
+int Session::assign_stream(const std::string& camera_id) {
+    auto known = camera_streams.find(camera_id);
+    if (known != camera_streams.end() && !stream_busy(known->second)) {
+        return known->second;
+    }
+
+    // Ids remembered for other cameras are left free for when they return
+    std::set<int> reserved;
+    for (const auto& entry : camera_streams) reserved.insert(entry.second);
+    for (int stream = 0; stream < MAX_STREAMS; stream++) {
+        if (reserved.count(stream) || stream_busy(stream) || (mosaic && stream == cfg.mosaic.stream)) continue;
+        // A second camera reporting the same identity gets a stream, but it is not remembered
+        if (known == camera_streams.end()) camera_streams[camera_id] = stream;
+        return stream;
+    }
+    return -1;
+}
+
+void Session::open_stream_async(int stream, int dev_video_id, std::function<FrameSource*(unsigned fps)> open_source) {
+    VideoStream& s = get_stream(stream);
+    s.opening = true;
+    if (dev_video_id != -1) opening_devices.insert(dev_video_id);
+    unsigned fps = s.settings.fps;
+    boost::asio::post(camera_ctx, [this, stream, dev_video_id, fps, open_source]() {
+        FrameSource* source = open_source(fps);
+        boost::asio::post(io_ctx, [this, stream, dev_video_id, source]() {
+            publish_stream(stream, dev_video_id, source);
+        });
+    });
+}
+
+void Session::publish_stream(int stream, int dev_video_id, FrameSource* source) {
+    VideoStream& s = *streams[stream];
+    s.opening = false;
+    opening_devices.erase(dev_video_id);
+    if (!source) return;
+
+    if (dev_video_id != -1) {
+        logger::log(logger::INFO, "Connected camera %s at /dev/video%d to stream %d",
+            camera_identity(source->name(), source->location()).c_str(), dev_video_id, stream);
+    } else {
+        logger::log(logger::INFO, "Streaming %s (%s) on stream %d", source->name().c_str(), source->location().c_str(), stream);
+    }
+    s.dev_video_id = dev_video_id;
+    open_worker(stream, source);
+    announce_streams();
+}
+
+void Session::announce_streams() {
+    video_msg::StreamAnnouncement msg;
+    for (std::size_t i = 0; i < streams.size(); i++) {
+        const FrameSource* source = streams[i]->source.get();
+        if (!source) continue;
+
+        video::StreamInfo* info = msg.data.add_streams();
+        info->set_stream(i);
+        info->set_name(source->name());
+        info->set_hardware_location(source->location());
+        info->set_width(source->width());
+        info->set_height(source->height());
+        info->set_fps(source->framerate() ? source->framerate() : streams[i]->settings.fps.load());
+        info->set_focused(mosaic && focus == static_cast<int>(i));
+    }
+    if (mosaic) {
+        std::vector<int> members;
+        int columns, width, height;
+        mosaic->layout(&members, &columns, &width, &height);
+
+        video::StreamInfo* info = msg.data.add_streams();
+        info->set_stream(cfg.mosaic.stream);
+        info->set_name("Mosaic");
+        info->set_width(width);
+        info->set_height(height);
+        info->set_fps(streams[cfg.mosaic.stream]->settings.fps);
+        for (int member : members) info->add_tiles(member);
+        info->set_tile_columns(columns);
+    }
+    // Oldest first, so stills taken while the base station was away are all offered in turn
+    const std::vector<StillInfo>& stills = still_store.list();
+    for (std::size_t i = 0; i < std::min(stills.size(), STILL_ANNOUNCE_COUNT); i++) {
+        video::StillInfo* info = msg.data.add_stills();
+        info->set_id(stills[i].id);
+        info->set_stream(stills[i].stream);
+        info->set_size(stills[i].size);
+        info->set_capture_time(stills[i].capture_time);
+    }
+    stream_announcer.send_message(msg);
+}
+
+void Session::schedule_announcement() {
+    announce_timer.expires_after(std::chrono::milliseconds(STREAM_ANNOUNCE_INTERVAL));
+    announce_timer.async_wait([this](const boost::system::error_code& ec) {
+        if (ec) return;
+        announce_streams();
+        schedule_announcement();
+    });
 }
 
 void Session::send_frames() {
-    for (size_t i = 1; i < MAX_STREAMS; i++) {
-            camera::CaptureSession* cs = streams[i];
-            if(!cs || !send_stream[i]) continue;
-            
-            // Grab a frame.
-            uint8_t* frame_buffer;
-            size_t frame_size;
-            {
-                camera::Error err = camera::grab_frame(cs, &frame_buffer, &frame_size);
-                if (err != camera::Error::OK) {
-                    if (err == camera::Error::AGAIN)
-                        continue;
-
-                    logger::log(logger::DEBUG, "Deleting camera %d, because it errored", cs->dev_video_id);
-                    camera::close(cs);
-                    delete cs;
-                    streams[i] = nullptr;
-                    continue;
-                }
+    send_pending = false;
+    EncodedFrame frame;
+    while (frame_queue.pop(frame)) {
+        // The sender holds the frame until it has gone out (or is replaced), then its buffer is recycled
+        std::shared_ptr<EncodedFrame> owner(new EncodedFrame(std::move(frame)), [this](EncodedFrame* sent) {
+            frame_queue.release(*sent);
+            delete sent;
+        });
+        video_streams_out.async_send_frame(owner->stream, owner->bytes(), owner->size(), owner, owner->capture_time);
+        video_window_bytes += owner->size();
+    }
+}
+
+void Session::queue_frame(int stream, const uint8_t* data, std::size_t len, uint64_t capture_time) {
+    if (!frame_queue.push(stream, data, len, capture_time)) {
+        dropped_frames++;
+    }
+    schedule_send();
+}
+
+void Session::queue_frame(int stream, FrameRef frame, std::size_t len, uint64_t capture_time) {
+    if (!frame_queue.push_ref(stream, std::move(frame), len, capture_time)) {
+        dropped_frames++;
+    }
+    schedule_send();
+}
+
+void Session::schedule_send() {
+    if (!send_pending.exchange(true)) {
+        boost::asio::post(io_ctx, [this]() { send_frames(); });
+    }
+}
+
+void Session::apply_rate(int stream) {
+    StreamRate rate = rate_controller.current(stream);
+    StreamSettings& settings = streams[stream]->settings;
+    settings.quality = rate.quality;
+    settings.scale = rate.scale_denominator;
+    if (settings.fps != rate.fps) {
+        set_stream_fps(stream, rate.fps);
+    }
+}
+
+void Session::framerate_refused(int stream) {
+    // The driver will not change rate while streaming. Restart the camera at the new rate
+    boost::asio::post(io_ctx, [this, stream]() {
+        logger::log(logger::DEBUG, "Restarting stream %d to change framerate to %u", stream, streams[stream]->settings.fps.load());
+        reopen_stream(stream);
+    });
+}
+
+void Session::worker_failed(int stream) {
+    boost::asio::post(io_ctx, [this, stream]() {
+        // The stream may have been closed (or reopened) by a camera scan in the meantime
+        VideoStream& s = *streams[stream];
+        if (s.worker && s.worker->failed()) {
+            logger::log(logger::DEBUG, "Closing stream %d, because its source %s errored", stream, s.source->name().c_str());
+            close_stream(stream);
+            announce_streams();
+            // No hot-plug event follows if the device is still present, so try it again later
+            if (cfg.detect_cameras && !poll_cameras) schedule_camera_update();
+        }
+    });
+}
+
+void Session::capture_still(int stream) {
+    VideoStream& s = *streams[stream];
+    if (!s.worker) return;
+    if (s.dev_video_id == -1) {
+        s.worker->request_still(cfg.stills.quality);
+        return;
+    }
+
+    // Listing frame sizes can block, so ask on the camera thread
+    int dev_video_id = s.dev_video_id;
+    std::size_t width = s.source->width();
+    std::size_t height = s.source->height();
+    boost::asio::post(camera_ctx, [this, stream, dev_video_id, width, height]() {
+        std::string device_name = device_path(dev_video_id);
+        std::size_t max_width, max_height;
+        bool larger = camera::largest_frame_size(device_name.c_str(), &max_width, &max_height) && max_width * max_height > width * height;
+
+        boost::asio::post(io_ctx, [this, stream, dev_video_id, larger, max_width, max_height]() {
+            // The camera may have been unplugged or reopened in the meantime
+            VideoStream& s = *streams[stream];
+            if (s.dev_video_id != dev_video_id || !s.worker) return;
+            if (!larger) {
+                s.worker->request_still(cfg.stills.quality);
+                return;
             }
-            unsigned long out_frame_size = frame_size;
-            // Decode the frame and encode it again to set our desired quality.
-            static uint8_t raw_buffer[CAMERA_WIDTH * CAMERA_HEIGHT * 3];
-            // Decompress into a raw frame.
-            tjDecompress2(
-                decompressor,
-                frame_buffer,
-                frame_size,
-                raw_buffer,
-                CAMERA_WIDTH,
-                3 * CAMERA_WIDTH,
-                CAMERA_HEIGHT,
-                TJPF_RGB,
-                0
-            );
-            // Recompress into jpeg buffer.
-            if (greyscale) {
-                tjCompress2(
-                    compressor,
-                    raw_buffer,
-                    CAMERA_WIDTH,
-                    3 * CAMERA_WIDTH,
-                    CAMERA_HEIGHT,
-                    TJPF_RGB,
-                    &frame_buffer,
-                    &out_frame_size,
-                    TJSAMP_GRAY,
-                    jpeg_quality,
-                    TJFLAG_NOREALLOC
-                );
+
+            // The device cannot stream at two sizes, so the stream pauses. Marking the device
+            // as opening keeps hot-plug scans from taking it while it is closed
+            logger::log(logger::INFO, "Pausing stream %d for a %zux%zu still", stream, max_width, max_height);
+            close_stream(stream);
+            s.opening = true;
+            opening_devices.insert(dev_video_id);
+            boost::asio::post(camera_ctx, [this, stream, dev_video_id, max_width, max_height]() {
+                std::vector<uint8_t> jpeg;
+                uint64_t capture_time = 0;
+                bool captured = capture_camera_still(dev_video_id, max_width, max_height, jpeg, &capture_time);
+                StillInfo saved;
+                if (captured) {
+                    saved = still_store.save(stream, capture_time, jpeg);
+                }
+
+                boost::asio::post(io_ctx, [this, stream, dev_video_id, captured, saved]() {
+                    if (captured) {
+                        still_saved(saved);
+                    } else {
+                        logger::log(logger::WARNING, "Unable to take a still with camera %d", dev_video_id);
+                    }
+                    open_stream_async(stream, dev_video_id, [this, dev_video_id](unsigned fps) {
+                        return open_camera(dev_video_id, fps);
+                    });
+                });
+            });
+        });
+    });
+}
+
+bool Session::capture_camera_still(int dev_video_id, std::size_t width, std::size_t height, std::vector<uint8_t>& jpeg, uint64_t* capture_time) {
+    std::string device_name = device_path(dev_video_id);
+
+    // Raw frames have not lost anything yet, so they are compressed at the still quality when the camera offers them
+    camera::CaptureOptions options = cfg.capture_options;
+    options.pixel_format = 0;
+    options.prefer_raw = true;
+    options.buffer_count = 2;
+    options.export_dmabuf = false;
+
+    std::unique_ptr<camera::CaptureSession> cs = std::make_unique<camera::CaptureSession>();
+    camera::Error err = camera::open(cs.get(), device_name.c_str(), width, height, dev_video_id, &global_clock, 0, &options);
+    if (err == camera::Error::OK) err = camera::start(cs.get());
+    if (err != camera::Error::OK) {
+        logger::log(logger::DEBUG, "Camera %d errored while opening for a still: %s", dev_video_id, camera::get_error_string(err));
+        camera::close(cs.get());
+        return false;
+    }
+
+    // The first frames after starting are often dark or blurred while the camera adjusts
+    bool captured = false;
+    unsigned skipped = 0;
+    struct pollfd pfd = { cs->fd, POLLIN, 0 };
+    while (!captured && ::poll(&pfd, 1, STILL_FRAME_TIMEOUT) > 0) {
+        uint8_t* frame;
+        std::size_t frame_size;
+        uint32_t index;
+        err = camera::grab_frame(cs.get(), &frame, &frame_size, &index, capture_time);
+        if (err == camera::Error::AGAIN) continue;
+        if (err != camera::Error::OK) break;
+
+        if (skipped++ >= cfg.stills.settle_frames) {
+            if (cs->pixel_format == V4L2_PIX_FMT_YUYV) {
+                Transcoder transcoder;
+                TranscodeSettings still;
+                still.quality = cfg.stills.quality;
+                if (transcoder.compress_yuyv(frame, frame_size, cs->bytes_per_line, cs->width, cs->height, still)) {
+                    jpeg.assign(transcoder.data(), transcoder.data() + transcoder.size());
+                    captured = true;
+                }
             } else {
-                tjCompress2(
-                    compressor,
-                    raw_buffer,
-                    CAMERA_WIDTH,
-                    3 * CAMERA_WIDTH,
-                    CAMERA_HEIGHT,
-                    TJPF_RGB,
-                    &frame_buffer,
-                    &out_frame_size,
-                    TJSAMP_420,
-                    jpeg_quality,
-                    TJFLAG_NOREALLOC
-                );
+                jpeg.assign(frame, frame + frame_size);
+                captured = true;
             }
-
-            video_streams_out.send_frame(i, frame_buffer, out_frame_size);
-            
-            camera::return_buffer(cs);
         }
+        camera::return_buffer(cs.get(), index);
+    }
+    camera::close(cs.get());
+    return captured;
+}
+
+void Session::still_captured(int stream, std::vector<uint8_t> jpeg, uint64_t capture_time) {
+    // Written on the camera thread, so the io_context keeps sending video meanwhile
+    auto still = std::make_shared<std::vector<uint8_t>>(std::move(jpeg));
+    boost::asio::post(camera_ctx, [this, stream, still, capture_time]() {
+        StillInfo saved = still_store.save(stream, capture_time, *still);
+        boost::asio::post(io_ctx, [this, saved]() {
+            still_saved(saved);
+        });
+    });
+}
+
+void Session::still_saved(const StillInfo& still) {
+    if (still.id == 0) {
+        logger::log(logger::WARNING, "Unable to save a still of stream %d in %s", still.stream, cfg.stills.directory.c_str());
+        return;
+    }
+    still_store.add(still);
+    logger::log(logger::INFO, "Saved still %u of stream %d (%u bytes)", still.id, still.stream, still.size);
+    limit_stills();
+    announce_streams();
+}
+
+void Session::delete_still(uint32_t id) {
+    if (still_transfer.id == id) {
+        still_transfer = StillTransfer();
+    }
+    if (!still_store.remove(id)) {
+        logger::log(logger::WARNING, "Unable to delete still %u from %s", id, cfg.stills.directory.c_str());
+    }
+}
+
+void Session::limit_stills() {
+    while (cfg.stills.max_stills != 0 && still_store.list().size() > cfg.stills.max_stills) {
+        const StillInfo& oldest = still_store.list().front();
+        logger::log(logger::WARNING, "Deleting still %u of stream %d to keep at most %u", oldest.id, oldest.stream, cfg.stills.max_stills);
+        delete_still(oldest.id);
+    }
+}
+
+void Session::schedule_still_chunk(std::chrono::microseconds delay) {
+    still_sending = true;
+    still_timer.expires_after(delay);
+    still_timer.async_wait([this](const boost::system::error_code& ec) {
+        if (ec) return;
+        send_still_chunk();
+    });
 }
 
+void Session::send_still_chunk() {
+    still_sending = false;
+    StillTransfer& t = still_transfer;
+    if (t.offset >= t.end) return;
+
+    // Video goes first: a chunk only leaves when no frame is waiting or being sent
+    if (video_streams_out.busy() || frame_queue.size() > 0) {
+        schedule_still_chunk(std::chrono::milliseconds(STILL_YIELD_INTERVAL));
+        return;
+    }
+
+    // The file stays open while its still is being sent, and is read in order unless the base station skips ahead
+    const StillInfo* still = still_store.find(t.id);
+    if (still && t.file_id != t.id) {
+        t.file_id = still_store.open(t.id, t.file) ? t.id : 0;
+    }
+    uint32_t len = std::min(t.chunk_size, t.end - t.offset);
+    video_msg::StillChunk msg;
+    std::string* data = msg.data.mutable_data();
+    data->resize(len);
+    bool read = still && t.file_id == t.id;
+    if (read && t.file.tellg() != static_cast<std::streamoff>(t.offset)) {
+        t.file.seekg(t.offset);
+    }
+    if (!read || !t.file.read(&(*data)[0], len)) {
+        logger::log(logger::WARNING, "Unable to read still %u", t.id);
+        t = StillTransfer();
+        return;
+    }
+
+    msg.data.set_id(t.id);
+    msg.data.set_offset(t.offset);
+    msg.data.set_size(still->size);
+    still_sender.send_message(msg);
+    t.offset += len;
+
+    // Spacing the chunks out keeps the link free for the frames that come next
+    schedule_still_chunk(std::chrono::microseconds(static_cast<uint64_t>(len) * 1000000 / still_rate()));
+}
+
+uint32_t Session::still_rate() {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - video_window_start).count();
+    if (elapsed >= 1.0) {
+        video_rate = video_window_bytes / elapsed;
+        video_window_bytes = 0;
+        video_window_start = now;
+    }
+
+    // The link's capacity, as far as the session knows it. Without one, stills are only kept out of the way of frames
+    double capacity = rate_controller.enabled() ? cfg.rate_control.target_bandwidth
+        : cfg.pacing_rate ? cfg.pacing_rate : cfg.stills.transfer_rate + video_rate;
+    double leftover = capacity - video_rate;
+    return static_cast<uint32_t>(std::clamp(leftover, static_cast<double>(cfg.stills.min_transfer_rate), static_cast<double>(cfg.stills.transfer_rate)));
+}
@@ -7,64 +7,279 @@
 #include <stream.hpp>
 
 #include "camera.hpp"
+#include "camera_monitor.hpp"
+#include "capture_worker.hpp"
+#include "frame_source.hpp"
+#include "frame_queue.hpp"
+#include "mosaic_worker.hpp"
+#include "rate_controller.hpp"
+#include "scene_detector.hpp"
+#include "still_store.hpp"
+#include "transcoder.hpp"
 
-#include <turbojpeg.h>
 #include <boost/property_tree/ptree.hpp>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
 
-const int MAX_STREAMS = 9;
+// Stream ids are limited by the stream header, not by the session
+const int MAX_STREAMS = net::FrameHeader::MAX_STREAMS;
 const unsigned int CAMERA_WIDTH = 1280;
 const unsigned int CAMERA_HEIGHT = 720;
 
+// Delay before rescanning for cameras after one fails. Also the scan period when inotify is unavailable
 const int CAMERA_UPDATE_INTERVAL = 5000;
 
-const int CAMERA_FRAME_INTERVAL = 1000 / 15;
+// Capture rate used when the config does not set one
+const unsigned DEFAULT_CAMERA_FPS = 15;
 
-const int TICK_INTERVAL = 1000;
 
-const int NETWORK_UPDATE_INTERVAL = 1000 / 2;
+// Encoded frames waiting for the sender, per open source
+const std::size_t FRAME_QUEUE_FRAMES_PER_SOURCE = 2;
 
+// Live streams are announced this often, and whenever a source is added or removed
+const int STREAM_ANNOUNCE_INTERVAL = 1000;
+
+// Announcements list this many of the oldest stills. Newer ones are listed as the base station receives those
+const std::size_t STILL_ANNOUNCE_COUNT = 16;
+// Still chunks must fit in a control message datagram
+const uint32_t STILL_MIN_CHUNK_SIZE = 256;
+const uint32_t STILL_MAX_CHUNK_SIZE = 1400;
+const uint32_t STILL_DEFAULT_CHUNK_SIZE = 1024;
+// While video frames are waiting to be sent, the next still chunk waits this long, in milliseconds
+const int STILL_YIELD_INTERVAL = 2;
+// How long to wait for a frame from a camera reopened for a still, in milliseconds
+const int STILL_FRAME_TIMEOUT = 2000;
+
+
+// A stream fed from a recording or a generated test pattern instead of a camera
+struct SourceConfig {
+    int stream;
+    // MJPEG file to replay. A test pattern is generated when empty
+    std::string file;
+    // Test pattern size. A recording keeps its own
+    unsigned width = CAMERA_WIDTH;
+    unsigned height = CAMERA_HEIGHT;
+    // Frames per second (0 = the stream's default)
+    unsigned fps = 0;
+};
 
 struct VideoConfig {
     bool read_from(boost::property_tree::ptree& src);
 
     uint16_t video_stream_port;
     uint16_t video_command_port;
+    // Stream announcements are sent to the stream address on this port
+    uint16_t video_announce_port;
+    // Data sections per FEC repair section (0 = no FEC)
+    uint8_t fec_group_size;
+    net::SendMode send_mode;
+    // Frames are paced to pacing_rate bytes/s, in bursts of at most pacing_burst bytes. 0 disables pacing, so each
+    // frame leaves as one burst that can overflow the link's queues. The rate should be what the link carries
+    uint64_t pacing_rate;
+    std::size_t pacing_burst;
     boost::asio::ip::address_v4 video_stream_address;
 
     uint8_t default_jpeg_quality;
     bool default_greyscale_enable;
+    TranscodeMode default_transcode_mode;
+    camera::CaptureOptions capture_options;
+    unsigned default_fps;
+    uint32_t default_frame_budget;
+    RateControlConfig rate_control;
+    // Hold back frames while the scene does not change
+    StaticSceneConfig static_scene;
+    // Send every camera as tiles of one stream, and only the focused one in full
+    MosaicConfig mosaic;
+    // Full resolution stills, kept on the video server until the base station downloads them
+    StillConfig stills;
     std::array<bool, MAX_STREAMS> default_enabled_streams;
+    // Stream ids reserved for cameras, by hardware location (or name, if the driver reports no location)
+    std::map<std::string, int> camera_streams;
+    // Open cameras as they are found. Off for machines that only use configured sources
+    bool detect_cameras;
+    std::vector<SourceConfig> sources;
+};
+
+// One stream id. It exists from the first control message or source that uses the id
+struct VideoStream {
+    StreamSettings settings;
+    std::unique_ptr<FrameSource> source;
+    // The source is the camera at /dev/video<dev_video_id>, or -1 if it is not a camera
+    int dev_video_id = -1;
+    // Captures and transcodes the source's frames on its own thread
+    std::unique_ptr<CaptureWorker> worker;
+    // Set while a source is being opened for this stream
+    bool opening = false;
 };
 
 class Session {
 private:
+    boost::asio::io_context& io_ctx;
     net::MessageReceiver ctrl_message_receiver;
     net::StreamSender video_streams_out;
+    net::MessageSender stream_announcer;
     const VideoConfig& cfg;
 public:
     util::Clock global_clock;
     VideoConfig config;
 
-    camera::CaptureSession* streams[MAX_STREAMS] = {0};
+    // Indexed by stream id. Grows as ids are used. Only accessed on the io_context
+    std::vector<std::unique_ptr<VideoStream>> streams;
+
+    // Opens cameras as they are plugged in and closes them when they are removed
+    CameraMonitor camera_monitor;
+    // Rescans for cameras after a failure, or every CAMERA_UPDATE_INTERVAL without inotify
+    boost::asio::steady_timer camera_update_timer;
 
-    util::Timer camera_update_timer;
-    util::Timer tick_timer;
-    util::Timer network_update_timer;
+    // Sends the list of live streams every STREAM_ANNOUNCE_INTERVAL
+    boost::asio::steady_timer announce_timer;
 
-    uint32_t ticks = 0;
+    // Written by control message handlers and read by the capture workers
+    std::atomic<bool> greyscale{false};
+    std::atomic<TranscodeMode> transcode_mode{TranscodeMode::DECODE};
+    const StaticSceneConfig static_scene;
+    // The camera sent on its own stream while there is a mosaic (-1 = none). Changed by Focus control messages
+    std::atomic<int> focus;
+    // Set when the mosaic is enabled. Created before any capture worker, and stopped after all of them
+    std::unique_ptr<MosaicWorker> mosaic;
 
-    tjhandle compressor;
-    tjhandle decompressor;
+    // Adjusts each stream's quality, scale, and fps from receiver feedback.
+    // The operator's settings from control messages are its upper limit
+    RateController rate_controller;
 
-    unsigned int jpeg_quality = 30;
-    bool greyscale = false;
-    std::array<bool, MAX_STREAMS> send_stream;
+    FrameQueue frame_queue;
+    // Frames discarded because the sender fell behind
+    std::atomic<uint32_t> dropped_frames{0};
+    // Frames not sent because the scene was static
+    std::atomic<uint32_t> suppressed_frames{0};
 
     Session(const VideoConfig&, boost::asio::io_context&);
 
-    int update_available_streams();
+    ~Session();
+
+    // Open the configured sources and available cameras, and watch for hot-plugged cameras on the io_context
+    void start();
+
+    // Open any cameras that are not streaming yet, and close the streams of removed ones
+    void update_available_streams();
+    // Get a stream's state, creating it with the default settings if the id is new
+    VideoStream& get_stream(int stream);
+    // Tell receivers which streams have cameras
+    void announce_streams();
+    // Hand the frames encoded by the capture workers to the paced sender
     void send_frames();
+    // Called by capture workers to hand off an encoded frame. Schedules send_frames on the io_context
+    void queue_frame(int stream, const uint8_t* data, std::size_t len, uint64_t capture_time);
+    // Hand off a frame by reference. It is released after sending
+    void queue_frame(int stream, FrameRef frame, std::size_t len, uint64_t capture_time);
+    // Change a stream's capture rate. Applied natively by the driver when possible
+    void set_stream_fps(int stream, unsigned fps);
+    // Called by a capture worker when the driver refuses a new framerate while streaming
+    void framerate_refused(int stream);
+    // Called by a capture worker when its source errors. The source is closed on the io_context
+    void worker_failed(int stream);
+
+    // Take a still at the camera's largest frame size. A camera streaming at a smaller size is
+    // reopened at the largest for one frame, pausing its stream. Other sources give their next frame
+    void capture_still(int stream);
+    // Called by a capture worker with a still it took. Saved and announced on the io_context
+    void still_captured(int stream, std::vector<uint8_t> jpeg, uint64_t capture_time);
+
+private:
+    // Set while a send_frames call is posted but has not started, so bursts of frames post once
+    std::atomic<bool> send_pending{false};
+
+    // Camera ioctls can block for hundreds of milliseconds, so cameras are opened
+    // and started on this thread and then published to the stream table on the io_context
+    boost::asio::io_context camera_ctx;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> camera_work;
+    std::thread camera_thread;
+    // Devices being identified or opened. Only accessed on the io_context
+    std::set<int> opening_devices;
+    // Stream id for each camera identity ever seen, plus the ones reserved in the config.
+    // A camera keeps its stream when it is unplugged or the devices are renumbered
+    std::map<std::string, int> camera_streams;
+    // The quality new streams start with. Changed by Quality control messages
+    int default_quality;
+    // Set when inotify is unavailable and cameras must be found by polling
+    bool poll_cameras = false;
+
+    void schedule_camera_update();
+    void schedule_send();
+    void schedule_announcement();
+
+    // Hot-plug handlers. Called on the io_context
+    void camera_added(int dev_video_id);
+    void camera_removed(int dev_video_id);
+    // The stream for a camera identity: its previous or reserved id, otherwise the lowest free one.
+    // Returns -1 if every id is in use
+    int assign_stream(const std::string& camera_id);
+    // True if the stream has a source or one is being opened for it
+    bool stream_busy(int stream) const;
+    // Reserve the stream and create its source on the camera thread, at the stream's fps.
+    // dev_video_id is -1 for sources that are not cameras
+    void open_stream_async(int stream, int dev_video_id, std::function<FrameSource*(unsigned fps)> open_source);
+    void publish_stream(int stream, int dev_video_id, FrameSource* source);
+
+    // Apply the rate controller's current settings for a stream
+    void apply_rate(int stream);
+
+    // Open and start /dev/video<dev_video_id>. Returns null on failure. Runs on the camera thread
+    FrameSource* open_camera(int dev_video_id, unsigned fps);
+    // Load a configured recording or test pattern. Returns null on failure. Runs on the camera thread
+    static FrameSource* open_replay(const SourceConfig& source, unsigned fps);
+    void open_worker(int stream, FrameSource* source);
+    // Keep FRAME_QUEUE_FRAMES_PER_SOURCE frames of room for each open source
+    void resize_frame_queue();
+    // Show every open, enabled source in the mosaic
+    void update_mosaic();
+    // Close and reopen a stream's camera, applying the current stream settings
+    void reopen_stream(int stream);
+    void close_stream(int stream);
+
+    // Stills are sent on their own sender, one chunk per message, to the announcement address
+    StillStore still_store;
+    net::MessageSender still_sender;
+    boost::asio::steady_timer still_timer;
+    // The part of a still the base station last asked for. Chunks are sent until offset reaches end
+    struct StillTransfer {
+        uint32_t id = 0;
+        uint32_t offset = 0;
+        uint32_t end = 0;
+        uint32_t chunk_size = STILL_DEFAULT_CHUNK_SIZE;
+        // Kept open from one chunk to the next. file_id is the still it holds, or 0
+        std::ifstream file;
+        uint32_t file_id = 0;
+    };
+    StillTransfer still_transfer;
+    bool still_sending = false;
+    // Bytes of video handed to the sender since video_window_start, and the rate over the last window
+    uint64_t video_window_bytes = 0;
+    std::chrono::steady_clock::time_point video_window_start;
+    double video_rate = 0.0;
+
+    // Reopen a camera at width x height, take one frame after the exposure settles, and close it. Runs on the camera thread
+    bool capture_camera_still(int dev_video_id, std::size_t width, std::size_t height, std::vector<uint8_t>& jpeg, uint64_t* capture_time);
+    // List a still written on the camera thread and announce it
+    void still_saved(const StillInfo& still);
+    // Delete a still, stopping its transfer if it is being sent
+    void delete_still(uint32_t id);
+    // Delete the oldest stills until no more than the configured number are kept
+    void limit_stills();
+    void schedule_still_chunk(std::chrono::microseconds delay);
+    // Send the next chunk of the requested still, unless video frames are waiting
+    void send_still_chunk();
+    // Bytes per second for stills: what the video streams leave of the link, within the configured limits
+    uint32_t still_rate();
 };
 
 #endif
@@ -0,0 +1,112 @@
+#include "still_store.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+StillStore::StillStore(const std::string& directory) : directory(directory) {}
+
+bool StillStore::load() {
+    std::error_code ec;
+    fs::create_directories(directory, ec);
+    if (ec) return false;
+
+    stills.clear();
+    for (const auto& entry : fs::directory_iterator(directory, ec)) {
+        StillInfo still;
+        uint32_t id;
+        int stream;
+        uint64_t capture_time;
+        char extension[5] = "";
+        std::string name = entry.path().filename().string();
+        if (std::sscanf(name.c_str(), "still_%" SCNu32 "_%d_%" SCNu64 ".%4s", &id, &stream, &capture_time, extension) != 4
+                || std::string(extension) != "jpg" || id == 0) {
+            continue;
+        }
+        std::error_code size_ec;
+        uintmax_t size = entry.file_size(size_ec);
+        if (size_ec || size == 0 || size > UINT32_MAX) continue;
+
+        still.id = id;
+        still.stream = stream;
+        still.size = static_cast<uint32_t>(size);
+        still.capture_time = capture_time;
+        stills.push_back(still);
+        next_id = std::max(next_id.load(), id + 1);
+    }
+    std::sort(stills.begin(), stills.end(), [](const StillInfo& a, const StillInfo& b) { return a.id < b.id; });
+    return true;
+}
+
+StillInfo StillStore::save(int stream, uint64_t capture_time, const std::vector<uint8_t>& jpeg) {
+    StillInfo still;
+    still.stream = stream;
+    still.size = static_cast<uint32_t>(jpeg.size());
+    still.capture_time = capture_time;
+    if (jpeg.empty() || jpeg.size() > UINT32_MAX) return still;
+    uint32_t id = next_id++;
+
+    // Written under another name and then renamed, so a crash never leaves a partial still to be sent
+    std::error_code ec;
+    fs::create_directories(directory, ec);
+    StillInfo named = still;
+    named.id = id;
+    std::string final_path = path(named);
+    std::string partial_path = final_path + ".part";
+    {
+        std::ofstream output(partial_path, std::ios::binary | std::ios::trunc);
+        output.write(reinterpret_cast<const char*>(jpeg.data()), jpeg.size());
+        if (!output) {
+            output.close();
+            fs::remove(partial_path, ec);
+            return still;
+        }
+    }
+    fs::rename(partial_path, final_path, ec);
+    if (ec) {
+        fs::remove(partial_path, ec);
+        return still;
+    }
+    return named;
+}
+
+void StillStore::add(const StillInfo& still) {
+    // Stills saved on different threads can finish out of order
+    auto it = std::lower_bound(stills.begin(), stills.end(), still.id, [](const StillInfo& s, uint32_t id) { return s.id < id; });
+    stills.insert(it, still);
+}
+
+const StillInfo* StillStore::find(uint32_t id) const {
+    auto it = std::lower_bound(stills.begin(), stills.end(), id, [](const StillInfo& still, uint32_t id) { return still.id < id; });
+    return it != stills.end() && it->id == id ? &*it : nullptr;
+}
+
+bool StillStore::remove(uint32_t id) {
+    auto it = std::lower_bound(stills.begin(), stills.end(), id, [](const StillInfo& still, uint32_t id) { return still.id < id; });
+    if (it == stills.end() || it->id != id) return false;
+
+    // Forgotten even if the file stays, so it is not offered again until a restart finds it
+    std::error_code ec;
+    bool removed = fs::remove(path(*it), ec);
+    stills.erase(it);
+    return removed;
+}
+
+bool StillStore::open(uint32_t id, std::ifstream& file) const {
+    const StillInfo* still = find(id);
+    if (!still) return false;
+    file.close();
+    file.clear();
+    file.open(path(*still), std::ios::binary);
+    return file.is_open();
+}
+
+std::string StillStore::path(const StillInfo& still) const {
+    char name[64];
+    std::snprintf(name, sizeof(name), "still_%" PRIu32 "_%d_%" PRIu64 ".jpg", still.id, still.stream, still.capture_time);
+    return (fs::path(directory) / name).string();
+}
@@ -0,0 +1,70 @@
+#ifndef STILL_STORE_H
+#define STILL_STORE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+struct StillConfig {
+    // Stills are saved here, so they survive a restart until the base station has them
+    std::string directory = "stills";
+    // Most bytes per second a still is sent at, when the video streams leave that much
+    uint32_t transfer_rate = 200000;
+    // Bytes per second a still is always sent at, even when the video streams use the whole link
+    uint32_t min_transfer_rate = 10000;
+    // JPEG quality of stills taken from raw frames
+    int quality = 95;
+    // Frames discarded after reopening a camera, while its exposure settles
+    unsigned settle_frames = 5;
+    // Most stills kept (0 = no limit). The oldest are deleted to make room, whether or not the base station has them
+    unsigned max_stills = 200;
+};
+
+// A still saved on the video server
+struct StillInfo {
+    uint32_t id = 0;
+    int stream = 0;
+    uint32_t size = 0;
+    // Microseconds since the Unix epoch
+    uint64_t capture_time = 0;
+};
+
+// Keeps full resolution stills as files until the base station says it has saved them.
+// Files are named after the still's id, stream, and capture time, so the list is rebuilt
+// from the directory after a restart and an interrupted download can resume.
+//
+// save() writes a file and may be called from any thread, so a multi-megabyte still is not
+// written on the thread that sends video. Everything else is only used on the Session's io_context.
+class StillStore {
+public:
+    explicit StillStore(const std::string& directory);
+
+    // Find the stills saved by earlier runs. Returns false if the directory cannot be created
+    bool load();
+
+    // Write a still under the next id. Its id is 0 if it could not be written. It is listed once added
+    StillInfo save(int stream, uint64_t capture_time, const std::vector<uint8_t>& jpeg);
+    void add(const StillInfo& still);
+
+    // Every saved still, oldest first
+    inline const std::vector<StillInfo>& list() const { return stills; }
+    // Returns null if there is no still with this id
+    const StillInfo* find(uint32_t id) const;
+    // Delete a still's file and forget it. Returns false if there was no such still or its file could not be deleted
+    bool remove(uint32_t id);
+
+    // Open a still for reading. Returns false if the still is gone
+    bool open(uint32_t id, std::ifstream& file) const;
+
+private:
+    const std::string directory;
+    std::vector<StillInfo> stills;
+    std::atomic<uint32_t> next_id{1};
+
+    std::string path(const StillInfo& still) const;
+};
+
+#endif
@@ -0,0 +1,344 @@
+#include "transcoder.hpp"
+#include "yuyv.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+bool parse_transcode_mode(const std::string& name, TranscodeMode* out_mode) {
+    if (name == "decode") {
+        *out_mode = TranscodeMode::DECODE;
+    } else if (name == "requantize") {
+        *out_mode = TranscodeMode::REQUANTIZE;
+    } else if (name == "passthrough") {
+        *out_mode = TranscodeMode::PASSTHROUGH;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* get_transcode_mode_string(TranscodeMode mode) {
+    switch (mode) {
+        case TranscodeMode::DECODE: return "decode";
+        case TranscodeMode::REQUANTIZE: return "requantize";
+        case TranscodeMode::PASSTHROUGH: return "passthrough";
+    }
+    return "unknown";
+}
+
+bool is_supported_scale(int denominator) {
+    int num_factors;
+    const tjscalingfactor* factors = tjGetScalingFactors(&num_factors);
+    if (!factors) return false;
+    for (int i = 0; i < num_factors; i++) {
+        if (factors[i].num == 1 && factors[i].denom == denominator) return true;
+    }
+    return false;
+}
+
+// Grow a region outwards to multiples of the alignment and clip it to the frame. Returns false if nothing is left
+static bool align_region(const FrameRegion& region, int width, int height, int align_x, int align_y, FrameRegion* out_region) {
+    int left = std::max(region.x, 0) / align_x * align_x;
+    int top = std::max(region.y, 0) / align_y * align_y;
+    int right = std::min((region.x + region.width + align_x - 1) / align_x * align_x, width);
+    int bottom = std::min((region.y + region.height + align_y - 1) / align_y * align_y, height);
+    if (right <= left || bottom <= top) return false;
+
+    out_region->x = left;
+    out_region->y = top;
+    out_region->width = right - left;
+    out_region->height = bottom - top;
+    return true;
+}
+
+Transcoder::Transcoder() :
+    compressor(tjInitCompress()),
+    decompressor(tjInitDecompress()),
+    transformer(tjInitTransform())
+{
+    if (!compressor || !decompressor || !transformer) {
+        if (compressor) tjDestroy(compressor);
+        if (decompressor) tjDestroy(decompressor);
+        if (transformer) tjDestroy(transformer);
+        throw std::runtime_error("Transcoder::Transcoder: Could not initialize JPEG compressors");
+    }
+}
+
+Transcoder::~Transcoder() {
+    tjDestroy(compressor);
+    tjDestroy(decompressor);
+    tjDestroy(transformer);
+    tjFree(encode_buffer);
+    tjFree(crop_buffer);
+}
+
+bool Transcoder::transcode(const uint8_t* jpeg, std::size_t len, const TranscodeSettings& settings) {
+    if (settings.crop.width > 0) {
+        if (!crop_jpeg(jpeg, len, settings.crop)) return false;
+        jpeg = crop_buffer;
+        len = crop_size;
+    }
+
+    // Only a full decode can change resolution
+    if (settings.scale_denominator != 1) {
+        return decode_encode(jpeg, len, settings);
+    }
+    if (settings.mode == TranscodeMode::PASSTHROUGH) {
+        out_data = jpeg;
+        out_size = len;
+        return true;
+    }
+    if (settings.mode == TranscodeMode::REQUANTIZE) {
+        bool requantized;
+        if (settings.detail.width > 0) {
+            // The frame's tables are the detail's, and everything else is rounded more coarsely
+            QualityRegion region;
+            region.x = settings.detail.x;
+            region.y = settings.detail.y;
+            region.width = settings.detail.width;
+            region.height = settings.detail.height;
+            region.background_quality = settings.quality;
+            requantized = requantizer.requantize(jpeg, len, std::max(settings.detail_quality, settings.quality), settings.greyscale, &region);
+        } else {
+            requantized = requantizer.requantize(jpeg, len, settings.quality, settings.greyscale);
+        }
+        if (!requantized) {
+            return false;
+        }
+        out_data = requantizer.data();
+        out_size = requantizer.size();
+        return true;
+    }
+    return decode_encode(jpeg, len, settings);
+}
+
+void Transcoder::reserve(int width, int height) {
+    // 4:4:4 planes are the largest, so any camera subsampling fits
+    reserve_planes(width, height, TJSAMP_444);
+    reserve_encode_buffer(width, height, TJSAMP_444);
+}
+
+bool Transcoder::reserve_planes(int width, int height, int subsamp) {
+    int num_planes = (subsamp == TJSAMP_GRAY) ? 1 : 3;
+    for (int i = 0; i < num_planes; i++) {
+        int plane_width = tjPlaneWidth(i, width, subsamp);
+        int plane_height = tjPlaneHeight(i, height, subsamp);
+        if (plane_width < 0 || plane_height < 0) return false;
+
+        std::size_t plane_size = static_cast<std::size_t>(plane_width) * plane_height;
+        // Never shrink, so alternating frame sizes do not reallocate
+        if (planes[i].size() < plane_size) {
+            planes[i].resize(plane_size);
+        }
+        strides[i] = plane_width;
+    }
+    return true;
+}
+
+bool Transcoder::reserve_encode_buffer(int width, int height, int subsamp) {
+    return reserve_buffer(&encode_buffer, &encode_capacity, width, height, subsamp);
+}
+
+bool Transcoder::reserve_buffer(unsigned char** buffer, unsigned long* capacity, int width, int height, int subsamp) {
+    // Worst-case size so the compressor never has to reallocate
+    unsigned long need_capacity = tjBufSize(width, height, subsamp);
+    if (*capacity < need_capacity) {
+        tjFree(*buffer);
+        *buffer = tjAlloc(need_capacity);
+        *capacity = *buffer ? need_capacity : 0;
+    }
+    return *buffer != nullptr;
+}
+
+bool Transcoder::crop_jpeg(const uint8_t* jpeg, std::size_t len, const FrameRegion& region) {
+    int width, height, subsamp, colorspace;
+    if (tjDecompressHeader3(decompressor, jpeg, len, &width, &height, &subsamp, &colorspace) != 0 || subsamp < 0) {
+        return false;
+    }
+
+    // Lossless crops can only start on an MCU boundary
+    FrameRegion aligned;
+    if (!align_region(region, width, height, tjMCUWidth[subsamp], tjMCUHeight[subsamp], &aligned)) return false;
+    if (!reserve_buffer(&crop_buffer, &crop_capacity, aligned.width, aligned.height, subsamp)) return false;
+
+    // Only the coefficients are copied. Camera frames carry no metadata worth sending
+    tjtransform transform = {};
+    transform.r.x = aligned.x;
+    transform.r.y = aligned.y;
+    transform.r.w = aligned.width;
+    transform.r.h = aligned.height;
+    transform.op = TJXOP_NONE;
+    transform.options = TJXOPT_CROP | TJXOPT_COPYNONE;
+
+    unsigned char* buffer = crop_buffer;
+    unsigned long cropped_size = crop_capacity;
+    if (tjTransform(transformer, jpeg, len, 1, &buffer, &cropped_size, &transform, TJFLAG_NOREALLOC) != 0
+            && tjGetErrorCode(transformer) == TJERR_FATAL) {
+        return false;
+    }
+    crop_size = cropped_size;
+    return true;
+}
+
+void Transcoder::halve_chroma_rows(int height) {
+    // 4:2:2 and 4:2:0 chroma planes have the same width, so average row pairs in place
+    int rows = tjPlaneHeight(1, height, TJSAMP_420);
+    for (int i = 1; i < 3; i++) {
+        uint8_t* plane = planes[i].data();
+        int stride = strides[i];
+        for (int y = 0; y < rows; y++) {
+            const uint8_t* top = plane + 2 * y * stride;
+            const uint8_t* bottom = (2 * y + 1 < height) ? top + stride : top;
+            uint8_t* out = plane + y * stride;
+            for (int x = 0; x < stride; x++) {
+                out[x] = static_cast<uint8_t>((top[x] + bottom[x] + 1) >> 1);
+            }
+        }
+    }
+}
+
+bool Transcoder::decode_encode(const uint8_t* jpeg, std::size_t len, const TranscodeSettings& settings) {
+    int subsamp;
+    if (!decode_planes(jpeg, len, settings.scale_denominator, settings.greyscale, false, &subsamp)) return false;
+    return encode_planes(planes_width, planes_height, subsamp, settings.quality);
+}
+
+bool Transcoder::compress_yuyv(const uint8_t* yuyv, std::size_t len, std::size_t stride, int width, int height, const TranscodeSettings& settings) {
+    int subsamp;
+    if (!repack_planes(yuyv, len, stride, width, height, settings.scale_denominator, settings.greyscale, false, settings.crop, &subsamp)) return false;
+    return encode_planes(planes_width, planes_height, subsamp, settings.quality);
+}
+
+bool Transcoder::decode_i420(const uint8_t* jpeg, std::size_t len, int scale_denominator, bool greyscale) {
+    int subsamp;
+    return decode_planes(jpeg, len, scale_denominator, greyscale, true, &subsamp);
+}
+
+bool Transcoder::yuyv_i420(const uint8_t* yuyv, std::size_t len, std::size_t stride, int width, int height, int scale_denominator, bool greyscale) {
+    int subsamp;
+    return repack_planes(yuyv, len, stride, width, height, scale_denominator, greyscale, true, FrameRegion(), &subsamp);
+}
+
+void Transcoder::flatten_chroma(int height) {
+    // Neutral chroma: grey in colour codecs
+    std::size_t size = static_cast<std::size_t>(strides[1]) * tjPlaneHeight(1, height, TJSAMP_420);
+    std::fill_n(planes[1].begin(), size, 128);
+    std::fill_n(planes[2].begin(), size, 128);
+}
+
+bool Transcoder::decode_planes(const uint8_t* jpeg, std::size_t len, int scale_denominator, bool greyscale, bool i420, int* out_subsamp) {
+    int width, height, subsamp, colorspace;
+    if (tjDecompressHeader3(decompressor, jpeg, len, &width, &height, &subsamp, &colorspace) != 0) {
+        return false;
+    }
+
+    // The decoder picks its scaled IDCT from the requested size, so smaller frames are cheaper to decode as well
+    const tjscalingfactor scale = { 1, scale_denominator };
+    width = TJSCALED(width, scale);
+    height = TJSCALED(height, scale);
+
+    // Camera frames are often slightly corrupt. Only give up on fatal errors, not warnings.
+    // Frames stay in YUV the whole way, skipping the conversion to RGB and back
+    if (greyscale || subsamp == TJSAMP_GRAY) {
+        subsamp = i420 ? TJSAMP_420 : TJSAMP_GRAY;
+        if (!reserve_planes(width, height, subsamp)) return false;
+
+        // A greyscale decode only runs the IDCT for the luma component
+        if (tjDecompress2(decompressor, jpeg, len, planes[0].data(), width, strides[0], height, TJPF_GRAY, 0) != 0
+                && tjGetErrorCode(decompressor) == TJERR_FATAL) {
+            return false;
+        }
+        if (i420) flatten_chroma(height);
+    } else {
+        if (!reserve_planes(width, height, subsamp)) return false;
+
+        unsigned char* dst_planes[3] = { planes[0].data(), planes[1].data(), planes[2].data() };
+        if (tjDecompressToYUVPlanes(decompressor, jpeg, len, dst_planes, width, strides, height, 0) != 0
+                && tjGetErrorCode(decompressor) == TJERR_FATAL) {
+            return false;
+        }
+
+        // Most cameras send 4:2:2. Sending 4:2:0 halves the chroma data
+        if (subsamp == TJSAMP_422) {
+            halve_chroma_rows(height);
+            subsamp = TJSAMP_420;
+        }
+        // Other subsamplings would need resampling, and cameras do not use them
+        if (i420 && subsamp != TJSAMP_420) return false;
+    }
+
+    planes_width = width;
+    planes_height = height;
+    *out_subsamp = subsamp;
+    return true;
+}
+
+bool Transcoder::repack_planes(const uint8_t* yuyv, std::size_t len, std::size_t stride, int width, int height, int scale, bool greyscale, bool i420,
+        const FrameRegion& crop, int* out_subsamp) {
+    if (width % 2 != 0 || stride < static_cast<std::size_t>(width) * 2 || len < stride * (height - 1) + width * 2) {
+        return false;
+    }
+
+    if (crop.width > 0) {
+        // Pixel pairs share their chroma, so the crop starts on an even column
+        FrameRegion aligned;
+        if (!align_region(crop, width, height, 2, 1, &aligned)) return false;
+        yuyv += aligned.y * stride + aligned.x * 2;
+        width = aligned.width;
+        height = aligned.height;
+    }
+
+    int out_width = yuyv_scaled_size(width, scale);
+    int out_height = yuyv_scaled_size(height, scale);
+
+    // Straight to the planes the encoder reads, with chroma already at 4:2:0
+    int subsamp = (greyscale && !i420) ? TJSAMP_GRAY : TJSAMP_420;
+    if (!reserve_planes(out_width, out_height, subsamp)) return false;
+    if (subsamp == TJSAMP_GRAY) {
+        yuyv_to_grey(yuyv, stride, width, height, scale, planes[0].data(), strides[0]);
+    } else {
+        yuyv_to_i420(yuyv, stride, width, height, scale,
+            planes[0].data(), strides[0], planes[1].data(), strides[1], planes[2].data(), strides[2]);
+        if (greyscale) flatten_chroma(out_height);
+    }
+
+    planes_width = out_width;
+    planes_height = out_height;
+    *out_subsamp = subsamp;
+    return true;
+}
+
+bool Transcoder::encode_planes(int width, int height, int subsamp, int quality) {
+    const uint8_t* src_planes[3] = { planes[0].data(), planes[1].data(), planes[2].data() };
+    return compress_planes(src_planes, strides, width, height, subsamp, quality);
+}
+
+bool Transcoder::compress_i420(const uint8_t* const src_planes[3], const int src_strides[3], int width, int height, int quality) {
+    return compress_planes(src_planes, src_strides, width, height, TJSAMP_420, quality);
+}
+
+bool Transcoder::compress_planes(const uint8_t* const src_planes[3], const int src_strides[3], int width, int height, int subsamp, int quality) {
+    if (!reserve_encode_buffer(width, height, subsamp)) return false;
+
+    // TurboJPEG takes non-const pointers to const planes
+    const unsigned char* tj_planes[3] = { src_planes[0], src_planes[1], src_planes[2] };
+    unsigned long encoded_size = encode_capacity;
+    if (tjCompressFromYUVPlanes(
+        compressor,
+        tj_planes,
+        width,
+        src_strides,
+        height,
+        subsamp,
+        &encode_buffer,
+        &encoded_size,
+        quality,
+        TJFLAG_NOREALLOC
+    ) != 0) {
+        return false;
+    }
+
+    out_data = encode_buffer;
+    out_size = encoded_size;
+    return true;
+}
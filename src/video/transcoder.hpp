@@ -0,0 +1,138 @@
+#ifndef TRANSCODER_H
+#define TRANSCODER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <turbojpeg.h>
+
+#include "requantizer.hpp"
+
+// How camera MJPEG frames are converted to the outgoing quality
+enum class TranscodeMode {
+    // Decode to YUV planes and compress them again. Works on any input
+    DECODE,
+    // Rescale the DCT coefficients directly. Much cheaper, but cannot change resolution
+    REQUANTIZE,
+    // Send the camera's frames unchanged. Quality and greyscale settings are ignored
+    PASSTHROUGH
+};
+
+// Parse a mode name from the config ("decode", "requantize", or "passthrough"). Returns false if the name is unknown
+bool parse_transcode_mode(const std::string& name, TranscodeMode* out_mode);
+const char* get_transcode_mode_string(TranscodeMode mode);
+
+// A rectangle of a frame, in pixels. Empty when width is 0
+struct FrameRegion {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+inline bool operator==(const FrameRegion& a, const FrameRegion& b) {
+    return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+}
+inline bool operator!=(const FrameRegion& a, const FrameRegion& b) { return !(a == b); }
+
+struct TranscodeSettings {
+    TranscodeMode mode = TranscodeMode::DECODE;
+    int quality = 30;
+    bool greyscale = false;
+    // Output is 1/scale_denominator of the input size. Anything but 1 forces DECODE mode
+    int scale_denominator = 1;
+    // Send only this part of the frame. JPEG frames are cropped without decoding, so the region
+    // grows to the edges of the blocks around it. Applied before scaling
+    FrameRegion crop;
+    // Keep this part of the frame at detail_quality, and the rest at quality. Only REQUANTIZE mode can, and
+    // other modes ignore it
+    FrameRegion detail;
+    int detail_quality = 0;
+};
+
+// Whether libjpeg-turbo can decode directly at 1/denominator scale
+bool is_supported_scale(int denominator);
+
+// Re-encodes camera frames at a new quality. Holds the JPEG handles and scratch buffers,
+// so each thread that transcodes needs its own Transcoder.
+class Transcoder {
+public:
+    // throws std::runtime_error if the JPEG handles cannot be created
+    Transcoder();
+    ~Transcoder();
+
+    Transcoder(const Transcoder&) = delete;
+    Transcoder& operator=(const Transcoder&) = delete;
+
+    // Allocate buffers for frames of the given size up front, instead of on the first frame
+    void reserve(int width, int height);
+
+    // Returns false if the frame is unreadable. The output is valid until the next call
+    bool transcode(const uint8_t* jpeg, std::size_t len, const TranscodeSettings& settings);
+    // Compress a raw YUYV frame with rows stride bytes apart. The mode is ignored: there is nothing to decode.
+    // Returns false if the frame is short. The output is valid until the next call
+    bool compress_yuyv(const uint8_t* yuyv, std::size_t len, std::size_t stride, int width, int height, const TranscodeSettings& settings);
+
+    inline const uint8_t* data() const { return out_data; }
+    inline std::size_t size() const { return out_size; }
+
+    // Decode a JPEG or repack a YUYV frame into 4:2:0 planes, ex. for a mosaic, at 1/scale_denominator size.
+    // Greyscale frames get neutral chroma. Returns false if the frame is unreadable, or a JPEG is not 4:2:2 or 4:2:0.
+    // The planes are valid until the next call
+    bool decode_i420(const uint8_t* jpeg, std::size_t len, int scale_denominator, bool greyscale);
+    bool yuyv_i420(const uint8_t* yuyv, std::size_t len, std::size_t stride, int width, int height, int scale_denominator, bool greyscale);
+
+    // Compress 4:2:0 planes from elsewhere. Returns false on failure. The output is valid until the next call
+    bool compress_i420(const uint8_t* const planes[3], const int strides[3], int width, int height, int quality);
+
+    inline const uint8_t* plane(int index) const { return planes[index].data(); }
+    inline const int* plane_strides() const { return strides; }
+    inline int frame_width() const { return planes_width; }
+    inline int frame_height() const { return planes_height; }
+
+private:
+    // Losslessly crop a JPEG into crop_buffer
+    bool crop_jpeg(const uint8_t* jpeg, std::size_t len, const FrameRegion& region);
+    bool decode_encode(const uint8_t* jpeg, std::size_t len, const TranscodeSettings& settings);
+    // Fill the planes from a frame, setting planes_width and planes_height. With i420, the planes are always 4:2:0
+    bool decode_planes(const uint8_t* jpeg, std::size_t len, int scale_denominator, bool greyscale, bool i420, int* out_subsamp);
+    bool repack_planes(const uint8_t* yuyv, std::size_t len, std::size_t stride, int width, int height, int scale, bool greyscale, bool i420,
+        const FrameRegion& crop, int* out_subsamp);
+    // Set the 4:2:0 chroma planes to grey
+    void flatten_chroma(int height);
+    // Compress the planes into encode_buffer and make it the output
+    bool encode_planes(int width, int height, int subsamp, int quality);
+    bool compress_planes(const uint8_t* const src_planes[3], const int src_strides[3], int width, int height, int subsamp, int quality);
+    bool reserve_planes(int width, int height, int subsamp);
+    bool reserve_encode_buffer(int width, int height, int subsamp);
+    // Grow a tjAlloc buffer to the worst-case size of a JPEG
+    bool reserve_buffer(unsigned char** buffer, unsigned long* capacity, int width, int height, int subsamp);
+    // Convert 4:2:2 chroma planes to 4:2:0
+    void halve_chroma_rows(int height);
+
+    tjhandle compressor;
+    tjhandle decompressor;
+    tjhandle transformer;
+
+    // Decoded Y, U, and V planes. Sized to the largest frame seen rather than a fixed camera resolution
+    std::vector<uint8_t> planes[3];
+    int strides[3] = { 0, 0, 0 };
+    // Size of the image in the planes
+    int planes_width = 0;
+    int planes_height = 0;
+    unsigned char* encode_buffer = nullptr;
+    unsigned long encode_capacity = 0;
+    // Cropped JPEG, before it is transcoded
+    unsigned char* crop_buffer = nullptr;
+    unsigned long crop_capacity = 0;
+    std::size_t crop_size = 0;
+
+    Requantizer requantizer;
+
+    const uint8_t* out_data = nullptr;
+    std::size_t out_size = 0;
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "yuyv.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Repack the first pixels of an unscaled row pair, 16 at a time. Returns how many were done
+static int repack_rows_vector(const uint8_t* top, const uint8_t* bottom, int width, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v) {
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+    for (; x + 16 <= width; x += 16) {
+        __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + 2 * x));
+        __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + 2 * x + 16));
+        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + 2 * x));
+        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + 2 * x + 16));
+
+        // Luma is every even byte
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y0 + x), _mm_packus_epi16(_mm_and_si128(a0, low_bytes), _mm_and_si128(a1, low_bytes)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y1 + x), _mm_packus_epi16(_mm_and_si128(b0, low_bytes), _mm_and_si128(b1, low_bytes)));
+
+        // Chroma is every odd byte, alternating U and V. Average the rows, then split U from V
+        __m128i uv = _mm_avg_epu8(
+            _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8)),
+            _mm_packus_epi16(_mm_srli_epi16(b0, 8), _mm_srli_epi16(b1, 8)));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(u + x / 2), _mm_packus_epi16(_mm_and_si128(uv, low_bytes), _mm_setzero_si128()));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(v + x / 2), _mm_packus_epi16(_mm_srli_epi16(uv, 8), _mm_setzero_si128()));
+    }
+#elif defined(__ARM_NEON)
+    for (; x + 16 <= width; x += 16) {
+        // De-interleaves into even Y, U, odd Y, and V lanes
+        uint8x8x4_t a = vld4_u8(top + 2 * x);
+        uint8x8x4_t b = vld4_u8(bottom + 2 * x);
+
+        uint8x8x2_t luma_top = { { a.val[0], a.val[2] } };
+        uint8x8x2_t luma_bottom = { { b.val[0], b.val[2] } };
+        vst2_u8(y0 + x, luma_top);
+        vst2_u8(y1 + x, luma_bottom);
+
+        vst1_u8(u + x / 2, vrhadd_u8(a.val[1], b.val[1]));
+        vst1_u8(v + x / 2, vrhadd_u8(a.val[3], b.val[3]));
+    }
+#else
+    (void) top; (void) bottom; (void) width; (void) y0; (void) y1; (void) u; (void) v;
+#endif
+    return x;
+}
+
+void yuyv_to_i420(const uint8_t* src, std::size_t src_stride, int width, int height, int scale,
+        uint8_t* y, int y_stride, uint8_t* u, int u_stride, uint8_t* v, int v_stride) {
+    int out_width = yuyv_scaled_size(width, scale);
+    int out_height = yuyv_scaled_size(height, scale);
+
+    for (int row = 0; row < out_height; row += 2) {
+        // With an odd height, the last row pairs with itself, which also fills the padding row
+        int bottom_row = (row + 1 < out_height) ? row + 1 : row;
+        const uint8_t* top = src + static_cast<std::size_t>(row) * scale * src_stride;
+        const uint8_t* bottom = src + static_cast<std::size_t>(bottom_row) * scale * src_stride;
+        uint8_t* y0 = y + static_cast<std::size_t>(row) * y_stride;
+        uint8_t* y1 = y0 + y_stride;
+        uint8_t* u_row = u + static_cast<std::size_t>(row / 2) * u_stride;
+        uint8_t* v_row = v + static_cast<std::size_t>(row / 2) * v_stride;
+
+        int x = (scale == 1) ? repack_rows_vector(top, bottom, width, y0, y1, u_row, v_row) : 0;
+        for (; x < out_width; x++) {
+            // Even output pixels start a YUYV pair at every scale, so their chroma follows them
+            std::size_t pair = 2 * static_cast<std::size_t>(x) * scale;
+            y0[x] = top[pair];
+            y1[x] = bottom[pair];
+            if (x % 2 == 0) {
+                u_row[x / 2] = static_cast<uint8_t>((top[pair + 1] + bottom[pair + 1] + 1) >> 1);
+                v_row[x / 2] = static_cast<uint8_t>((top[pair + 3] + bottom[pair + 3] + 1) >> 1);
+            }
+        }
+    }
+}
+
+void yuyv_to_grey(const uint8_t* src, std::size_t src_stride, int width, int height, int scale, uint8_t* y, int y_stride) {
+    int out_width = yuyv_scaled_size(width, scale);
+    int out_height = yuyv_scaled_size(height, scale);
+
+    for (int row = 0; row < out_height; row++) {
+        const uint8_t* in = src + static_cast<std::size_t>(row) * scale * src_stride;
+        uint8_t* out = y + static_cast<std::size_t>(row) * y_stride;
+
+        int x = 0;
+#if defined(__SSE2__)
+        if (scale == 1) {
+            const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+            for (; x + 16 <= width; x += 16) {
+                __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * x));
+                __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * x + 16));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(_mm_and_si128(a0, low_bytes), _mm_and_si128(a1, low_bytes)));
+            }
+        }
+#elif defined(__ARM_NEON)
+        if (scale == 1) {
+            for (; x + 16 <= width; x += 16) {
+                vst1q_u8(out + x, vld2q_u8(in + 2 * x).val[0]);
+            }
+        }
+#endif
+        for (; x < out_width; x++) {
+            out[x] = in[2 * static_cast<std::size_t>(x) * scale];
+        }
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef YUYV_H
+#define YUYV_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Output size of a width x height YUYV frame reduced by 1/scale
+inline int yuyv_scaled_size(int size, int scale) { return (size + scale - 1) / scale; }
+
+// Repack a packed YUYV (4:2:2) frame into Y, U, and V planes for 4:2:0 compression,
+// keeping every scale'th pixel of every scale'th row. Chroma is averaged over each pair of output rows.
+// Width must be even. The planes are sized as tjPlaneWidth/tjPlaneHeight give for TJSAMP_420:
+// with an odd output height, the last row is repeated into the padding row of the Y plane.
+// The unscaled repack is vectorized with SSE2 or NEON when available
+void yuyv_to_i420(const uint8_t* src, std::size_t src_stride, int width, int height, int scale,
+    uint8_t* y, int y_stride, uint8_t* u, int u_stride, uint8_t* v, int v_stride);
+
+// Extract the Y plane, keeping every scale'th pixel of every scale'th row
+void yuyv_to_grey(const uint8_t* src, std::size_t src_stride, int width, int height, int scale, uint8_t* y, int y_stride);
+
+#endif